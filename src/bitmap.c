@@ -0,0 +1,807 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Reachability bitmaps, in git's .bitmap format so that git can use them
+ * too. A bitmap has one bit per object of a packfile, in pack order, set
+ * for each object reachable from a commit. The file holds, after a header,
+ * one bitmap per object type and then the bitmaps of the selected commits,
+ * each naming its commit by its position in the .idx; a bitmap may be
+ * stored XORed with one of the entries before it. All bitmaps are EWAH
+ * compressed (see ewah.c).
+ * Objects are reached through the object database; a walk stops at any
+ * commit that has a bitmap of its own and ORs that bitmap in instead. */
+
+#define KGIT_BITMAP_VERSION    1
+#define KGIT_BITMAP_FULL_DAG   0x1
+#define KGIT_BITMAP_HEADER     (8 + 4 + GIT_OID_RAWSZ)
+#define KGIT_BITMAP_XOR_MAX    160
+
+typedef struct kgit_bitmapentry {
+	uint32_t pos;          /* position of the commit in the .idx */
+	kgit_bitmap bitmap;
+} kgit_bitmapentry;
+
+typedef struct kgit_bitmapindex {
+	git_odb *odb;
+	kgit_packidx pidx;
+	uint32_t *order;       /* .idx position of each object, in pack order */
+	uint32_t *rank;        /* pack order of each object, by .idx position */
+	kgit_bitmapentry *entries;
+	size_t nentries;       /* entries, sorted by position once loaded */
+} kgit_bitmapindex;
+
+static int kgit_bitmapentry_cmp(const void *a, const void *b)
+{
+	const kgit_bitmapentry *x = (const kgit_bitmapentry *)a, *y = (const kgit_bitmapentry *)b;
+	return (x->pos < y->pos) ? -1 : (x->pos > y->pos);
+}
+
+static void kgit_bitmapindex_free(kgit_bitmapindex *bi)
+{
+	size_t i;
+	for (i = 0; i < bi->nentries; i++) {
+		kgit_bitmap_free(&bi->entries[i].bitmap);
+	}
+	free(bi->entries);
+	free(bi->order);
+	free(bi->rank);
+	kgit_packidx_close(&bi->pidx);
+}
+
+/* Path of the file next to 'pack_path' with 'ext' instead of ".pack" */
+static char *kgit_pack_ext(const char *pack_path, const char *ext)
+{
+	size_t len = strlen(pack_path);
+	char *path;
+	if (len < 5 || strcmp(pack_path + len - 5, ".pack") != 0) {
+		return NULL;
+	}
+	if ((path = (char *)malloc(len - 5 + strlen(ext) + 1)) != NULL) {
+		memcpy(path, pack_path, len - 5);
+		strcpy(path + len - 5, ext);
+	}
+	return path;
+}
+
+typedef struct kgit_rank {
+	uint64_t offset;
+	uint32_t pos;
+} kgit_rank;
+
+static int kgit_rank_cmp(const void *a, const void *b)
+{
+	const kgit_rank *x = (const kgit_rank *)a, *y = (const kgit_rank *)b;
+	return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+/* Open the .idx of a pack and work out its pack order. */
+static int kgit_bitmapindex_open(kgit_bitmapindex *bi, git_repository *repo, const char *pack_path)
+{
+	char *idx_path = kgit_pack_ext(pack_path, ".idx");
+	kgit_rank *ranks;
+	uint32_t i;
+	int error;
+	memset(bi, 0, sizeof(kgit_bitmapindex));
+	if (idx_path == NULL) {
+		return GIT_EINVALIDARGS;
+	}
+	error = kgit_packidx_open(&bi->pidx, idx_path);
+	free(idx_path);
+	if (error < GIT_SUCCESS) {
+		return error;
+	}
+	bi->odb = git_repository_database(repo);
+	bi->order = (uint32_t *)malloc((bi->pidx.n + 1) * sizeof(uint32_t));
+	bi->rank = (uint32_t *)malloc((bi->pidx.n + 1) * sizeof(uint32_t));
+	ranks = (kgit_rank *)malloc((bi->pidx.n + 1) * sizeof(kgit_rank));
+	if (bi->order == NULL || bi->rank == NULL || ranks == NULL) {
+		free(ranks);
+		kgit_bitmapindex_free(bi);
+		return GIT_ENOMEM;
+	}
+	for (i = 0; i < bi->pidx.n; i++) {
+		ranks[i].offset = kgit_packidx_offset(&bi->pidx, i);
+		ranks[i].pos = i;
+	}
+	qsort(ranks, bi->pidx.n, sizeof(kgit_rank), kgit_rank_cmp);
+	for (i = 0; i < bi->pidx.n; i++) {
+		bi->order[i] = ranks[i].pos;
+		bi->rank[ranks[i].pos] = i;
+	}
+	free(ranks);
+	return GIT_SUCCESS;
+}
+
+/* Load the .bitmap of a pack opened with kgit_bitmapindex_open(). */
+static int kgit_bitmapindex_load(kgit_bitmapindex *bi, const char *pack_path)
+{
+	char *path = kgit_pack_ext(pack_path, ".bitmap");
+	unsigned char *data = NULL;
+	size_t mapped = 0, size, off, i, n;
+	int error = GIT_EOBJCORRUPTED;
+	if (path == NULL || (data = kgit_mapfile(path, &mapped)) == NULL) {
+		free(path);
+		return GIT_ENOTFOUND;
+	}
+	free(path);
+	if (mapped < KGIT_BITMAP_HEADER + GIT_OID_RAWSZ || memcmp(data, "BITM", 4) != 0
+			|| (data[4] << 8 | data[5]) != KGIT_BITMAP_VERSION
+			|| memcmp(data + 12, bi->pidx.pack_checksum.id, GIT_OID_RAWSZ) != 0) {
+		goto cleanup;
+	}
+	n = kgit_be32(data + 8);
+	off = KGIT_BITMAP_HEADER;
+	/* the trailing checksum is not part of the bitmaps */
+	size = mapped - GIT_OID_RAWSZ;
+	for (i = 0; i < 4; i++) {
+		/* the type bitmaps are not used */
+		kgit_bitmap bitmap;
+		long used = kgit_ewah_read(&bitmap, data + off, size - off);
+		if (used < 0) {
+			goto cleanup;
+		}
+		kgit_bitmap_free(&bitmap);
+		off += (size_t)used;
+	}
+	if (n > bi->pidx.n || (bi->entries = (kgit_bitmapentry *)calloc(n + 1, sizeof(kgit_bitmapentry))) == NULL) {
+		error = (n > bi->pidx.n) ? GIT_EOBJCORRUPTED : GIT_ENOMEM;
+		goto cleanup;
+	}
+	for (i = 0; i < n; i++) {
+		kgit_bitmapentry *e = &bi->entries[i];
+		unsigned int xor;
+		long used;
+		if (size - off < 6) {
+			goto cleanup;
+		}
+		e->pos = kgit_be32(data + off);
+		xor = data[off + 4];
+		off += 6;
+		used = kgit_ewah_read(&e->bitmap, data + off, size - off);
+		if (used < 0) {
+			goto cleanup;
+		}
+		bi->nentries++;
+		off += (size_t)used;
+		/* git rounds the bit count up to whole words */
+		if (e->pos >= bi->pidx.n || xor > KGIT_BITMAP_XOR_MAX || xor > i
+				|| KGIT_BITMAP_WORDS(e->bitmap.nbits) > KGIT_BITMAP_WORDS(bi->pidx.n)
+				|| kgit_bitmap_grow(&e->bitmap, bi->pidx.n) < GIT_SUCCESS) {
+			goto cleanup;
+		}
+		if (xor > 0) {
+			kgit_bitmap_xor(&e->bitmap, &bi->entries[i - xor].bitmap);
+		}
+		e->bitmap.nbits = bi->pidx.n;
+		if (bi->pidx.n % 64 != 0) {
+			e->bitmap.words[bi->pidx.n / 64] &= ((uint64_t)1 << (bi->pidx.n % 64)) - 1;
+		}
+	}
+	qsort(bi->entries, bi->nentries, sizeof(kgit_bitmapentry), kgit_bitmapentry_cmp);
+	error = GIT_SUCCESS;
+
+cleanup:
+	munmap(data, mapped);
+	return error;
+}
+
+static const kgit_bitmap *kgit_bitmapindex_lookup(const kgit_bitmapindex *bi, uint32_t pos)
+{
+	kgit_bitmapentry key;
+	key.pos = pos;
+	const kgit_bitmapentry *e = (const kgit_bitmapentry *)bsearch(&key, bi->entries, bi->nentries, sizeof(kgit_bitmapentry), kgit_bitmapentry_cmp);
+	return (e != NULL) ? &e->bitmap : NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+
+typedef struct kgit_oidstack {
+	git_oid *ptr;
+	size_t size;
+	size_t capacity;
+} kgit_oidstack;
+
+static int kgit_oidstack_push(kgit_oidstack *stack, const char *hex)
+{
+	char buf[GIT_OID_HEXSZ + 1];
+	if (stack->size == stack->capacity) {
+		size_t capacity = (stack->capacity == 0) ? 64 : stack->capacity * 2;
+		git_oid *ptr = (git_oid *)realloc(stack->ptr, capacity * sizeof(git_oid));
+		if (ptr == NULL) {
+			return GIT_ENOMEM;
+		}
+		stack->ptr = ptr;
+		stack->capacity = capacity;
+	}
+	memcpy(buf, hex, GIT_OID_HEXSZ);
+	buf[GIT_OID_HEXSZ] = '\0';
+	if (git_oid_fromstr(&stack->ptr[stack->size], buf) < GIT_SUCCESS) {
+		return GIT_EOBJCORRUPTED;
+	}
+	stack->size++;
+	return GIT_SUCCESS;
+}
+
+/* The objects outside the pack a non-strict walk has read. They have no
+ * bit to mark them, so this keeps a merge from reading them twice. */
+typedef struct kgit_oidset {
+	git_oid *slots;
+	size_t size;
+	size_t mask;
+} kgit_oidset;
+
+static int kgit_oidset_isempty(const git_oid *oid)
+{
+	static const git_oid zero;
+	return memcmp(oid->id, zero.id, GIT_OID_RAWSZ) == 0;
+}
+
+/* Add 'oid' to the set: 1 when it is new, 0 when it was there already */
+static int kgit_oidset_add(kgit_oidset *set, const git_oid *oid)
+{
+	size_t i;
+	if ((set->size + 1) * 2 > set->mask) {
+		size_t mask = (set->mask == 0) ? 63 : set->mask * 2 + 1;
+		git_oid *slots = (git_oid *)calloc(mask + 1, sizeof(git_oid));
+		if (slots == NULL) {
+			return GIT_ENOMEM;
+		}
+		for (i = 0; set->mask != 0 && i <= set->mask; i++) {
+			if (!kgit_oidset_isempty(&set->slots[i])) {
+				size_t j = kgit_be32(set->slots[i].id) & mask;
+				while (!kgit_oidset_isempty(&slots[j])) {
+					j = (j + 1) & mask;
+				}
+				slots[j] = set->slots[i];
+			}
+		}
+		free(set->slots);
+		set->slots = slots;
+		set->mask = mask;
+	}
+	for (i = kgit_be32(oid->id) & set->mask; !kgit_oidset_isempty(&set->slots[i]); i = (i + 1) & set->mask) {
+		if (git_oid_cmp(&set->slots[i], oid) == 0) {
+			return 0;
+		}
+	}
+	set->slots[i] = *oid;
+	set->size++;
+	return 1;
+}
+
+/* Position of an object in pack order, or -1 when it is not in the pack */
+static long kgit_bitmapindex_rank(const kgit_bitmapindex *bi, const git_oid *oid)
+{
+	long i = kgit_packidx_find(&bi->pidx, oid);
+	return (i < 0) ? -1 : (long)bi->rank[i];
+}
+
+/* Queue the objects a commit, tree or tag points to. Blobs are marked
+ * right away, as there is nothing to read from them. */
+static int kgit_bitmap_children(const kgit_bitmapindex *bi, kgit_bitmap *reach, kgit_oidstack *stack, int strict,
+		git_otype type, const char *data, size_t size)
+{
+	const char *p = data, *end = data + size;
+	int error = GIT_SUCCESS;
+	if (type == GIT_OBJ_COMMIT || type == GIT_OBJ_TAG) {
+		const char *key = (type == GIT_OBJ_COMMIT) ? "tree " : "object ";
+		size_t keylen = strlen(key);
+		while (error == GIT_SUCCESS && (size_t)(end - p) > keylen + GIT_OID_HEXSZ && memcmp(p, key, keylen) == 0) {
+			error = kgit_oidstack_push(stack, p + keylen);
+			p += keylen + GIT_OID_HEXSZ + 1;
+			key = "parent ";
+			keylen = 7;
+		}
+	} else if (type == GIT_OBJ_TREE) {
+		while (error == GIT_SUCCESS && p < end) {
+			const char *nul = (const char *)memchr(p, '\0', end - p);
+			unsigned int attr = (unsigned int)strtoul(p, NULL, 8);
+			git_oid oid;
+			if (nul == NULL || end - nul - 1 < GIT_OID_RAWSZ) {
+				return GIT_EOBJCORRUPTED;
+			}
+			git_oid_fromraw(&oid, (const unsigned char *)nul + 1);
+			p = nul + 1 + GIT_OID_RAWSZ;
+			if (GIT_ATTR_ISDIR(attr)) {
+				char hex[GIT_OID_HEXSZ];
+				git_oid_fmt(hex, &oid);
+				error = kgit_oidstack_push(stack, hex);
+			} else if ((attr & 0170000) != 0160000) {
+				/* a blob; submodule commits are not in this repository */
+				long pos = kgit_bitmapindex_rank(bi, &oid);
+				if (pos >= 0) {
+					kgit_bitmap_set(reach, (size_t)pos);
+				} else if (strict) {
+					error = GIT_ENOTFOUND;
+				}
+			}
+		}
+	}
+	return error;
+}
+
+/* Mark in 'reach' every object reachable from 'tip'. An object missing
+ * from the pack fails the walk with GIT_ENOTFOUND when 'strict' is set.
+ * Otherwise it is read from the object database, when it is there, and
+ * the walk goes on through it to the objects of the pack it reaches. */
+static int kgit_bitmap_walk(const kgit_bitmapindex *bi, kgit_bitmap *reach, const git_oid *tip, int strict)
+{
+	kgit_oidstack stack = {NULL, 0, 0};
+	kgit_oidset outside = {NULL, 0, 0};
+	char hex[GIT_OID_HEXSZ];
+	int error;
+	git_oid_fmt(hex, tip);
+	error = kgit_oidstack_push(&stack, hex);
+	while (error == GIT_SUCCESS && stack.size > 0) {
+		git_oid oid = stack.ptr[--stack.size];
+		long i = kgit_packidx_find(&bi->pidx, &oid);
+		const kgit_bitmap *bitmap;
+		git_odb_object *obj;
+		if (i < 0) {
+			if (strict) {
+				error = GIT_ENOTFOUND;
+				break;
+			}
+			if ((error = kgit_oidset_add(&outside, &oid)) <= 0) {
+				continue;
+			}
+			if ((error = git_odb_read(&obj, bi->odb, &oid)) < GIT_SUCCESS) {
+				/* not in this repository at all */
+				error = (error == GIT_ENOTFOUND) ? GIT_SUCCESS : error;
+				continue;
+			}
+		} else if (kgit_bitmap_get(reach, bi->rank[i])) {
+			continue;
+		} else if ((bitmap = kgit_bitmapindex_lookup(bi, (uint32_t)i)) != NULL) {
+			kgit_bitmap_or(reach, bitmap);
+			continue;
+		} else {
+			kgit_bitmap_set(reach, bi->rank[i]);
+			if ((error = git_odb_read(&obj, bi->odb, &oid)) < GIT_SUCCESS) {
+				break;
+			}
+		}
+		error = kgit_bitmap_children(bi, reach, &stack, strict, git_odb_object_type(obj),
+				(const char *)git_odb_object_data(obj), git_odb_object_size(obj));
+		git_odb_object_close(obj);
+	}
+	free(stack.ptr);
+	free(outside.slots);
+	return error;
+}
+
+/* Mark the objects reachable from any of the GitOids in 'tips'. */
+static int kgit_bitmap_reach(const kgit_bitmapindex *bi, kgit_bitmap *reach, kArray *tips, int strict)
+{
+	size_t i, n = knh_Array_size(tips);
+	int error = kgit_bitmap_init(reach, bi->pidx.n);
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		const git_oid *oid = (const git_oid *)tips->ptrs[i]->rawptr;
+		error = (oid != NULL) ? kgit_bitmap_walk(bi, reach, oid, strict) : GIT_EINVALIDARGS;
+	}
+	if (error < GIT_SUCCESS) {
+		kgit_bitmap_free(reach);
+	}
+	return error;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Bitmaps of the objects of each type, as git stores them first. */
+static int kgit_bitmap_types(const kgit_bitmapindex *bi, const char *pack_path, kgit_bitmap types[4])
+{
+	size_t size, p, n = bi->pidx.n, left = n, before;
+	unsigned char *data = kgit_mapfile(pack_path, &size);
+	int *type = (int *)calloc(n + 1, sizeof(int));
+	int error = GIT_SUCCESS;
+	if (data == NULL || type == NULL) {
+		free(type);
+		if (data != NULL) {
+			munmap(data, size);
+		}
+		return (data == NULL) ? GIT_ENOTFOUND : GIT_ENOMEM;
+	}
+	do {
+		/* a REF_DELTA may come before its base; loop until all are typed */
+		before = left;
+		for (p = 0; p < n && error == GIT_SUCCESS; p++) {
+			uint64_t off = kgit_packidx_offset(&bi->pidx, bi->order[p]);
+			uint64_t end = (p + 1 < n) ? kgit_packidx_offset(&bi->pidx, bi->order[p + 1]) : size - GIT_OID_RAWSZ;
+			kgit_packentry e;
+			long base = -1;
+			if (type[p] != 0) {
+				continue;
+			}
+			if (end <= off || end > size || kgit_pack_header(&e, data + off, (size_t)(end - off), off) == 0) {
+				error = GIT_EOBJCORRUPTED;
+				break;
+			}
+			if (e.type == GIT_OBJ_REF_DELTA) {
+				base = kgit_bitmapindex_rank(bi, &e.base_oid);
+			} else if (e.type == GIT_OBJ_OFS_DELTA) {
+				size_t lo = 0, hi = p;
+				while (lo < hi) {
+					size_t mid = lo + (hi - lo) / 2;
+					if (kgit_packidx_offset(&bi->pidx, bi->order[mid]) < e.base_offset) {
+						lo = mid + 1;
+					} else {
+						hi = mid;
+					}
+				}
+				if (lo == p || kgit_packidx_offset(&bi->pidx, bi->order[lo]) != e.base_offset) {
+					error = GIT_EOBJCORRUPTED;
+					break;
+				}
+				base = (long)lo;
+			}
+			if (!kgit_pack_isdelta(e.type)) {
+				type[p] = e.type;
+			} else if (base >= 0 && (size_t)base < n) {
+				type[p] = type[base];
+			}
+			left -= (type[p] != 0);
+		}
+	} while (error == GIT_SUCCESS && left > 0 && left < before);
+	munmap(data, size);
+	if (error == GIT_SUCCESS && left > 0) {
+		/* a thin pack, whose bases live outside of it */
+		error = GIT_EOBJCORRUPTED;
+	}
+	for (p = 0; p < 4 && error == GIT_SUCCESS; p++) {
+		error = kgit_bitmap_init(&types[p], n);
+	}
+	for (p = 0; p < n && error == GIT_SUCCESS; p++) {
+		kgit_bitmap_set(&types[type[p] - GIT_OBJ_COMMIT], p);
+	}
+	free(type);
+	return error;
+}
+
+typedef struct kgit_selected {
+	git_oid oid;
+	uint32_t pos;
+	long time;
+} kgit_selected;
+
+static int kgit_selected_cmp(const void *a, const void *b)
+{
+	const kgit_selected *x = (const kgit_selected *)a, *y = (const kgit_selected *)b;
+	if (x->time != y->time) {
+		return (x->time < y->time) ? -1 : 1;
+	}
+	return (x->pos < y->pos) ? -1 : (x->pos > y->pos);
+}
+
+/* Commit time of a raw commit, used to compute ancestors first */
+static long kgit_commit_time(const char *data, size_t size)
+{
+	const char *p = data, *end = data + size;
+	while (p < end && *p != '\n') {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			break;
+		}
+		if (eol - p > 10 && memcmp(p, "committer ", 10) == 0) {
+			const char *gt = p;
+			while (gt < eol && *gt != '>') {
+				gt++;
+			}
+			return (gt < eol) ? strtol(gt + 1, NULL, 10) : 0;
+		}
+		p = eol + 1;
+	}
+	return 0;
+}
+
+/* Build the bitmaps of the commits in 'commits' that are in the pack and
+ * whose history is all in it, and write them to the .bitmap of the pack,
+ * if there are any. Returns the number of commits with a bitmap, or an
+ * error. */
+static long kgit_bitmap_write(git_repository *repo, const char *pack_path, kArray *commits, const char **msg)
+{
+	kgit_bitmapindex bi;
+	kgit_selected *selected;
+	kgit_bitmap types[4];
+	kgit_buf buf = {NULL, 0, 0};
+	unsigned char b[6];
+	size_t i, nselected = 0, n = knh_Array_size(commits);
+	char *path = NULL;
+	int error;
+	memset(types, 0, sizeof(types));
+	*msg = "cannot read the index of the pack";
+	if ((error = kgit_bitmapindex_open(&bi, repo, pack_path)) < GIT_SUCCESS) {
+		return error;
+	}
+	*msg = "out of memory";
+	selected = (kgit_selected *)malloc((n + 1) * sizeof(kgit_selected));
+	bi.entries = (kgit_bitmapentry *)calloc(n + 1, sizeof(kgit_bitmapentry));
+	error = (selected != NULL && bi.entries != NULL) ? GIT_SUCCESS : GIT_ENOMEM;
+	*msg = "cannot read commit";
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		const git_oid *oid = (const git_oid *)commits->ptrs[i]->rawptr;
+		long pos = (oid != NULL) ? kgit_packidx_find(&bi.pidx, oid) : -1;
+		git_odb_object *obj;
+		if (pos < 0 || git_odb_read(&obj, bi.odb, oid) < GIT_SUCCESS) {
+			continue;
+		}
+		if (git_odb_object_type(obj) == GIT_OBJ_COMMIT) {
+			kgit_selected *s = &selected[nselected++];
+			git_oid_cpy(&s->oid, oid);
+			s->pos = (uint32_t)pos;
+			s->time = kgit_commit_time((const char *)git_odb_object_data(obj), git_odb_object_size(obj));
+		}
+		git_odb_object_close(obj);
+	}
+	if (error == GIT_SUCCESS) {
+		qsort(selected, nselected, sizeof(kgit_selected), kgit_selected_cmp);
+	}
+	*msg = "cannot walk commit";
+	for (i = 0; i < nselected && error == GIT_SUCCESS; i++) {
+		kgit_bitmapentry *e = &bi.entries[bi.nentries];
+		if (i > 0 && selected[i].pos == selected[i - 1].pos) {
+			continue;
+		}
+		if ((error = kgit_bitmap_init(&e->bitmap, bi.pidx.n)) < GIT_SUCCESS) {
+			break;
+		}
+		error = kgit_bitmap_walk(&bi, &e->bitmap, &selected[i].oid, 1);
+		if (error == GIT_ENOTFOUND) {
+			/* some of its history is in other packs */
+			kgit_bitmap_free(&e->bitmap);
+			error = GIT_SUCCESS;
+			continue;
+		}
+		if (error == GIT_SUCCESS) {
+			/* keep the entries sorted for the walks that follow */
+			size_t j = bi.nentries++;
+			kgit_bitmapentry tmp = *e;
+			while (j > 0 && bi.entries[j - 1].pos > tmp.pos) {
+				bi.entries[j] = bi.entries[j - 1];
+				j--;
+			}
+			e = &bi.entries[j];
+			e->pos = selected[i].pos;
+			e->bitmap = tmp.bitmap;
+		}
+	}
+	if (error == GIT_SUCCESS && bi.nentries == 0) {
+		/* git uses a single .bitmap; do not shadow a useful one */
+		goto cleanup;
+	}
+	if (error == GIT_SUCCESS) {
+		*msg = "cannot read packfile";
+		error = kgit_bitmap_types(&bi, pack_path, types);
+	}
+	if (error == GIT_SUCCESS) {
+		*msg = "cannot write bitmap";
+		b[0] = 0;
+		b[1] = KGIT_BITMAP_VERSION;
+		b[2] = 0;
+		b[3] = KGIT_BITMAP_FULL_DAG;
+		if ((error = kgit_buf_put(&buf, "BITM", 4)) == GIT_SUCCESS && (error = kgit_buf_put(&buf, b, 4)) == GIT_SUCCESS) {
+			kgit_put_be32(b, (uint32_t)bi.nentries);
+			error = kgit_buf_put(&buf, b, 4);
+		}
+		if (error == GIT_SUCCESS) {
+			error = kgit_buf_put(&buf, bi.pidx.pack_checksum.id, GIT_OID_RAWSZ);
+		}
+		for (i = 0; i < 4 && error == GIT_SUCCESS; i++) {
+			error = kgit_ewah_write(&buf, &types[i]);
+		}
+		for (i = 0; i < bi.nentries && error == GIT_SUCCESS; i++) {
+			kgit_put_be32(b, bi.entries[i].pos);
+			b[4] = 0;  /* not XORed */
+			b[5] = 0;
+			if ((error = kgit_buf_put(&buf, b, 6)) == GIT_SUCCESS) {
+				error = kgit_ewah_write(&buf, &bi.entries[i].bitmap);
+			}
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		kgit_sha1_ctx sha1;
+		git_oid checksum;
+		kgit_sha1_init(&sha1);
+		kgit_sha1_update(&sha1, buf.ptr, buf.size);
+		kgit_sha1_final(&checksum, &sha1);
+		error = kgit_buf_put(&buf, checksum.id, GIT_OID_RAWSZ);
+	}
+	if (error == GIT_SUCCESS) {
+		path = kgit_pack_ext(pack_path, ".bitmap");
+		error = (path != NULL) ? kgit_writefile(path, buf.ptr, buf.size) : GIT_ENOMEM;
+	}
+
+cleanup:
+	n = bi.nentries;
+	free(path);
+	free(buf.ptr);
+	free(selected);
+	for (i = 0; i < 4; i++) {
+		kgit_bitmap_free(&types[i]);
+	}
+	kgit_bitmapindex_free(&bi);
+	return (error < GIT_SUCCESS) ? error : (long)n;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void kGitBitmap_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitBitmap_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_bitmapindex_free((kgit_bitmapindex *)po->rawptr);
+		KNH_FREE(ctx, po->rawptr, sizeof(kgit_bitmapindex));
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitBitmap(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitBitmap";
+	cdef->init = kGitBitmap_init;
+	cdef->free = kGitBitmap_free;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Count the objects of the pack reachable from the given commits, or -1
+ * when some of the objects they reach are not in the pack */
+//## @Native int GitBitmap.count(Array<GitOid> tips);
+KMETHOD GitBitmap_count(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_bitmapindex *bi = RawPtr_to(kgit_bitmapindex *, sfp[0]);
+	kgit_bitmap reach;
+	int error = kgit_bitmap_reach(bi, &reach, sfp[1].a, 1);
+	if (error < GIT_SUCCESS) {
+		KNH_NTRACE2(ctx, "git_bitmap_count", K_FAILED, KNH_LDATA(LOG_i("errno", error)));
+		RETURNi_(-1);
+	}
+	size_t n = kgit_bitmap_count(&reach);
+	kgit_bitmap_free(&reach);
+	RETURNi_(n);
+}
+
+/* Count the objects a fetch of 'wants' needs when it already has 'haves':
+ * those reachable from 'wants' but not from 'haves'. The history of
+ * 'wants' must be in the pack; that of 'haves' may leave it. */
+//## @Native int GitBitmap.countMissing(Array<GitOid> wants, Array<GitOid> haves);
+KMETHOD GitBitmap_countMissing(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_bitmapindex *bi = RawPtr_to(kgit_bitmapindex *, sfp[0]);
+	kgit_bitmap want, have;
+	int error = kgit_bitmap_reach(bi, &want, sfp[1].a, 1);
+	if (error == GIT_SUCCESS && (error = kgit_bitmap_reach(bi, &have, sfp[2].a, 0)) < GIT_SUCCESS) {
+		kgit_bitmap_free(&want);
+	}
+	if (error < GIT_SUCCESS) {
+		KNH_NTRACE2(ctx, "git_bitmap_count", K_FAILED, KNH_LDATA(LOG_i("errno", error)));
+		RETURNi_(-1);
+	}
+	kgit_bitmap_andnot(&want, &have);
+	size_t n = kgit_bitmap_count(&want);
+	kgit_bitmap_free(&want);
+	kgit_bitmap_free(&have);
+	RETURNi_(n);
+}
+
+/* Free the bitmap index */
+//## @Native void GitBitmap.free();
+KMETHOD GitBitmap_free(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kGitBitmap_free(ctx, sfp[0].p);
+	RETURNvoid_();
+}
+
+/* List the ids of the objects counted by countMissing(), in pack order */
+//## @Native Array<GitOid> GitBitmap.missing(Array<GitOid> wants, Array<GitOid> haves);
+KMETHOD GitBitmap_missing(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_bitmapindex *bi = RawPtr_to(kgit_bitmapindex *, sfp[0]);
+	kgit_bitmap want, have;
+	size_t p;
+	int error = kgit_bitmap_reach(bi, &want, sfp[1].a, 1);
+	if (error == GIT_SUCCESS && (error = kgit_bitmap_reach(bi, &have, sfp[2].a, 0)) < GIT_SUCCESS) {
+		kgit_bitmap_free(&want);
+	}
+	if (error < GIT_SUCCESS) {
+		KNH_NTRACE2(ctx, "git_bitmap_missing", K_FAILED, KNH_LDATA(LOG_i("errno", error)));
+		RETURN_(KNH_NULL);
+	}
+	kgit_bitmap_andnot(&want, &have);
+	kArray *a = new_Array(ctx, knh_getcid(ctx, STEXT("GitOid")), kgit_bitmap_count(&want));
+	for (p = 0; p < bi->pidx.n; p++) {
+		if (kgit_bitmap_get(&want, p)) {
+			git_oid oid;
+			git_oid_fromraw(&oid, bi->pidx.ids + (size_t)bi->order[p] * GIT_OID_RAWSZ);
+			knh_Array_add(ctx, a, new_GitOid(ctx, &oid));
+		}
+	}
+	kgit_bitmap_free(&want);
+	kgit_bitmap_free(&have);
+	RETURN_(a);
+}
+
+/* Open the bitmaps of a packfile. Commits without a bitmap are walked
+ * through the repository until they reach commits with one. */
+//## @Native @Static GitBitmap GitBitmap.open(GitRepository repo, Path pack);
+KMETHOD GitBitmap_open(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	const char *pack_path = sfp[2].pth->ospath;
+	kgit_bitmapindex *bi = (kgit_bitmapindex *)KNH_MALLOC(ctx, sizeof(kgit_bitmapindex));
+	int error = kgit_bitmapindex_open(bi, repo, pack_path);
+	if (error == GIT_SUCCESS && (error = kgit_bitmapindex_load(bi, pack_path)) < GIT_SUCCESS) {
+		kgit_bitmapindex_free(bi);
+	}
+	if (error < GIT_SUCCESS) {
+		KNH_FREE(ctx, bi, sizeof(kgit_bitmapindex));
+		KNH_NTRACE2(ctx, "git_bitmap_open", K_FAILED, KNH_LDATA(LOG_i("errno", error), LOG_s("path", pack_path)));
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, bi));
+}
+
+/* Build reachability bitmaps for the given commits and write them next to
+ * the packfile, with a .bitmap extension. Commits that are not in the pack,
+ * or whose history is partly in other packs, are skipped; no file is
+ * written when none is left. Returns the number of commits with a bitmap,
+ * or -1 on error. */
+//## @Native @Static int GitBitmap.write(GitRepository repo, Path pack, Array<GitOid> commits);
+KMETHOD GitBitmap_write(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	const char *msg;
+	long n = kgit_bitmap_write(repo, sfp[2].pth->ospath, sfp[3].a, &msg);
+	if (n < GIT_SUCCESS) {
+		KNH_NTRACE2(ctx, "git_bitmap_write", K_FAILED, KNH_LDATA(LOG_i("errno", n), LOG_msg(msg)));
+		RETURNi_(-1);
+	}
+	RETURNi_(n);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,528 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* The cache-tree remembers, for each directory of the index, the id of the
+ * tree object last written for it and how many index entries it covers. A
+ * node whose entry_count is -1 has been invalidated by a change below it.
+ * Writing a tree from the index only rebuilds invalid directories. The same
+ * structure is read from and written to the TREE extension of the index
+ * file, so it survives between processes. */
+
+#define KGIT_INDEX_HEADER   12
+#define KGIT_INDEX_ENTRY    62
+
+uint32_t kgit_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+void kgit_put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+/* Return the offset of the first extension of an index file image, or 0 if
+ * the image is not a version 2 or 3 index. When 'offsets' is not NULL, the
+ * offset of each entry is stored in it. */
+size_t kgit_indexfile_extensions(const unsigned char *data, size_t size, uint32_t *offsets)
+{
+	size_t off = KGIT_INDEX_HEADER;
+	uint32_t version, i, n;
+	if (size < KGIT_INDEX_HEADER + GIT_OID_RAWSZ || memcmp(data, "DIRC", 4) != 0) {
+		return 0;
+	}
+	version = kgit_be32(data + 4);
+	n = kgit_be32(data + 8);
+	if (version != 2 && version != 3) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		size_t fixed = KGIT_INDEX_ENTRY;
+		const unsigned char *path;
+		const unsigned char *nul;
+		if (off + KGIT_INDEX_ENTRY > size - GIT_OID_RAWSZ) {
+			return 0;
+		}
+		if (offsets != NULL) {
+			offsets[i] = (uint32_t)off;
+		}
+		if (version == 3 && (data[off + 60] & 0x40)) {
+			fixed += 2;
+		}
+		path = data + off + fixed;
+		nul = (const unsigned char *)memchr(path, '\0', size - GIT_OID_RAWSZ - (off + fixed));
+		if (nul == NULL) {
+			return 0;
+		}
+		off += (fixed + (nul - path) + 8) & ~(size_t)7;
+	}
+	return (off <= size - GIT_OID_RAWSZ) ? off : 0;
+}
+
+void kgit_cachetree_free(kgit_cachetree *node)
+{
+	size_t i;
+	if (node == NULL) {
+		return;
+	}
+	for (i = 0; i < node->nchildren; i++) {
+		kgit_cachetree_free(node->children[i]);
+	}
+	free(node->children);
+	free(node->name);
+	free(node);
+}
+
+static kgit_cachetree *kgit_cachetree_new(const char *name, size_t namelen)
+{
+	kgit_cachetree *node = (kgit_cachetree *)calloc(1, sizeof(kgit_cachetree));
+	if (node == NULL) {
+		return NULL;
+	}
+	node->name = strndup(name, namelen);
+	if (node->name == NULL) {
+		free(node);
+		return NULL;
+	}
+	node->namelen = namelen;
+	node->entry_count = -1;
+	return node;
+}
+
+/* Order directory names as git orders subtrees: as if followed by '/'. */
+static int kgit_dirname_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	size_t len = (alen < blen) ? alen : blen;
+	int cmp = memcmp(a, b, len);
+	if (cmp != 0) {
+		return cmp;
+	}
+	unsigned char ca = (alen > len) ? a[len] : '/';
+	unsigned char cb = (blen > len) ? b[len] : '/';
+	return ca - cb;
+}
+
+static int kgit_cachetree_cmp(const void *p1, const void *p2)
+{
+	const kgit_cachetree *a = *(kgit_cachetree *const *)p1;
+	const kgit_cachetree *b = *(kgit_cachetree *const *)p2;
+	return kgit_dirname_cmp(a->name, a->namelen, b->name, b->namelen);
+}
+
+/* Order subtrees as git writes them in the TREE extension: shorter names
+ * first, then by bytes. */
+static int kgit_cachetree_filecmp(const void *p1, const void *p2)
+{
+	const kgit_cachetree *a = *(kgit_cachetree *const *)p1;
+	const kgit_cachetree *b = *(kgit_cachetree *const *)p2;
+	if (a->namelen != b->namelen) {
+		return (a->namelen < b->namelen) ? -1 : 1;
+	}
+	return memcmp(a->name, b->name, a->namelen);
+}
+
+static kgit_cachetree *kgit_cachetree_child(kgit_cachetree *node, const char *name, size_t namelen)
+{
+	size_t lo = 0, hi = node->nchildren;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		kgit_cachetree *c = node->children[mid];
+		int cmp = kgit_dirname_cmp(c->name, c->namelen, name, namelen);
+		if (cmp == 0) {
+			return c;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+/* Invalidate every directory on the way to 'path'. */
+void kgit_cachetree_invalidate(kgit_cachetree *root, const char *path)
+{
+	kgit_cachetree *node = root;
+	while (node != NULL) {
+		const char *slash = strchr(path, '/');
+		node->entry_count = -1;
+		if (slash == NULL) {
+			break;
+		}
+		node = kgit_cachetree_child(node, path, slash - path);
+		path = slash + 1;
+	}
+}
+
+static kgit_cachetree *kgit_cachetree_parse(const char **pp, const char *end)
+{
+	const char *p = *pp;
+	const char *nul = (const char *)memchr(p, '\0', end - p);
+	char *q;
+	long entries, subtrees, i;
+	kgit_cachetree *node;
+	if (nul == NULL) {
+		return NULL;
+	}
+	node = kgit_cachetree_new(p, nul - p);
+	if (node == NULL) {
+		return NULL;
+	}
+	p = nul + 1;
+	entries = strtol(p, &q, 10);
+	if (q >= end || *q != ' ') {
+		goto fail;
+	}
+	subtrees = strtol(q + 1, &q, 10);
+	if (q >= end || *q != '\n' || subtrees < 0) {
+		goto fail;
+	}
+	p = q + 1;
+	node->entry_count = (int)entries;
+	if (entries >= 0) {
+		if (end - p < GIT_OID_RAWSZ) {
+			goto fail;
+		}
+		git_oid_fromraw(&node->oid, (const unsigned char *)p);
+		p += GIT_OID_RAWSZ;
+	}
+	if (subtrees > 0) {
+		node->children = (kgit_cachetree **)calloc(subtrees, sizeof(kgit_cachetree *));
+		if (node->children == NULL) {
+			goto fail;
+		}
+		for (i = 0; i < subtrees; i++) {
+			kgit_cachetree *child = kgit_cachetree_parse(&p, end);
+			if (child == NULL) {
+				goto fail;
+			}
+			node->children[node->nchildren++] = child;
+		}
+		/* lookups and kgit_cachetree_build() go by git tree order */
+		qsort(node->children, node->nchildren, sizeof(kgit_cachetree *), kgit_cachetree_cmp);
+	}
+	*pp = p;
+	return node;
+fail:
+	kgit_cachetree_free(node);
+	return NULL;
+}
+
+unsigned char *kgit_readfile(const char *path, size_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+	unsigned char *data = NULL;
+	long len;
+	if (fp == NULL) {
+		return NULL;
+	}
+	if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+		data = (unsigned char *)malloc(len + 1);
+		if (data != NULL && fread(data, 1, len, fp) != (size_t)len) {
+			free(data);
+			data = NULL;
+		}
+		*size = (size_t)len;
+	}
+	fclose(fp);
+	return data;
+}
+
+/* Read the TREE extension of an index file; NULL when there is none. */
+kgit_cachetree *kgit_cachetree_read(const char *index_path)
+{
+	size_t size, off;
+	kgit_cachetree *root = NULL;
+	unsigned char *data = kgit_readfile(index_path, &size);
+	if (data == NULL) {
+		return NULL;
+	}
+	off = kgit_indexfile_extensions(data, size, NULL);
+	while (off > 0 && off + 8 <= size - GIT_OID_RAWSZ) {
+		uint32_t len = kgit_be32(data + off + 4);
+		if (off + 8 + len > size - GIT_OID_RAWSZ) {
+			break;
+		}
+		if (memcmp(data + off, "TREE", 4) == 0) {
+			const char *p = (const char *)data + off + 8;
+			root = kgit_cachetree_parse(&p, p + len);
+			break;
+		}
+		off += 8 + len;
+	}
+	free(data);
+	return root;
+}
+
+int kgit_buf_put(kgit_buf *buf, const void *data, size_t len)
+{
+	if (buf->size + len > buf->capacity) {
+		size_t capacity = (buf->capacity == 0) ? 4096 : buf->capacity;
+		while (buf->size + len > capacity) {
+			capacity *= 2;
+		}
+		unsigned char *ptr = (unsigned char *)realloc(buf->ptr, capacity);
+		if (ptr == NULL) {
+			return GIT_ENOMEM;
+		}
+		buf->ptr = ptr;
+		buf->capacity = capacity;
+	}
+	memcpy(buf->ptr + buf->size, data, len);
+	buf->size += len;
+	return GIT_SUCCESS;
+}
+
+static int kgit_cachetree_serialize(kgit_buf *buf, const kgit_cachetree *node)
+{
+	char header[64];
+	kgit_cachetree **children = NULL;
+	size_t i;
+	int error = kgit_buf_put(buf, node->name, node->namelen + 1);
+	int len = sprintf(header, "%d %lu\n", node->entry_count, (unsigned long)node->nchildren);
+	if (error == GIT_SUCCESS) {
+		error = kgit_buf_put(buf, header, len);
+	}
+	if (error == GIT_SUCCESS && node->entry_count >= 0) {
+		error = kgit_buf_put(buf, node->oid.id, GIT_OID_RAWSZ);
+	}
+	if (error == GIT_SUCCESS && node->nchildren > 0) {
+		/* git binary-searches the subtrees in its own order */
+		children = (kgit_cachetree **)malloc(node->nchildren * sizeof(kgit_cachetree *));
+		if (children == NULL) {
+			return GIT_ENOMEM;
+		}
+		memcpy(children, node->children, node->nchildren * sizeof(kgit_cachetree *));
+		qsort(children, node->nchildren, sizeof(kgit_cachetree *), kgit_cachetree_filecmp);
+	}
+	for (i = 0; i < node->nchildren && error == GIT_SUCCESS; i++) {
+		error = kgit_cachetree_serialize(buf, children[i]);
+	}
+	free(children);
+	return error;
+}
+
+/* Replace the TREE extension of an index file on disk with 'root', keeping
+ * every other extension, and rewrite the trailing checksum. */
+int kgit_cachetree_write(const char *index_path, const kgit_cachetree *root)
+{
+	kgit_buf buf = {NULL, 0, 0}, tree = {NULL, 0, 0};
+	kgit_sha1_ctx sha1;
+	git_oid checksum;
+	unsigned char ext[8];
+	size_t size, off, start;
+	int error = GIT_SUCCESS;
+	unsigned char *data = kgit_readfile(index_path, &size);
+	if (data == NULL) {
+		return GIT_ENOTFOUND;
+	}
+	start = off = kgit_indexfile_extensions(data, size, NULL);
+	if (off == 0) {
+		free(data);
+		return GIT_EOBJCORRUPTED;
+	}
+	error = kgit_cachetree_serialize(&tree, root);
+	memcpy(ext, "TREE", 4);
+	kgit_put_be32(ext + 4, (uint32_t)tree.size);
+	if (error == GIT_SUCCESS) error = kgit_buf_put(&buf, data, start);
+	if (error == GIT_SUCCESS) error = kgit_buf_put(&buf, ext, 8);
+	if (error == GIT_SUCCESS) error = kgit_buf_put(&buf, tree.ptr, tree.size);
+	while (error == GIT_SUCCESS && off + 8 <= size - GIT_OID_RAWSZ) {
+		uint32_t len = kgit_be32(data + off + 4);
+		if (off + 8 + len > size - GIT_OID_RAWSZ) {
+			error = GIT_EOBJCORRUPTED;
+			break;
+		}
+		if (memcmp(data + off, "TREE", 4) != 0) {
+			error = kgit_buf_put(&buf, data + off, 8 + len);
+		}
+		off += 8 + len;
+	}
+	if (error == GIT_SUCCESS) {
+		kgit_sha1_init(&sha1);
+		kgit_sha1_update(&sha1, buf.ptr, buf.size);
+		kgit_sha1_final(&checksum, &sha1);
+		error = kgit_buf_put(&buf, checksum.id, GIT_OID_RAWSZ);
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_writefile(index_path, buf.ptr, buf.size);
+	}
+	free(data);
+	free(buf.ptr);
+	free(tree.ptr);
+	return error;
+}
+
+/* Write 'data' to 'path' atomically through a lock file. */
+int kgit_writefile(const char *path, const void *data, size_t size)
+{
+	size_t len = strlen(path);
+	char *lock = (char *)malloc(len + 6);
+	FILE *fp;
+	int error = GIT_SUCCESS;
+	if (lock == NULL) {
+		return GIT_ENOMEM;
+	}
+	memcpy(lock, path, len);
+	memcpy(lock + len, ".lock", 6);
+	fp = fopen(lock, "wb");
+	if (fp == NULL) {
+		free(lock);
+		return GIT_ERROR;
+	}
+	if (fwrite(data, 1, size, fp) != size) {
+		error = GIT_ERROR;
+	}
+	if (fclose(fp) != 0) {
+		error = GIT_ERROR;
+	}
+	if (error == GIT_SUCCESS && rename(lock, path) != 0) {
+		error = GIT_ERROR;
+	}
+	if (error != GIT_SUCCESS) {
+		remove(lock);
+	}
+	free(lock);
+	return error;
+}
+
+/* Rebuild the directory covering index entries [lo, hi), whose paths share
+ * a prefix of 'off' bytes. */
+static int kgit_cachetree_build(kgit_cachetree *node, git_repository *repo, git_index *index, unsigned int lo, unsigned int hi, size_t off)
+{
+	kgit_cachetree **children = NULL;
+	kgit_entry *entries = NULL;
+	size_t nchildren = 0, nentries = 0, k = 0, i;
+	unsigned int j = lo;
+	int error = GIT_SUCCESS;
+	if (node->entry_count >= 0 && (unsigned int)node->entry_count == hi - lo) {
+		return GIT_SUCCESS;
+	}
+	entries = (kgit_entry *)malloc((hi - lo + 1) * sizeof(kgit_entry));
+	children = (kgit_cachetree **)malloc((hi - lo + 1) * sizeof(kgit_cachetree *));
+	if (entries == NULL || children == NULL) {
+		error = GIT_ENOMEM;
+	}
+	while (j < hi && error == GIT_SUCCESS) {
+		const git_index_entry *e = git_index_get(index, j);
+		const char *name = e->path + off;
+		const char *slash = strchr(name, '/');
+		kgit_entry *d = &entries[nentries];
+		if (slash == NULL) {
+			d->name = name;
+			d->namelen = strlen(name);
+			d->attr = e->mode;
+			git_oid_cpy(&d->oid, &e->oid);
+			j++;
+		} else {
+			size_t len = slash - name;
+			unsigned int end = j + 1;
+			kgit_cachetree *child = NULL;
+			while (end < hi && strncmp(git_index_get(index, end)->path + off, name, len + 1) == 0) {
+				end++;
+			}
+			/* children are kept in git order, as are the directories met here */
+			while (k < node->nchildren && kgit_dirname_cmp(node->children[k]->name, node->children[k]->namelen, name, len) < 0) {
+				kgit_cachetree_free(node->children[k]);
+				node->children[k++] = NULL;
+			}
+			if (k < node->nchildren && kgit_dirname_cmp(node->children[k]->name, node->children[k]->namelen, name, len) == 0) {
+				child = node->children[k];
+				node->children[k++] = NULL;
+			} else if ((child = kgit_cachetree_new(name, len)) == NULL) {
+				error = GIT_ENOMEM;
+				break;
+			}
+			children[nchildren++] = child;
+			error = kgit_cachetree_build(child, repo, index, j, end, off + len + 1);
+			d->name = name;
+			d->namelen = len;
+			d->attr = GIT_ATTR_DIR;
+			git_oid_cpy(&d->oid, &child->oid);
+			j = end;
+		}
+		d->seq = nentries++;
+	}
+	for (i = 0; i < node->nchildren; i++) {
+		kgit_cachetree_free(node->children[i]);
+	}
+	free(node->children);
+	node->children = children;
+	node->nchildren = nchildren;
+	if (error == GIT_SUCCESS) {
+		error = kgit_tree_write(&node->oid, repo, entries, nentries);
+	}
+	node->entry_count = (error == GIT_SUCCESS) ? (int)(hi - lo) : -1;
+	free(entries);
+	return error;
+}
+
+/* Write the tree objects for the index, rebuilding only the directories
+ * invalidated in '*root' (created when NULL). The index must not have
+ * unmerged entries. */
+int kgit_cachetree_update(git_oid *out, git_repository *repo, git_index *index, kgit_cachetree **root)
+{
+	unsigned int i, n;
+	int error;
+	/* a lookup sorts the entries by path */
+	git_index_find(index, "");
+	n = git_index_entrycount(index);
+	for (i = 0; i < n; i++) {
+		if (git_index_entry_stage(git_index_get(index, i)) != 0) {
+			return GIT_ERROR;
+		}
+	}
+	if (*root == NULL && (*root = kgit_cachetree_new("", 0)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	error = kgit_cachetree_build(*root, repo, index, 0, n, 0);
+	if (error == GIT_SUCCESS) {
+		git_oid_cpy(out, &(*root)->oid);
+	}
+	return error;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,348 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+void kgit_diff_free(CTX ctx, kgit_diff *diff)
+{
+	size_t i;
+	for (i = 0; i < diff->size; i++) {
+		free(diff->deltas[i].path);
+	}
+	free(diff->deltas);
+	KNH_FREE(ctx, diff, sizeof(kgit_diff));
+}
+
+kgit_diff *kgit_diff_new(CTX ctx)
+{
+	kgit_diff *diff = (kgit_diff *)KNH_MALLOC(ctx, sizeof(kgit_diff));
+	memset(diff, 0, sizeof(kgit_diff));
+	return diff;
+}
+
+int kgit_diff_push(kgit_diff *diff, int status, const char *path,
+		const git_oid *old_oid, unsigned int old_attr, const git_oid *new_oid, unsigned int new_attr)
+{
+	if (diff->size == diff->capacity) {
+		size_t capacity = (diff->capacity == 0) ? 16 : diff->capacity * 2;
+		kgit_delta *deltas = (kgit_delta *)realloc(diff->deltas, capacity * sizeof(kgit_delta));
+		if (deltas == NULL) {
+			return GIT_ENOMEM;
+		}
+		diff->deltas = deltas;
+		diff->capacity = capacity;
+	}
+	kgit_delta *d = &diff->deltas[diff->size];
+	memset(d, 0, sizeof(kgit_delta));
+	d->status = status;
+	d->path = strdup(path);
+	if (d->path == NULL) {
+		return GIT_ENOMEM;
+	}
+	if (old_oid != NULL) {
+		git_oid_cpy(&d->old_oid, old_oid);
+		d->old_attr = old_attr;
+	}
+	if (new_oid != NULL) {
+		git_oid_cpy(&d->new_oid, new_oid);
+		d->new_attr = new_attr;
+	}
+	diff->size++;
+	return GIT_SUCCESS;
+}
+
+static int kgit_diff_add(kgit_diff *diff, int status, const char *path,
+		const git_tree_entry *old_entry, const git_tree_entry *new_entry)
+{
+	return kgit_diff_push(diff, status, path,
+			(old_entry != NULL) ? git_tree_entry_id(old_entry) : NULL,
+			(old_entry != NULL) ? git_tree_entry_attributes(old_entry) : 0,
+			(new_entry != NULL) ? git_tree_entry_id(new_entry) : NULL,
+			(new_entry != NULL) ? git_tree_entry_attributes(new_entry) : 0);
+}
+
+/* Compare two entries in the order git sorts tree objects, that is, as if the
+ * name of a subtree had a trailing '/'. */
+static int kgit_entry_cmp(const git_tree_entry *a, const git_tree_entry *b)
+{
+	const char *na = git_tree_entry_name(a);
+	const char *nb = git_tree_entry_name(b);
+	size_t la = strlen(na), lb = strlen(nb);
+	size_t len = (la < lb) ? la : lb;
+	int cmp = memcmp(na, nb, len);
+	if (cmp != 0) {
+		return cmp;
+	}
+	unsigned char ca = (la > len) ? na[len] : (GIT_ATTR_ISDIR(git_tree_entry_attributes(a)) ? '/' : '\0');
+	unsigned char cb = (lb > len) ? nb[len] : (GIT_ATTR_ISDIR(git_tree_entry_attributes(b)) ? '/' : '\0');
+	return ca - cb;
+}
+
+static char *kgit_path_join(const char *base, const char *name)
+{
+	size_t blen = strlen(base), nlen = strlen(name);
+	char *path = (char *)malloc(blen + nlen + 2);
+	if (path == NULL) {
+		return NULL;
+	}
+	if (blen > 0) {
+		memcpy(path, base, blen);
+		path[blen++] = '/';
+	}
+	memcpy(path + blen, name, nlen + 1);
+	return path;
+}
+
+static int kgit_diff_tree(kgit_diff *diff, git_repository *repo, const char *base, git_tree *a, git_tree *b);
+
+/* Diff a single pair of entries sharing the same name; either side may be
+ * NULL. Subtrees are only opened when their ids differ. */
+static int kgit_diff_entry(kgit_diff *diff, git_repository *repo, const char *base,
+		const git_tree_entry *ea, const git_tree_entry *eb)
+{
+	const git_tree_entry *e = (ea != NULL) ? ea : eb;
+	char *path = kgit_path_join(base, git_tree_entry_name(e));
+	int error = GIT_SUCCESS;
+	if (path == NULL) {
+		return GIT_ENOMEM;
+	}
+	if (GIT_ATTR_ISDIR(git_tree_entry_attributes(e))) {
+		git_tree *ta = NULL, *tb = NULL;
+		if (ea != NULL && eb != NULL && git_oid_cmp(git_tree_entry_id(ea), git_tree_entry_id(eb)) == 0) {
+			goto cleanup;
+		}
+		if (ea != NULL && (error = git_tree_lookup(&ta, repo, git_tree_entry_id(ea))) < GIT_SUCCESS) {
+			goto cleanup;
+		}
+		if (eb != NULL && (error = git_tree_lookup(&tb, repo, git_tree_entry_id(eb))) < GIT_SUCCESS) {
+			if (ta != NULL) git_tree_close(ta);
+			goto cleanup;
+		}
+		error = kgit_diff_tree(diff, repo, path, ta, tb);
+		if (ta != NULL) git_tree_close(ta);
+		if (tb != NULL) git_tree_close(tb);
+	} else if (ea == NULL) {
+		error = kgit_diff_add(diff, GIT_DELTA_ADDED, path, NULL, eb);
+	} else if (eb == NULL) {
+		error = kgit_diff_add(diff, GIT_DELTA_DELETED, path, ea, NULL);
+	} else if (git_oid_cmp(git_tree_entry_id(ea), git_tree_entry_id(eb)) != 0 ||
+			git_tree_entry_attributes(ea) != git_tree_entry_attributes(eb)) {
+		error = kgit_diff_add(diff, GIT_DELTA_MODIFIED, path, ea, eb);
+	}
+cleanup:
+	free(path);
+	return error;
+}
+
+/* Merge-walk the sorted entries of two trees; a NULL tree is empty. */
+static int kgit_diff_tree(kgit_diff *diff, git_repository *repo, const char *base, git_tree *a, git_tree *b)
+{
+	unsigned int na = (a != NULL) ? git_tree_entrycount(a) : 0;
+	unsigned int nb = (b != NULL) ? git_tree_entrycount(b) : 0;
+	unsigned int i = 0, j = 0;
+	int error = GIT_SUCCESS;
+	while (error == GIT_SUCCESS && (i < na || j < nb)) {
+		const git_tree_entry *ea = (i < na) ? git_tree_entry_byindex(a, i) : NULL;
+		const git_tree_entry *eb = (j < nb) ? git_tree_entry_byindex(b, j) : NULL;
+		int cmp = (ea == NULL) ? 1 : (eb == NULL) ? -1 : kgit_entry_cmp(ea, eb);
+		if (cmp < 0) {
+			error = kgit_diff_entry(diff, repo, base, ea, NULL);
+			i++;
+		} else if (cmp > 0) {
+			error = kgit_diff_entry(diff, repo, base, NULL, eb);
+			j++;
+		} else {
+			error = kgit_diff_entry(diff, repo, base, ea, eb);
+			i++;
+			j++;
+		}
+	}
+	return error;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void kGitDiff_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitDiff_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_diff_free(ctx, (kgit_diff *)po->rawptr);
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitDiff(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitDiff";
+	cdef->init = kGitDiff_init;
+	cdef->free = kGitDiff_free;
+}
+
+DEFAPI(void) defGitDelta(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitDelta";
+}
+
+static knh_IntData_t GitDeltaConstInt[] = {
+	{"ADDED", GIT_DELTA_ADDED},
+	{"DELETED", GIT_DELTA_DELETED},
+	{"MODIFIED", GIT_DELTA_MODIFIED},
+	{NULL}
+};
+
+DEFAPI(void) constGitDelta(CTX ctx, kclass_t cid, const knh_LoaderAPI_t *kapi)
+{
+	kapi->loadClassIntConst(ctx, cid, GitDeltaConstInt);
+}
+
+static kgit_delta *GitDiff_delta(ksfp_t *sfp)
+{
+	kgit_diff *diff = RawPtr_to(kgit_diff *, sfp[0]);
+	kint_t n = Int_to(kint_t, sfp[1]);
+	if (diff == NULL || n < 0 || (size_t)n >= diff->size) {
+		return NULL;
+	}
+	return &diff->deltas[n];
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Free a diff list */
+//## @Native void GitDiff.free();
+KMETHOD GitDiff_free(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kGitDiff_free(ctx, sfp[0].p);
+	RETURNvoid_();
+}
+
+/* Get the new attributes of the n-th changed path */
+//## @Native int GitDiff.newAttributes(int n);
+KMETHOD GitDiff_newAttributes(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_delta *d = GitDiff_delta(sfp);
+	RETURNi_((d != NULL) ? d->new_attr : 0);
+}
+
+/* Get the new id of the n-th changed path */
+//## @Native GitOid GitDiff.newId(int n);
+KMETHOD GitDiff_newId(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_delta *d = GitDiff_delta(sfp);
+	if (d == NULL || d->status == GIT_DELTA_DELETED) {
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_GitOidCopy(ctx, sfp, &d->new_oid));
+}
+
+/* Get the old attributes of the n-th changed path */
+//## @Native int GitDiff.oldAttributes(int n);
+KMETHOD GitDiff_oldAttributes(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_delta *d = GitDiff_delta(sfp);
+	RETURNi_((d != NULL) ? d->old_attr : 0);
+}
+
+/* Get the old id of the n-th changed path */
+//## @Native GitOid GitDiff.oldId(int n);
+KMETHOD GitDiff_oldId(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_delta *d = GitDiff_delta(sfp);
+	if (d == NULL || d->status == GIT_DELTA_ADDED) {
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_GitOidCopy(ctx, sfp, &d->old_oid));
+}
+
+/* Get the path of the n-th changed path */
+//## @Native String GitDiff.path(int n);
+KMETHOD GitDiff_path(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_delta *d = GitDiff_delta(sfp);
+	if (d == NULL) {
+		RETURN_(KNH_TNULL(String));
+	}
+	RETURN_(new_String(ctx, d->path));
+}
+
+/* Get the number of changed paths */
+//## @Native int GitDiff.size();
+KMETHOD GitDiff_size(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_diff *diff = RawPtr_to(kgit_diff *, sfp[0]);
+	RETURNi_((diff != NULL) ? diff->size : 0);
+}
+
+/* Get the status (GitDelta) of the n-th changed path */
+//## @Native int GitDiff.status(int n);
+KMETHOD GitDiff_status(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_delta *d = GitDiff_delta(sfp);
+	RETURNi_((d != NULL) ? d->status : 0);
+}
+
+/* Compute the blob-level changes between two trees. Subtrees whose ids are
+ * equal on both sides are skipped without being read. Either tree may be null
+ * to describe a root commit. */
+//## @Native @Static GitDiff GitDiff.trees(GitRepository repo, GitTree a, GitTree b);
+KMETHOD GitDiff_trees(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	git_tree *a = RawPtr_to(git_tree *, sfp[2]);
+	git_tree *b = RawPtr_to(git_tree *, sfp[3]);
+	kgit_diff *diff = kgit_diff_new(ctx);
+	int error = GIT_SUCCESS;
+	if (a == NULL || b == NULL || git_oid_cmp(git_tree_id(a), git_tree_id(b)) != 0) {
+		error = kgit_diff_tree(diff, repo, "", a, b);
+	}
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_tree_lookup", error);
+		kgit_diff_free(ctx, diff);
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, diff));
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
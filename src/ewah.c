@@ -0,0 +1,221 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Plain bitmaps are kept uncompressed in memory and converted to and from
+ * git's EWAH serialization at the file boundary: a 32-bit bit count, a
+ * 32-bit word count, the 64-bit words, and the position of the last marker
+ * word, all big-endian. A marker word holds the running bit (bit 0), the
+ * number of clean words of that bit (bits 1-32) and the number of literal
+ * words following it (bits 33-63). */
+
+#define KGIT_EWAH_RUN_MAX      0xffffffffULL
+#define KGIT_EWAH_LITERAL_MAX  0x7fffffffULL
+
+int kgit_bitmap_init(kgit_bitmap *bitmap, size_t nbits)
+{
+	bitmap->nbits = nbits;
+	bitmap->words = (uint64_t *)calloc(KGIT_BITMAP_WORDS(nbits) + 1, sizeof(uint64_t));
+	return (bitmap->words != NULL) ? GIT_SUCCESS : GIT_ENOMEM;
+}
+
+void kgit_bitmap_free(kgit_bitmap *bitmap)
+{
+	free(bitmap->words);
+	bitmap->words = NULL;
+	bitmap->nbits = 0;
+}
+
+void kgit_bitmap_set(kgit_bitmap *bitmap, size_t pos)
+{
+	bitmap->words[pos / 64] |= (uint64_t)1 << (pos % 64);
+}
+
+int kgit_bitmap_get(const kgit_bitmap *bitmap, size_t pos)
+{
+	return pos < bitmap->nbits && (bitmap->words[pos / 64] >> (pos % 64)) & 1;
+}
+
+size_t kgit_bitmap_count(const kgit_bitmap *bitmap)
+{
+	size_t i, n = 0;
+	for (i = 0; i < KGIT_BITMAP_WORDS(bitmap->nbits); i++) {
+		n += __builtin_popcountll(bitmap->words[i]);
+	}
+	return n;
+}
+
+/* Grow a bitmap to 'nbits' bits, clearing the new ones. */
+int kgit_bitmap_grow(kgit_bitmap *bitmap, size_t nbits)
+{
+	size_t have = KGIT_BITMAP_WORDS(bitmap->nbits), want = KGIT_BITMAP_WORDS(nbits);
+	if (nbits <= bitmap->nbits) {
+		return GIT_SUCCESS;
+	}
+	uint64_t *words = (uint64_t *)realloc(bitmap->words, (want + 1) * sizeof(uint64_t));
+	if (words == NULL) {
+		return GIT_ENOMEM;
+	}
+	memset(words + have, 0, (want + 1 - have) * sizeof(uint64_t));
+	bitmap->words = words;
+	bitmap->nbits = nbits;
+	return GIT_SUCCESS;
+}
+
+/* dst |= src, over the bits both bitmaps have */
+void kgit_bitmap_or(kgit_bitmap *dst, const kgit_bitmap *src)
+{
+	size_t i, n = KGIT_BITMAP_WORDS((dst->nbits < src->nbits) ? dst->nbits : src->nbits);
+	for (i = 0; i < n; i++) {
+		dst->words[i] |= src->words[i];
+	}
+}
+
+/* dst &= ~src, over the bits both bitmaps have */
+void kgit_bitmap_andnot(kgit_bitmap *dst, const kgit_bitmap *src)
+{
+	size_t i, n = KGIT_BITMAP_WORDS((dst->nbits < src->nbits) ? dst->nbits : src->nbits);
+	for (i = 0; i < n; i++) {
+		dst->words[i] &= ~src->words[i];
+	}
+}
+
+/* dst ^= src, over the bits both bitmaps have */
+void kgit_bitmap_xor(kgit_bitmap *dst, const kgit_bitmap *src)
+{
+	size_t i, n = KGIT_BITMAP_WORDS((dst->nbits < src->nbits) ? dst->nbits : src->nbits);
+	for (i = 0; i < n; i++) {
+		dst->words[i] ^= src->words[i];
+	}
+}
+
+static int kgit_put_be64(kgit_buf *buf, uint64_t v)
+{
+	unsigned char b[8];
+	kgit_put_be32(b, (uint32_t)(v >> 32));
+	kgit_put_be32(b + 4, (uint32_t)v);
+	return kgit_buf_put(buf, b, 8);
+}
+
+static uint64_t kgit_be64(const unsigned char *p)
+{
+	return ((uint64_t)kgit_be32(p) << 32) | kgit_be32(p + 4);
+}
+
+/* Append the EWAH serialization of a bitmap to 'buf'. */
+int kgit_ewah_write(kgit_buf *buf, const kgit_bitmap *bitmap)
+{
+	size_t i = 0, n = KGIT_BITMAP_WORDS(bitmap->nbits), start = buf->size, nwords = 0, marker = 0;
+	unsigned char b[4];
+	int error;
+	kgit_put_be32(b, (uint32_t)bitmap->nbits);
+	if ((error = kgit_buf_put(buf, b, 4)) < GIT_SUCCESS || (error = kgit_buf_put(buf, b, 4)) < GIT_SUCCESS) {
+		return error;
+	}
+	do {
+		uint64_t run = 0, literals = 0, bit = (i < n && bitmap->words[i] == ~0ULL) ? 1 : 0;
+		size_t at = buf->size;
+		marker = nwords++;
+		if ((error = kgit_put_be64(buf, 0)) < GIT_SUCCESS) {
+			return error;
+		}
+		while (i < n && bitmap->words[i] == (bit ? ~0ULL : 0) && run < KGIT_EWAH_RUN_MAX) {
+			run++;
+			i++;
+		}
+		while (i < n && bitmap->words[i] != 0 && bitmap->words[i] != ~0ULL && literals < KGIT_EWAH_LITERAL_MAX) {
+			if ((error = kgit_put_be64(buf, bitmap->words[i])) < GIT_SUCCESS) {
+				return error;
+			}
+			literals++;
+			nwords++;
+			i++;
+		}
+		uint64_t rlw = bit | (run << 1) | (literals << 33);
+		kgit_put_be32(buf->ptr + at, (uint32_t)(rlw >> 32));
+		kgit_put_be32(buf->ptr + at + 4, (uint32_t)rlw);
+	} while (i < n);
+	kgit_put_be32(buf->ptr + start + 4, (uint32_t)nwords);
+	kgit_put_be32(b, (uint32_t)marker);
+	return kgit_buf_put(buf, b, 4);
+}
+
+/* Read an EWAH bitmap; returns the number of bytes consumed, or -1 when the
+ * data is truncated or inconsistent. */
+long kgit_ewah_read(kgit_bitmap *bitmap, const unsigned char *data, size_t size)
+{
+	size_t i, nwords, pos = 0, n;
+	/* bit count, word count and the position of the last marker word */
+	if (size < 12) {
+		return -1;
+	}
+	nwords = kgit_be32(data + 4);
+	if (nwords > (size - 12) / 8) {
+		return -1;
+	}
+	if (kgit_bitmap_init(bitmap, kgit_be32(data)) < GIT_SUCCESS) {
+		return -1;
+	}
+	n = KGIT_BITMAP_WORDS(bitmap->nbits);
+	data += 8;
+	for (i = 0; i < nwords; i++) {
+		uint64_t rlw = kgit_be64(data + i * 8);
+		uint64_t run = (rlw >> 1) & KGIT_EWAH_RUN_MAX, literals = rlw >> 33;
+		if (i + literals >= nwords || pos + run + literals > n) {
+			kgit_bitmap_free(bitmap);
+			return -1;
+		}
+		if (rlw & 1) {
+			memset(bitmap->words + pos, 0xff, run * sizeof(uint64_t));
+		}
+		pos += run;
+		for (; literals > 0; literals--) {
+			bitmap->words[pos++] = kgit_be64(data + (++i) * 8);
+		}
+	}
+	if (n > 0 && bitmap->nbits % 64 != 0) {
+		bitmap->words[n - 1] &= ((uint64_t)1 << (bitmap->nbits % 64)) - 1;
+	}
+	return (long)(12 + nwords * 8);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -29,6 +29,10 @@
 //  chen_ji - Takuma Wakamori, Yokohama National University, Japan
 // **************************************************************************
 
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #define USE_STRUCT_Path
 #include <konoha1.h>
 #include "libgit2.h"
@@ -37,6 +41,290 @@
 extern "C" {
 #endif
 
+#ifdef __APPLE__
+#define kgit_st_mtime_nsec(st)  ((st)->st_mtimespec.tv_nsec)
+#define kgit_st_ctime_nsec(st)  ((st)->st_ctimespec.tv_nsec)
+#else
+#define kgit_st_mtime_nsec(st)  ((st)->st_mtim.tv_nsec)
+#define kgit_st_ctime_nsec(st)  ((st)->st_ctim.tv_nsec)
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Per-index state kept by the binding, looked up by git_index pointer.
+ * Every method that mutates an index calls kgit_index_touch() or
+ * kgit_index_touch_path() so derived data is rebuilt on its next use.
+ * Indexes opened through a repository or a file are registered with their
+ * repository and path, which lets the cache-tree be loaded and saved and
+ * split index files be read and written. */
+
+typedef struct kgit_indexdata {
+	struct kgit_indexdata *next;
+	git_index *index;
+	int use_pathindex;
+	int pathindex_valid;
+	uint32_t *slots; /* entry position + 1, or 0 when empty */
+	uint32_t mask;
+	git_repository *repo;
+	char *path;
+	kgit_cachetree *cachetree;
+	int split;
+	kgit_indexfile *shared;
+	int detached; /* libgit2 holds the shared index path, not 'path' */
+} kgit_indexdata;
+
+static kgit_indexdata *indexdata = NULL;
+static pthread_mutex_t indexdata_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with indexdata_lock held */
+static kgit_indexdata *kgit_indexdata_get(git_index *index, int create)
+{
+	kgit_indexdata *d;
+	for (d = indexdata; d != NULL; d = d->next) {
+		if (d->index == index) {
+			return d;
+		}
+	}
+	if (!create || (d = (kgit_indexdata *)calloc(1, sizeof(kgit_indexdata))) == NULL) {
+		return NULL;
+	}
+	d->index = index;
+	d->next = indexdata;
+	indexdata = d;
+	return d;
+}
+
+static void kgit_indexdata_drop(git_index *index)
+{
+	kgit_indexdata **p;
+	pthread_mutex_lock(&indexdata_lock);
+	for (p = &indexdata; *p != NULL; p = &(*p)->next) {
+		if ((*p)->index == index) {
+			kgit_indexdata *d = *p;
+			*p = d->next;
+			free(d->slots);
+			free(d->path);
+			kgit_cachetree_free(d->cachetree);
+			kgit_indexfile_free(d->shared);
+			free(d);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+}
+
+/* Remember the repository and file backing an index and load the cache-tree
+ * stored in that file. 'repo' may be NULL for a bare index file. */
+void kgit_index_register(git_index *index, git_repository *repo, const char *path)
+{
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 1);
+	if (d != NULL) {
+		d->repo = repo;
+		free(d->path);
+		d->path = (path != NULL) ? strdup(path) : NULL;
+		kgit_cachetree_free(d->cachetree);
+		d->cachetree = (d->path != NULL) ? kgit_cachetree_read(d->path) : NULL;
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+}
+
+/* Read the entries of a registered index from its file. Split index files
+ * are expanded here; libgit2 only reads plain ones, and only from the path
+ * it was opened with, so a detached index is always read here. */
+static int kgit_index_load(git_index *index)
+{
+	int error = GIT_ENOTFOUND, detached = 0;
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	if (d != NULL && d->path != NULL) {
+		detached = d->detached;
+		error = kgit_splitindex_read(index, d->path, &d->shared, detached || d->shared != NULL);
+		if (error == GIT_ENOTFOUND && detached && access(d->path, F_OK) != 0) {
+			/* the index file was removed: nothing is staged */
+			git_index_clear(index);
+			error = GIT_SUCCESS;
+		}
+		if (error == GIT_SUCCESS) {
+			/* keep the file split the way it was found */
+			d->split = (d->shared != NULL);
+			d->pathindex_valid = 0;
+			kgit_cachetree_free(d->cachetree);
+			d->cachetree = kgit_cachetree_read(d->path);
+		}
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+	return (error == GIT_ENOTFOUND && !detached) ? git_index_read(index) : error;
+}
+
+/* Open the index file at 'path', which may be split. A split index is
+ * opened through its shared index, then expanded; it stays detached from
+ * the path libgit2 knows, even once split mode is turned off. */
+int kgit_index_open(git_index **out, git_repository *repo, const char *path)
+{
+	char *shared = kgit_splitindex_shared(path);
+	int split = (shared != NULL);
+	int error = git_index_open(out, split ? shared : path);
+	free(shared);
+	if (error < GIT_SUCCESS) {
+		return error;
+	}
+	kgit_index_register(*out, repo, path);
+	if (split) {
+		pthread_mutex_lock(&indexdata_lock);
+		kgit_indexdata *d = kgit_indexdata_get(*out, 0);
+		if (d != NULL) {
+			d->detached = 1;
+		}
+		pthread_mutex_unlock(&indexdata_lock);
+		if ((error = kgit_index_load(*out)) < GIT_SUCCESS) {
+			kgit_indexdata_drop(*out);
+			git_index_free(*out);
+		}
+	}
+	return error;
+}
+
+/* Invalidate everything derived from the entries of an index. */
+void kgit_index_touch(git_index *index)
+{
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	if (d != NULL) {
+		d->pathindex_valid = 0;
+		kgit_cachetree_free(d->cachetree);
+		d->cachetree = NULL;
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+}
+
+/* Invalidate what depends on the entry at 'path' only; the cache-tree keeps
+ * the directories that do not contain it. */
+static void kgit_index_touch_path(git_index *index, const char *path)
+{
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	if (d != NULL) {
+		d->pathindex_valid = 0;
+		if (d->cachetree != NULL) {
+			kgit_cachetree_invalidate(d->cachetree, path);
+		}
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+}
+
+/* Write the tree objects for an index. When the index belongs to a known
+ * repository, directories left unchanged since the last write are reused
+ * from the cache-tree instead of being hashed again. */
+int kgit_index_write_tree(git_oid *out, git_index *index)
+{
+	int error;
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	if (d != NULL && d->repo != NULL) {
+		error = kgit_cachetree_update(out, d->repo, index, &d->cachetree);
+	} else {
+		error = git_tree_create_fromindex(out, index);
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+	return error;
+}
+
+/* Get the working directory of the repository an index was opened from, or
+ * NULL for a bare index. */
+static const char *kgit_index_workdir(git_index *index, git_repository **repo)
+{
+	const char *workdir = NULL;
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	*repo = (d != NULL) ? d->repo : NULL;
+	if (*repo != NULL) {
+		workdir = git_repository_path(*repo, GIT_REPO_PATH_WORKDIR);
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+	return workdir;
+}
+
+/* Get the modification time of the file of a registered index, or zero when
+ * it is not known. */
+static void kgit_index_mtime(git_index *index, struct timespec *mtime)
+{
+	struct stat st;
+	mtime->tv_sec = 0;
+	mtime->tv_nsec = 0;
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	if (d != NULL && d->path != NULL && stat(d->path, &st) == 0) {
+		mtime->tv_sec = st.st_mtime;
+		mtime->tv_nsec = kgit_st_mtime_nsec(&st);
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+}
+
+static uint32_t kgit_path_hash(const char *path)
+{
+	uint32_t h = 2166136261U;
+	for (; *path != '\0'; path++) {
+		h = (h ^ (unsigned char)*path) * 16777619U;
+	}
+	return h;
+}
+
+/* must be called with indexdata_lock held */
+static int kgit_pathindex_build(kgit_indexdata *d)
+{
+	unsigned int i, n;
+	uint32_t size = 1;
+	/* a lookup sorts the entries, so positions are stable from here on */
+	git_index_find(d->index, "");
+	n = git_index_entrycount(d->index);
+	while (size < n * 2) {
+		size <<= 1;
+	}
+	free(d->slots);
+	d->slots = (uint32_t *)calloc(size, sizeof(uint32_t));
+	if (d->slots == NULL) {
+		return GIT_ENOMEM;
+	}
+	d->mask = size - 1;
+	for (i = 0; i < n; i++) {
+		const char *path = git_index_get(d->index, i)->path;
+		uint32_t h = kgit_path_hash(path) & d->mask;
+		for (; d->slots[h] != 0; h = (h + 1) & d->mask) {
+			if (strcmp(git_index_get(d->index, d->slots[h] - 1)->path, path) == 0) {
+				break; /* keep the first stage of a path */
+			}
+		}
+		if (d->slots[h] == 0) {
+			d->slots[h] = i + 1;
+		}
+	}
+	d->pathindex_valid = 1;
+	return GIT_SUCCESS;
+}
+
+/* Find the position of the first entry for 'path' like git_index_find,
+ * through the path hash index when it is enabled for this index. */
+static int kgit_index_find(git_index *index, const char *path)
+{
+	int position = GIT_ENOTFOUND;
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	if (d == NULL || !d->use_pathindex ||
+			(!d->pathindex_valid && kgit_pathindex_build(d) < GIT_SUCCESS)) {
+		pthread_mutex_unlock(&indexdata_lock);
+		return git_index_find(index, path);
+	}
+	uint32_t h = kgit_path_hash(path) & d->mask;
+	for (; d->slots[h] != 0; h = (h + 1) & d->mask) {
+		if (strcmp(git_index_get(index, d->slots[h] - 1)->path, path) == 0) {
+			position = (int)d->slots[h] - 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&indexdata_lock);
+	return position;
+}
+
 /* ------------------------------------------------------------------------ */
 
 static void kGitIndex_init(CTX ctx, kRawPtr *po)
@@ -48,6 +336,7 @@ static void kGitIndex_free(CTX ctx, kRawPtr *po)
 {
 	if (po->rawptr != NULL) {
 		fprintf(stderr, "git_index_free(%p)\n", po->rawptr);
+		kgit_indexdata_drop((git_index *)po->rawptr);
 		git_index_free((git_index *)po->rawptr);
 		po->rawptr = NULL;
 	}
@@ -101,6 +390,220 @@ DEFAPI(void) defGitIndexEntryUnmerged(CTX ctx, kclass_t cid, kclassdef_t *cdef)
 	cdef->free = kGitIndexEntryUnmerged_free;
 }
 
+/* A columnar copy of the index taken in one pass: all paths share a single
+ * string buffer and every other field lives in its own array. */
+typedef struct kgit_index_snapshot {
+	char *paths;
+	uint32_t *offsets;
+	git_oid *oids;
+	git_time_t *mtimes;
+	git_off_t *sizes;
+	uint32_t *modes;
+	uint8_t *stages;
+	size_t size;
+} kgit_index_snapshot;
+
+static void kgit_index_snapshot_free(CTX ctx, kgit_index_snapshot *snap)
+{
+	free(snap->paths);
+	free(snap->offsets);
+	free(snap->oids);
+	free(snap->mtimes);
+	free(snap->sizes);
+	free(snap->modes);
+	free(snap->stages);
+	KNH_FREE(ctx, snap, sizeof(kgit_index_snapshot));
+}
+
+/* ------------------------------------------------------------------------ */
+/* addAll: files are stat'ed and hashed on worker threads, and only files
+ * whose stat data differs from their index entry are hashed at all. Blob
+ * writes stay on the calling thread since the object database is not safe
+ * for concurrent writers. A file modified at or after the time the index
+ * file was written may have changed again within the same tick after its
+ * entry was taken, so it is hashed whatever its stat data says, as racy-git
+ * handling in git does. */
+
+#define KGIT_ADD_UNCHANGED 0
+#define KGIT_ADD_CHANGED   1
+#define KGIT_ADD_FAILED    2
+
+typedef struct kgit_addjob {
+	const char *path;
+	char *fullpath;
+	int status;
+	struct stat st;
+	git_oid oid;
+	const git_index_entry *old;
+} kgit_addjob;
+
+typedef struct kgit_addall {
+	kgit_addjob *jobs;
+	struct timespec racy;
+} kgit_addall;
+
+static unsigned int kgit_index_mode(const struct stat *st)
+{
+	if (S_ISLNK(st->st_mode)) {
+		return 0120000;
+	}
+	return (st->st_mode & 0100) ? 0100755 : 0100644;
+}
+
+static int kgit_stat_matches(const git_index_entry *e, const struct stat *st, const struct timespec *racy)
+{
+	if (st->st_mtime > racy->tv_sec || (st->st_mtime == racy->tv_sec && kgit_st_mtime_nsec(st) >= racy->tv_nsec)) {
+		return 0;
+	}
+	return e != NULL &&
+		(git_time_t)st->st_mtime == e->mtime.seconds &&
+		(git_time_t)st->st_ctime == e->ctime.seconds &&
+		(git_off_t)st->st_size == e->file_size &&
+		(unsigned int)st->st_ino == e->ino &&
+		kgit_index_mode(st) == e->mode;
+}
+
+static int kgit_hash_path(git_oid *oid, const char *fullpath, const struct stat *st)
+{
+	if (S_ISLNK(st->st_mode)) {
+		char target[4096];
+		ssize_t len = readlink(fullpath, target, sizeof(target));
+		if (len < 0) {
+			return GIT_ENOTFOUND;
+		}
+		return git_odb_hash(oid, target, len, GIT_OBJ_BLOB);
+	}
+	return git_odb_hashfile(oid, fullpath, GIT_OBJ_BLOB);
+}
+
+static void kgit_addall_worker(void *arg, size_t i)
+{
+	kgit_addall *all = (kgit_addall *)arg;
+	kgit_addjob *job = &all->jobs[i];
+	if (lstat(job->fullpath, &job->st) < 0 || !(S_ISREG(job->st.st_mode) || S_ISLNK(job->st.st_mode))) {
+		job->status = KGIT_ADD_FAILED;
+		return;
+	}
+	if (kgit_stat_matches(job->old, &job->st, &all->racy)) {
+		job->status = KGIT_ADD_UNCHANGED;
+		return;
+	}
+	job->status = (kgit_hash_path(&job->oid, job->fullpath, &job->st) < GIT_SUCCESS) ? KGIT_ADD_FAILED : KGIT_ADD_CHANGED;
+}
+
+static int kgit_write_blob(git_odb *odb, const kgit_addjob *job)
+{
+	git_oid written;
+	char *buf;
+	ssize_t len;
+	int error;
+	if (git_odb_exists(odb, &job->oid)) {
+		return GIT_SUCCESS;
+	}
+	if (S_ISLNK(job->st.st_mode)) {
+		buf = (char *)malloc(4096);
+		len = (buf != NULL) ? readlink(job->fullpath, buf, 4096) : -1;
+	} else {
+		FILE *fp = fopen(job->fullpath, "rb");
+		buf = (char *)malloc(job->st.st_size + 1);
+		len = (fp != NULL && buf != NULL) ? (ssize_t)fread(buf, 1, job->st.st_size, fp) : -1;
+		if (fp != NULL) fclose(fp);
+	}
+	if (len < 0) {
+		free(buf);
+		return GIT_ENOTFOUND;
+	}
+	error = git_odb_write(&written, odb, buf, len, GIT_OBJ_BLOB);
+	free(buf);
+	if (error == GIT_SUCCESS && git_oid_cmp(&written, &job->oid) != 0) {
+		/* the file changed between hashing and writing */
+		error = GIT_EOBJCORRUPTED;
+	}
+	return error;
+}
+
+static void kgit_fill_entry(git_index_entry *e, const kgit_addjob *job)
+{
+	e->ctime.seconds = job->st.st_ctime;
+	e->ctime.nanoseconds = kgit_st_ctime_nsec(&job->st);
+	e->mtime.seconds = job->st.st_mtime;
+	e->mtime.nanoseconds = kgit_st_mtime_nsec(&job->st);
+	e->dev = job->st.st_dev;
+	e->ino = job->st.st_ino;
+	e->mode = kgit_index_mode(&job->st);
+	e->uid = job->st.st_uid;
+	e->gid = job->st.st_gid;
+	e->file_size = job->st.st_size;
+	git_oid_cpy(&e->oid, &job->oid);
+}
+
+static int kgit_addjob_cmp(const void *a, const void *b)
+{
+	return strcmp(((const kgit_addjob *)a)->path, ((const kgit_addjob *)b)->path);
+}
+
+/* Remove the stage 0 entry of 'path' appended by kgit_addall_merge() */
+static void kgit_index_unappend(git_index *index, const char *path)
+{
+	int position = git_index_find(index, path);
+	while (position > 0 && strcmp(git_index_get(index, position - 1)->path, path) == 0) {
+		position--;
+	}
+	for (; position >= 0 && (unsigned int)position < git_index_entrycount(index); position++) {
+		git_index_entry *e = git_index_get(index, position);
+		if (strcmp(e->path, path) != 0) {
+			break;
+		}
+		if (git_index_entry_stage(e) == 0) {
+			git_index_remove(index, position);
+			break;
+		}
+	}
+	kgit_index_touch_path(index, path);
+}
+
+/* Merge the entries of the changed files, sorted by path, into the index in
+ * one pass: new paths are appended without a lookup, for the index to sort
+ * them in once on its next search or write, and entries already there are
+ * updated in place. When an append fails, the ones before it are taken out
+ * again and the index is left as it was. */
+static int kgit_addall_merge(git_index *index, const kgit_addjob *jobs, size_t n, size_t *nchanged)
+{
+	size_t i, k;
+	int error;
+	for (i = 0; i < n; i++) {
+		git_index_entry entry;
+		if (jobs[i].status != KGIT_ADD_CHANGED || jobs[i].old != NULL) {
+			continue;
+		}
+		memset(&entry, 0, sizeof(git_index_entry));
+		kgit_fill_entry(&entry, &jobs[i]);
+		entry.path = (char *)jobs[i].path;
+		if ((error = git_index_append2(index, &entry)) < GIT_SUCCESS) {
+			for (k = 0; k < i; k++) {
+				if (jobs[k].status == KGIT_ADD_CHANGED && jobs[k].old == NULL) {
+					kgit_index_unappend(index, jobs[k].path);
+				}
+			}
+			return error;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (jobs[i].status != KGIT_ADD_CHANGED) {
+			continue;
+		}
+		if (jobs[i].old != NULL) {
+			/* entries are allocated one by one, so the pointer taken before
+			 * the appends still holds, while git_index_get() would sort the
+			 * appended entries in and shift the saved positions */
+			kgit_fill_entry((git_index_entry *)jobs[i].old, &jobs[i]);
+		}
+		kgit_index_touch_path(index, jobs[i].path);
+		(*nchanged)++;
+	}
+	return GIT_SUCCESS;
+}
+
 /* ------------------------------------------------------------------------ */
 
 /* fields */
@@ -142,12 +645,93 @@ KMETHOD GitIndex_add(CTX ctx, ksfp_t *sfp _RIX)
 	const char *path = sfp[1].pth->ospath;
 	int stage = Int_to(int, sfp[2]);
 	int error = git_index_add(index, path, stage);
+	kgit_index_touch_path(index, path);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_index_add", error);
 	}
 	RETURNvoid_();
 }
 
+/* Add or update stage 0 entries for many files in the working directory.
+ * Files whose stat data still matches their entry are skipped without being
+ * read; the others are hashed in parallel. Returns the number of entries
+ * added or updated, or -1 when a file could not be added, in which case the
+ * index is left as it was. */
+//## @Native int GitIndex.addAll(Array<Path> paths);
+KMETHOD GitIndex_addAll(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_index *index = RawPtr_to(git_index *, sfp[0]);
+	kArray *a = sfp[1].a;
+	size_t i, n = knh_Array_size(a), nchanged = 0;
+	git_repository *repo = NULL;
+	const char *workdir = (index != NULL) ? kgit_index_workdir(index, &repo) : NULL;
+	int error = GIT_SUCCESS;
+	if (workdir == NULL) {
+		KNH_NTRACE2(ctx, "git_index_add", K_FAILED, KNH_LDATA(LOG_msg("index is not backed by a working directory")));
+		RETURNi_(-1);
+	}
+	kgit_addall all;
+	all.jobs = (kgit_addjob *)calloc(n + 1, sizeof(kgit_addjob));
+	if (all.jobs == NULL) {
+		RETURNi_(-1);
+	}
+	kgit_index_mtime(index, &all.racy);
+	size_t wlen = strlen(workdir);
+	for (i = 0; i < n; i++) {
+		kgit_addjob *job = &all.jobs[i];
+		job->path = ((kPath *)a->list[i])->ospath;
+		job->fullpath = (char *)malloc(wlen + strlen(job->path) + 2);
+		if (job->fullpath == NULL) {
+			error = GIT_ENOMEM;
+			break;
+		}
+		sprintf(job->fullpath, "%s%s%s", workdir, (wlen > 0 && workdir[wlen - 1] != '/') ? "/" : "", job->path);
+	}
+	if (error == GIT_SUCCESS) {
+		/* look up existing entries before any thread starts; git_index_find
+		 * may sort the entry vector */
+		qsort(all.jobs, n, sizeof(kgit_addjob), kgit_addjob_cmp);
+		for (i = 0; i < n; i++) {
+			kgit_addjob *job = &all.jobs[i];
+			int position = git_index_find(index, job->path);
+			job->old = (position >= 0) ? git_index_get(index, position) : NULL;
+			if (job->old != NULL && git_index_entry_stage(job->old) != 0) {
+				job->old = NULL;
+			}
+		}
+		kgit_parallel_for(n, 0, kgit_addall_worker, &all);
+	}
+	git_odb *odb = git_repository_database(repo);
+	/* write the blobs first; the index is only changed once all are in */
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		kgit_addjob *job = &all.jobs[i];
+		if (i + 1 < n && strcmp(job->path, all.jobs[i + 1].path) == 0) {
+			job->status = KGIT_ADD_UNCHANGED;
+			continue;
+		}
+		if (job->status == KGIT_ADD_FAILED) {
+			error = GIT_ENOTFOUND;
+			TRACE_ERROR(ctx, job->path, error);
+			break;
+		}
+		if (job->status == KGIT_ADD_UNCHANGED) {
+			continue;
+		}
+		if ((error = kgit_write_blob(odb, job)) < GIT_SUCCESS) {
+			TRACE_ERROR(ctx, "git_odb_write", error);
+			break;
+		}
+	}
+	if (error == GIT_SUCCESS && (error = kgit_addall_merge(index, all.jobs, n, &nchanged)) < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_index_append2", error);
+	}
+	for (i = 0; i < n; i++) {
+		free(all.jobs[i].fullpath);
+	}
+	free(all.jobs);
+	RETURNi_((error < GIT_SUCCESS) ? -1 : (kint_t)nchanged);
+}
+
 /* Add (append) an index entry from a file in disk */
 //## @Native void GitIndex.append(Path path, int stage);
 KMETHOD GitIndex_append(CTX ctx, ksfp_t *sfp _RIX)
@@ -156,6 +740,7 @@ KMETHOD GitIndex_append(CTX ctx, ksfp_t *sfp _RIX)
 	const char *path = sfp[1].pth->ospath;
 	int stage = Int_to(int, sfp[2]);
 	int error = git_index_append(index, path, stage);
+	kgit_index_touch_path(index, path);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_index_append", error);
 	}
@@ -169,6 +754,7 @@ KMETHOD GitIndex_append(CTX ctx, ksfp_t *sfp _RIX)
 KMETHOD GitIndex_clear(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index_clear(RawPtr_to(git_index *, sfp[0]));
+	kgit_index_touch(RawPtr_to(git_index *, sfp[0]));
 	RETURNvoid_();
 }
 
@@ -200,7 +786,7 @@ KMETHOD GitIndex_find(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index *index = RawPtr_to(git_index *, sfp[0]);
 	const char *path = sfp[1].pth->ospath;
-	int i = git_index_find(index, path);
+	int i = kgit_index_find(index, path);
 	if (i < 0) {
 		KNH_NTRACE2(ctx, "git_index_find", K_FAILED, KNH_LDATA0);
 		RETURN_(KNH_TNULL(Int));
@@ -208,6 +794,23 @@ KMETHOD GitIndex_find(CTX ctx, ksfp_t *sfp _RIX)
 	RETURNi_(i);
 }
 
+/* Find the positions of the first entries for many paths at once; paths
+ * that are not in the index are reported as -1 */
+//## @Native Array<int> GitIndex.findMany(Array<String> paths);
+KMETHOD GitIndex_findMany(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_index *index = RawPtr_to(git_index *, sfp[0]);
+	kArray *paths = sfp[1].a;
+	size_t i, n = knh_Array_size(paths);
+	kArray *a = new_Array(ctx, CLASS_Int, n);
+	for (i = 0; i < n; i++) {
+		int position = (index != NULL) ? kgit_index_find(index, S_totext(paths->strings[i])) : GIT_ENOTFOUND;
+		a->ilist[i] = (position < 0) ? -1 : position;
+	}
+	a->size = n;
+	RETURN_(a);
+}
+
 /* Free an existing index object. */
 //## @Native void GitIndex.free();
 KMETHOD GitIndex_free(CTX ctx, ksfp_t *sfp _RIX)
@@ -265,7 +868,7 @@ KMETHOD GitIndex_open(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index *index;
 	const char *index_path = S_totext(sfp[1].s);
-	int error = git_index_open(&index, index_path);
+	int error = kgit_index_open(&index, NULL, index_path);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_index_open", error);
 		RETURN_(KNH_NULL);
@@ -279,9 +882,17 @@ KMETHOD GitIndex_open(CTX ctx, ksfp_t *sfp _RIX)
 KMETHOD GitIndex_read(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index *index = RawPtr_to(git_index *, sfp[0]);
-	int error = git_index_read(index);
+	kgit_index_touch(index);
+	int error = kgit_index_load(index);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_index_read", error);
+	} else {
+		pthread_mutex_lock(&indexdata_lock);
+		kgit_indexdata *d = kgit_indexdata_get(index, 0);
+		if (d != NULL && d->path != NULL && d->cachetree == NULL) {
+			d->cachetree = kgit_cachetree_read(d->path);
+		}
+		pthread_mutex_unlock(&indexdata_lock);
 	}
 	RETURNvoid_();
 }
@@ -292,29 +903,133 @@ KMETHOD GitIndex_remove(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index *index = RawPtr_to(git_index *, sfp[0]);
 	int position = Int_to(int, sfp[1]);
+	git_index_entry *entry = git_index_get(index, position);
+	char *path = (entry != NULL) ? strdup(entry->path) : NULL;
 	int error = git_index_remove(index, position);
+	if (path != NULL) {
+		kgit_index_touch_path(index, path);
+		free(path);
+	}
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_index_remove", error);
 	}
 	RETURNvoid_();
 }
 
+/* Copy every entry of the index into a columnar snapshot in one pass */
+//## @Native GitIndexSnapshot GitIndex.snapshot();
+KMETHOD GitIndex_snapshot(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_index *index = RawPtr_to(git_index *, sfp[0]);
+	if (index == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	unsigned int i, n = git_index_entrycount(index);
+	size_t len = 0;
+	for (i = 0; i < n; i++) {
+		len += strlen(git_index_get(index, i)->path) + 1;
+	}
+	kgit_index_snapshot *snap = (kgit_index_snapshot *)KNH_MALLOC(ctx, sizeof(kgit_index_snapshot));
+	memset(snap, 0, sizeof(kgit_index_snapshot));
+	snap->paths = (char *)malloc(len + 1);
+	snap->offsets = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+	snap->oids = (git_oid *)malloc((n + 1) * sizeof(git_oid));
+	snap->mtimes = (git_time_t *)malloc((n + 1) * sizeof(git_time_t));
+	snap->sizes = (git_off_t *)malloc((n + 1) * sizeof(git_off_t));
+	snap->modes = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+	snap->stages = (uint8_t *)malloc(n + 1);
+	if (snap->paths == NULL || snap->offsets == NULL || snap->oids == NULL || snap->mtimes == NULL ||
+			snap->sizes == NULL || snap->modes == NULL || snap->stages == NULL) {
+		kgit_index_snapshot_free(ctx, snap);
+		KNH_NTRACE2(ctx, "git_index_snapshot", K_FAILED, KNH_LDATA(LOG_msg("out of memory")));
+		RETURN_(KNH_NULL);
+	}
+	len = 0;
+	for (i = 0; i < n; i++) {
+		const git_index_entry *e = git_index_get(index, i);
+		size_t plen = strlen(e->path) + 1;
+		memcpy(snap->paths + len, e->path, plen);
+		snap->offsets[i] = (uint32_t)len;
+		len += plen;
+		git_oid_cpy(&snap->oids[i], &e->oid);
+		snap->mtimes[i] = e->mtime.seconds;
+		snap->sizes[i] = e->file_size;
+		snap->modes[i] = e->mode;
+		snap->stages[i] = (uint8_t)git_index_entry_stage(e);
+	}
+	snap->size = n;
+	RETURN_(new_ReturnRawPtr(ctx, sfp, snap));
+}
+
+/* Enable or disable the path hash index used by find() and findMany(). The
+ * table is rebuilt lazily on the first lookup after the index changes. */
+//## @Native void GitIndex.usePathIndex(boolean enable);
+KMETHOD GitIndex_usePathIndex(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_index *index = RawPtr_to(git_index *, sfp[0]);
+	int enable = Boolean_to(int, sfp[1]);
+	if (index != NULL) {
+		pthread_mutex_lock(&indexdata_lock);
+		kgit_indexdata *d = kgit_indexdata_get(index, enable);
+		if (d != NULL) {
+			d->use_pathindex = enable;
+			d->pathindex_valid = 0;
+		}
+		pthread_mutex_unlock(&indexdata_lock);
+	}
+	RETURNvoid_();
+}
+
+/* Write the index as a split index: a shared index file holding most
+ * entries, and an index file holding only the entries changed since the
+ * shared index was written. Disabling it writes a plain index file again. */
+//## @Native void GitIndex.useSplitIndex(boolean enable);
+KMETHOD GitIndex_useSplitIndex(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_index *index = RawPtr_to(git_index *, sfp[0]);
+	int enable = Boolean_to(int, sfp[1]);
+	if (index != NULL) {
+		pthread_mutex_lock(&indexdata_lock);
+		kgit_indexdata *d = kgit_indexdata_get(index, 0);
+		if (d != NULL && d->path != NULL) {
+			d->split = enable;
+		} else if (enable) {
+			KNH_NTRACE2(ctx, "git_index_split", K_FAILED, KNH_LDATA(LOG_msg("index has no file")));
+		}
+		pthread_mutex_unlock(&indexdata_lock);
+	}
+	RETURNvoid_();
+}
+
 /* Remove all entries with equal path except last added */
 //## @Native void GitIndex.uniq();
 KMETHOD GitIndex_uniq(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index *index = RawPtr_to(git_index *, sfp[0]);
 	git_index_uniq(index);
+	kgit_index_touch(index);
 	RETURNvoid_();
 }
 
 /* Write an existing index object from memory back to disk using an atomic file
- * lock. */
+ * lock. A valid cache-tree is saved with it as the TREE extension. */
 //## @Native void GitIndex.write();
 KMETHOD GitIndex_write(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index *index = RawPtr_to(git_index *, sfp[0]);
-	int error = git_index_write(index);
+	int error;
+	pthread_mutex_lock(&indexdata_lock);
+	kgit_indexdata *d = kgit_indexdata_get(index, 0);
+	if (d != NULL && (d->split || d->shared != NULL || d->detached)) {
+		error = kgit_splitindex_write(index, d->path, &d->shared, d->split);
+	} else {
+		error = git_index_write(index);
+	}
+	if (error == GIT_SUCCESS && d != NULL && d->path != NULL && d->cachetree != NULL && d->cachetree->entry_count >= 0) {
+		/* neither writer above writes extensions */
+		error = kgit_cachetree_write(d->path, d->cachetree);
+	}
+	pthread_mutex_unlock(&indexdata_lock);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_index_write", error);
 	}
@@ -323,6 +1038,116 @@ KMETHOD GitIndex_write(CTX ctx, ksfp_t *sfp _RIX)
 
 /* ------------------------------------------------------------------------ */
 
+static void kGitIndexSnapshot_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitIndexSnapshot_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_index_snapshot_free(ctx, (kgit_index_snapshot *)po->rawptr);
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitIndexSnapshot(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitIndexSnapshot";
+	cdef->init = kGitIndexSnapshot_init;
+	cdef->free = kGitIndexSnapshot_free;
+}
+
+static long GitIndexSnapshot_index(ksfp_t *sfp)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	kint_t n = Int_to(kint_t, sfp[1]);
+	if (snap == NULL || n < 0 || (size_t)n >= snap->size) {
+		return -1;
+	}
+	return (long)n;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Get the file size of the n-th entry of a snapshot */
+//## @Native int GitIndexSnapshot.fileSize(int n);
+KMETHOD GitIndexSnapshot_fileSize(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	long n = GitIndexSnapshot_index(sfp);
+	RETURNi_((n >= 0) ? snap->sizes[n] : -1);
+}
+
+/* Free a snapshot */
+//## @Native void GitIndexSnapshot.free();
+KMETHOD GitIndexSnapshot_free(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kGitIndexSnapshot_free(ctx, sfp[0].p);
+	RETURNvoid_();
+}
+
+/* Get the id of the n-th entry of a snapshot */
+//## @Native GitOid GitIndexSnapshot.id(int n);
+KMETHOD GitIndexSnapshot_id(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	long n = GitIndexSnapshot_index(sfp);
+	if (n < 0) {
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_GitOidCopy(ctx, sfp, &snap->oids[n]));
+}
+
+/* Get the mode of the n-th entry of a snapshot */
+//## @Native int GitIndexSnapshot.mode(int n);
+KMETHOD GitIndexSnapshot_mode(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	long n = GitIndexSnapshot_index(sfp);
+	RETURNi_((n >= 0) ? (kint_t)snap->modes[n] : -1);
+}
+
+/* Get the modification time of the n-th entry of a snapshot */
+//## @Native int GitIndexSnapshot.mtime(int n);
+KMETHOD GitIndexSnapshot_mtime(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	long n = GitIndexSnapshot_index(sfp);
+	RETURNi_((n >= 0) ? snap->mtimes[n] : -1);
+}
+
+/* Get the path of the n-th entry of a snapshot */
+//## @Native String GitIndexSnapshot.path(int n);
+KMETHOD GitIndexSnapshot_path(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	long n = GitIndexSnapshot_index(sfp);
+	if (n < 0) {
+		RETURN_(KNH_TNULL(String));
+	}
+	RETURN_(new_String(ctx, snap->paths + snap->offsets[n]));
+}
+
+/* Get the number of entries in a snapshot */
+//## @Native int GitIndexSnapshot.size();
+KMETHOD GitIndexSnapshot_size(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	RETURNi_((snap != NULL) ? snap->size : 0);
+}
+
+/* Get the stage of the n-th entry of a snapshot */
+//## @Native int GitIndexSnapshot.stage(int n);
+KMETHOD GitIndexSnapshot_stage(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_index_snapshot *snap = RawPtr_to(kgit_index_snapshot *, sfp[0]);
+	long n = GitIndexSnapshot_index(sfp);
+	RETURNi_((n >= 0) ? snap->stages[n] : -1);
+}
+
+/* ------------------------------------------------------------------------ */
+
 #ifdef __cplusplus
 }
 #endif
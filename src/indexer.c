@@ -30,12 +30,768 @@
 // **************************************************************************
 
 #include <konoha1.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "libgit2.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* ------------------------------------------------------------------------ */
+/* The indexer reads a packfile in two passes. The first pass walks the pack
+ * in order, which it must do to find where each object ends: it records
+ * every object, computes its CRC32, and hashes the objects stored whole.
+ * It is a stream parser fed with whatever bytes are at hand, so it can run
+ * while a pack is still being received (append) as well as over a file on
+ * disk (run); either way the whole pack is read only once in this pass.
+ * The second pass resolves deltas. Each base object is the root of a tree
+ * of deltas built on it; the trees are handed out to a pool of threads, and
+ * each thread walks its tree depth-first, so the base of a delta is always
+ * the inflated parent held on its own stack.
+ * Progress is kept in counters that are updated atomically, so another
+ * thread may read them while indexing runs. A progress callback is only
+ * ever called on the thread that started indexing: between the chunks fed
+ * to the first pass, and between deltas resolved on that thread. */
+
+enum {
+	KGIT_STREAM_HEADER,
+	KGIT_STREAM_OBJECT,
+	KGIT_STREAM_INFLATE,
+	KGIT_STREAM_TRAILER,
+	KGIT_STREAM_DONE
+};
+
+typedef struct kgit_indexer {
+	char *packname;
+	int nthreads;
+	kgit_packentry *entries;
+	size_t nentries;
+	git_oid hash;
+	int indexed;
+	/* first pass state */
+	int state;
+	int fd;                /* packfile being written by append(), or -1 */
+	size_t current;        /* entry being parsed */
+	uint64_t offset;       /* bytes parsed so far */
+	unsigned char buf[KGIT_PACK_HEADER_MAX];
+	size_t buflen;         /* partial header or trailer held in buf */
+	kgit_sha1_ctx pack_sha1;
+	kgit_sha1_ctx object_sha1;
+	z_stream zs;
+	int zs_ready;
+	unsigned char *scratch;
+	/* progress */
+	size_t received;       /* objects parsed by the first pass */
+	size_t processed;      /* objects whose id is known */
+	size_t resolved;       /* deltas resolved */
+	uint64_t hashed;       /* bytes of object data hashed */
+	uint64_t started;      /* in milliseconds */
+	uint64_t stopped;      /* 0 while indexing */
+	int (*progress)(void *arg);
+	void *progress_arg;
+	uint64_t interval;
+	uint64_t reported;
+	pthread_t owner;
+	int cancelled;
+} kgit_indexer;
+
+#define KGIT_SCRATCH_SIZE  65536
+
+typedef struct kgit_resolver {
+	kgit_indexer *idx;
+	const unsigned char *data;
+	kgit_packentry **roots;
+	size_t nroots;
+	kgit_packentry **ofs;  /* OFS_DELTA entries by base offset */
+	size_t nofs;
+	kgit_packentry **ref;  /* REF_DELTA entries by base id */
+	size_t nref;
+	int hash_roots;        /* roots are not hashed yet */
+	int error;
+} kgit_resolver;
+
+static uint64_t kgit_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static kgit_indexer *kgit_indexer_new(const char *packname)
+{
+	kgit_indexer *idx = (kgit_indexer *)calloc(1, sizeof(kgit_indexer));
+	if (idx == NULL || (idx->packname = strdup(packname)) == NULL) {
+		free(idx);
+		return NULL;
+	}
+	idx->fd = -1;
+	return idx;
+}
+
+static void kgit_indexer_reset(kgit_indexer *idx)
+{
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->nentries = 0;
+	idx->indexed = 0;
+	idx->state = KGIT_STREAM_HEADER;
+	idx->current = 0;
+	idx->offset = 0;
+	idx->buflen = 0;
+	kgit_sha1_init(&idx->pack_sha1);
+	idx->received = 0;
+	idx->processed = 0;
+	idx->resolved = 0;
+	idx->hashed = 0;
+	idx->started = kgit_now();
+	idx->stopped = 0;
+	idx->reported = idx->started;
+	idx->cancelled = 0;
+}
+
+/* Call the progress callback if one is set, we are on the thread that set
+ * it, and 'interval' milliseconds have passed since the last call (or
+ * 'force' is set). Returns GIT_ERROR once the callback has asked to stop. */
+static int kgit_indexer_tick(kgit_indexer *idx, int force)
+{
+	if (idx->progress != NULL && !idx->cancelled && pthread_equal(pthread_self(), idx->owner)) {
+		uint64_t now = kgit_now();
+		if (force || now - idx->reported >= idx->interval) {
+			idx->reported = now;
+			idx->cancelled = (idx->progress(idx->progress_arg) != 0);
+		}
+	}
+	return idx->cancelled ? GIT_ERROR : GIT_SUCCESS;
+}
+
+static void kgit_indexer_free(kgit_indexer *idx)
+{
+	if (idx->fd >= 0) {
+		close(idx->fd);
+	}
+	if (idx->zs_ready) {
+		inflateEnd(&idx->zs);
+	}
+	free(idx->scratch);
+	free(idx->packname);
+	free(idx->entries);
+	free(idx);
+}
+
+static int kgit_ofs_cmp(const void *a, const void *b)
+{
+	uint64_t x = (*(kgit_packentry *const *)a)->base_offset;
+	uint64_t y = (*(kgit_packentry *const *)b)->base_offset;
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static int kgit_ref_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&(*(kgit_packentry *const *)a)->base_oid, &(*(kgit_packentry *const *)b)->base_oid);
+}
+
+/* Position of the first delta whose base is at 'offset' */
+static size_t kgit_ofs_lower(const kgit_resolver *r, uint64_t offset)
+{
+	size_t lo = 0, hi = r->nofs;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (r->ofs[mid]->base_offset < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Position of the first delta whose base is 'oid' */
+static size_t kgit_ref_lower(const kgit_resolver *r, const git_oid *oid)
+{
+	size_t lo = 0, hi = r->nref;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (git_oid_cmp(&r->ref[mid]->base_oid, oid) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int kgit_has_children(const kgit_resolver *r, const kgit_packentry *e)
+{
+	size_t i = kgit_ofs_lower(r, e->offset), j = kgit_ref_lower(r, &e->oid);
+	return (i < r->nofs && r->ofs[i]->base_offset == e->offset) ||
+		(j < r->nref && git_oid_cmp(&r->ref[j]->base_oid, &e->oid) == 0);
+}
+
+/* Inflate the data of an entry; the buffer is malloc'ed. */
+static unsigned char *kgit_entry_inflate(const unsigned char *data, const kgit_packentry *e)
+{
+	size_t used;
+	unsigned char *buf = (unsigned char *)malloc(e->size + 1);
+	if (buf != NULL && kgit_pack_inflate(data + e->data_offset, e->end - e->data_offset, buf, e->size, &used) < GIT_SUCCESS) {
+		free(buf);
+		buf = NULL;
+	}
+	return buf;
+}
+
+static void kgit_resolve_children(kgit_resolver *r, const kgit_packentry *base, const unsigned char *data, size_t len);
+
+static void kgit_resolve_delta(kgit_resolver *r, kgit_packentry *e, const kgit_packentry *base, const unsigned char *data, size_t len)
+{
+	unsigned char *delta, *result;
+	size_t resultlen;
+	/* a base id may appear twice in a pack; resolve each delta once */
+	if (!__sync_bool_compare_and_swap(&e->real_type, GIT_OBJ_BAD, base->real_type)) {
+		return;
+	}
+	delta = kgit_entry_inflate(r->data, e);
+	if (delta == NULL || kgit_delta_apply(&result, &resultlen, data, len, delta, e->size) < GIT_SUCCESS) {
+		free(delta);
+		r->error = GIT_EOBJCORRUPTED;
+		return;
+	}
+	free(delta);
+	e->depth = base->depth + 1;
+	kgit_object_hash(&e->oid, e->real_type, result, resultlen);
+	__sync_fetch_and_add(&r->idx->hashed, (uint64_t)resultlen);
+	__sync_fetch_and_add(&r->idx->processed, 1);
+	__sync_fetch_and_add(&r->idx->resolved, 1);
+	if (kgit_indexer_tick(r->idx, 0) < GIT_SUCCESS) {
+		r->error = GIT_ERROR;
+	}
+	kgit_resolve_children(r, e, result, resultlen);
+	free(result);
+}
+
+static void kgit_resolve_children(kgit_resolver *r, const kgit_packentry *base, const unsigned char *data, size_t len)
+{
+	size_t i;
+	for (i = kgit_ofs_lower(r, base->offset); i < r->nofs && r->error == GIT_SUCCESS; i++) {
+		kgit_packentry *e = r->ofs[i];
+		if (e->base_offset != base->offset) {
+			break;
+		}
+		kgit_resolve_delta(r, e, base, data, len);
+	}
+	for (i = kgit_ref_lower(r, &base->oid); i < r->nref && r->error == GIT_SUCCESS; i++) {
+		kgit_packentry *e = r->ref[i];
+		if (git_oid_cmp(&e->base_oid, &base->oid) != 0) {
+			break;
+		}
+		kgit_resolve_delta(r, e, base, data, len);
+	}
+}
+
+static void kgit_resolve_worker(void *arg, size_t i)
+{
+	kgit_resolver *r = (kgit_resolver *)arg;
+	kgit_packentry *root = r->roots[i];
+	if (r->error != GIT_SUCCESS || (!r->hash_roots && !kgit_has_children(r, root))) {
+		return;
+	}
+	unsigned char *data = kgit_entry_inflate(r->data, root);
+	if (data == NULL) {
+		r->error = GIT_EOBJCORRUPTED;
+		return;
+	}
+	if (r->hash_roots) {
+		kgit_object_hash(&root->oid, root->type, data, root->size);
+		__sync_fetch_and_add(&r->idx->hashed, root->size);
+		__sync_fetch_and_add(&r->idx->processed, 1);
+	}
+	kgit_resolve_children(r, root, data, root->size);
+	free(data);
+}
+
+/* Take up to 'want' bytes into the header buffer; returns the number taken. */
+static size_t kgit_stream_take(kgit_indexer *idx, const unsigned char *p, size_t len, size_t want)
+{
+	size_t n = (want - idx->buflen < len) ? want - idx->buflen : len;
+	memcpy(idx->buf + idx->buflen, p, n);
+	idx->buflen += n;
+	return n;
+}
+
+static int kgit_stream_header(kgit_indexer *idx)
+{
+	uint32_t version = kgit_be32(idx->buf + 4);
+	if (memcmp(idx->buf, "PACK", 4) != 0 || (version != 2 && version != 3)) {
+		return GIT_EOBJCORRUPTED;
+	}
+	idx->nentries = kgit_be32(idx->buf + 8);
+	idx->entries = (kgit_packentry *)calloc(idx->nentries + 1, sizeof(kgit_packentry));
+	if (idx->entries == NULL) {
+		return GIT_ENOMEM;
+	}
+	if (idx->scratch == NULL && (idx->scratch = (unsigned char *)malloc(KGIT_SCRATCH_SIZE)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	kgit_sha1_update(&idx->pack_sha1, idx->buf, 12);
+	idx->offset = 12;
+	idx->buflen = 0;
+	idx->state = (idx->nentries > 0) ? KGIT_STREAM_OBJECT : KGIT_STREAM_TRAILER;
+	return GIT_SUCCESS;
+}
+
+/* Parse the header of the next object once enough of it is buffered;
+ * returns how many of the 'n' bytes just buffered belong to it. */
+static long kgit_stream_object(kgit_indexer *idx, size_t n)
+{
+	kgit_packentry *e = &idx->entries[idx->current];
+	size_t hdrlen = kgit_pack_header(e, idx->buf, idx->buflen, idx->offset);
+	if (hdrlen == 0) {
+		return (idx->buflen < KGIT_PACK_HEADER_MAX) ? (long)n : -1;
+	}
+	n -= idx->buflen - hdrlen;
+	idx->buflen = 0;
+	e->data_offset = idx->offset + hdrlen;
+	e->crc = (uint32_t)crc32(0, idx->buf, (uInt)hdrlen);
+	kgit_sha1_update(&idx->pack_sha1, idx->buf, hdrlen);
+	idx->offset += hdrlen;
+	if (!kgit_pack_isdelta(e->type)) {
+		kgit_object_hash_init(&idx->object_sha1, e->type, e->size);
+	}
+	if (idx->zs_ready) {
+		inflateReset(&idx->zs);
+	} else {
+		memset(&idx->zs, 0, sizeof(z_stream));
+		if (inflateInit(&idx->zs) != Z_OK) {
+			return -1;
+		}
+		idx->zs_ready = 1;
+	}
+	idx->state = KGIT_STREAM_INFLATE;
+	return (long)n;
+}
+
+/* Inflate the current object from 'p'; returns the number of bytes used. */
+static long kgit_stream_inflate(kgit_indexer *idx, const unsigned char *p, size_t len)
+{
+	kgit_packentry *e = &idx->entries[idx->current];
+	int status = Z_OK;
+	idx->zs.next_in = (Bytef *)p;
+	idx->zs.avail_in = (len > 0x40000000) ? 0x40000000 : (uInt)len;
+	while (status == Z_OK && idx->zs.avail_in > 0) {
+		idx->zs.next_out = idx->scratch;
+		idx->zs.avail_out = KGIT_SCRATCH_SIZE;
+		status = inflate(&idx->zs, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END) {
+			return -1;
+		}
+		if (!kgit_pack_isdelta(e->type)) {
+			kgit_sha1_update(&idx->object_sha1, idx->scratch, KGIT_SCRATCH_SIZE - idx->zs.avail_out);
+		}
+	}
+	size_t used = (size_t)(idx->zs.next_in - p);
+	e->crc = (uint32_t)crc32(e->crc, p, (uInt)used);
+	kgit_sha1_update(&idx->pack_sha1, p, used);
+	idx->offset += used;
+	if (status == Z_STREAM_END) {
+		if (idx->zs.total_out != e->size) {
+			return -1;
+		}
+		if (!kgit_pack_isdelta(e->type)) {
+			kgit_sha1_final(&e->oid, &idx->object_sha1);
+			__sync_fetch_and_add(&idx->hashed, (uint64_t)e->size);
+			__sync_fetch_and_add(&idx->processed, 1);
+		}
+		e->end = idx->offset;
+		idx->current++;
+		__sync_fetch_and_add(&idx->received, 1);
+		idx->state = (idx->current < idx->nentries) ? KGIT_STREAM_OBJECT : KGIT_STREAM_TRAILER;
+	}
+	return (long)used;
+}
+
+/* Feed the next bytes of the pack to the first pass. */
+static int kgit_indexer_feed(kgit_indexer *idx, const unsigned char *p, size_t len)
+{
+	while (len > 0) {
+		long n;
+		switch (idx->state) {
+		case KGIT_STREAM_HEADER:
+			n = (long)kgit_stream_take(idx, p, len, 12);
+			if (idx->buflen == 12) {
+				int error = kgit_stream_header(idx);
+				if (error < GIT_SUCCESS) {
+					return error;
+				}
+			}
+			break;
+		case KGIT_STREAM_OBJECT:
+			n = kgit_stream_object(idx, kgit_stream_take(idx, p, len, KGIT_PACK_HEADER_MAX));
+			break;
+		case KGIT_STREAM_INFLATE:
+			n = kgit_stream_inflate(idx, p, len);
+			break;
+		case KGIT_STREAM_TRAILER:
+			n = (long)kgit_stream_take(idx, p, len, GIT_OID_RAWSZ);
+			if (idx->buflen == GIT_OID_RAWSZ) {
+				kgit_sha1_final(&idx->hash, &idx->pack_sha1);
+				if (memcmp(idx->hash.id, idx->buf, GIT_OID_RAWSZ) != 0) {
+					return GIT_EOBJCORRUPTED;
+				}
+				idx->state = KGIT_STREAM_DONE;
+			}
+			break;
+		default:
+			/* trailing garbage */
+			return GIT_EOBJCORRUPTED;
+		}
+		if (n < 0) {
+			return GIT_EOBJCORRUPTED;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return GIT_SUCCESS;
+}
+
+static int kgit_indexer_resolve(kgit_indexer *idx, const unsigned char *data, int hash_roots)
+{
+	kgit_resolver r;
+	size_t i, ndeltas;
+	memset(&r, 0, sizeof(kgit_resolver));
+	r.idx = idx;
+	r.data = data;
+	r.hash_roots = hash_roots;
+	r.roots = (kgit_packentry **)malloc((idx->nentries + 1) * sizeof(kgit_packentry *));
+	r.ofs = (kgit_packentry **)malloc((idx->nentries + 1) * sizeof(kgit_packentry *));
+	r.ref = (kgit_packentry **)malloc((idx->nentries + 1) * sizeof(kgit_packentry *));
+	if (r.roots == NULL || r.ofs == NULL || r.ref == NULL) {
+		r.error = GIT_ENOMEM;
+	}
+	for (i = 0; i < idx->nentries && r.error == GIT_SUCCESS; i++) {
+		kgit_packentry *e = &idx->entries[i];
+		if (e->type == GIT_OBJ_OFS_DELTA) {
+			r.ofs[r.nofs++] = e;
+		} else if (e->type == GIT_OBJ_REF_DELTA) {
+			r.ref[r.nref++] = e;
+		} else {
+			r.roots[r.nroots++] = e;
+		}
+	}
+	ndeltas = r.nofs + r.nref;
+	if (r.error == GIT_SUCCESS) {
+		qsort(r.ofs, r.nofs, sizeof(kgit_packentry *), kgit_ofs_cmp);
+		qsort(r.ref, r.nref, sizeof(kgit_packentry *), kgit_ref_cmp);
+		kgit_parallel_for(r.nroots, idx->nthreads, kgit_resolve_worker, &r);
+	}
+	if (r.error == GIT_SUCCESS && idx->resolved != ndeltas) {
+		/* a thin pack, whose bases live outside of it */
+		r.error = GIT_ENOTFOUND;
+	}
+	free(r.roots);
+	free(r.ofs);
+	free(r.ref);
+	return r.error;
+}
+
+/* Finish indexing once the first pass has seen the whole pack. */
+static int kgit_indexer_finish(kgit_indexer *idx, const char **msg)
+{
+	struct stat st;
+	unsigned char *data = NULL;
+	size_t size = 0;
+	int error = GIT_EOBJCORRUPTED;
+	int fd = open(idx->packname, O_RDONLY);
+	*msg = "truncated packfile";
+	if (idx->state == KGIT_STREAM_DONE && fd < 0) {
+		*msg = "cannot read packfile";
+		error = GIT_ENOTFOUND;
+	} else if (idx->state == KGIT_STREAM_DONE) {
+		if (fstat(fd, &st) == 0 && (uint64_t)st.st_size == idx->offset + GIT_OID_RAWSZ) {
+			size = (size_t)st.st_size;
+			data = (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		if (data != NULL && data != MAP_FAILED) {
+			*msg = "unresolved delta";
+			error = kgit_indexer_resolve(idx, data, 0);
+			munmap(data, size);
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_indexer_tick(idx, 1);
+	}
+	if (idx->cancelled) {
+		*msg = "cancelled";
+	}
+	idx->stopped = kgit_now();
+	idx->indexed = (error == GIT_SUCCESS);
+	return error;
+}
+
+static int kgit_indexer_run(kgit_indexer *idx, const char **msg)
+{
+	unsigned char *chunk = (unsigned char *)malloc(KGIT_SCRATCH_SIZE * 16);
+	int error = GIT_SUCCESS;
+	int fd = open(idx->packname, O_RDONLY);
+	ssize_t n;
+	*msg = "cannot read packfile";
+	if (fd < 0 || chunk == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(chunk);
+		return (fd < 0) ? GIT_ENOTFOUND : GIT_ENOMEM;
+	}
+	kgit_indexer_reset(idx);
+	*msg = "corrupted packfile";
+	while (error == GIT_SUCCESS && (n = read(fd, chunk, KGIT_SCRATCH_SIZE * 16)) > 0) {
+		error = kgit_indexer_feed(idx, chunk, (size_t)n);
+		if (error == GIT_SUCCESS && kgit_indexer_tick(idx, 0) < GIT_SUCCESS) {
+			*msg = "cancelled";
+			error = GIT_ERROR;
+		}
+	}
+	close(fd);
+	free(chunk);
+	if (error < GIT_SUCCESS) {
+		idx->stopped = kgit_now();
+		return error;
+	}
+	return kgit_indexer_finish(idx, msg);
+}
+
+/* Close the packfile written by append() and finish indexing it. */
+static int kgit_indexer_commit(kgit_indexer *idx, const char **msg)
+{
+	int error;
+	*msg = "no pack was appended";
+	if (idx == NULL || idx->fd < 0) {
+		return GIT_ERROR;
+	}
+	error = (close(idx->fd) == 0) ? GIT_SUCCESS : GIT_ERROR;
+	idx->fd = -1;
+	return (error == GIT_SUCCESS) ? kgit_indexer_finish(idx, msg) : error;
+}
+
+/* ------------------------------------------------------------------------ */
+/* The pack verifier takes the list of objects from the .idx instead of
+ * walking the pack in order, so the headers and CRC32s of all objects are
+ * checked in parallel while one more thread hashes the whole pack for its
+ * trailer. The resolver then hashes every object, bases included, and the
+ * ids are compared with the ones in the .idx. */
+
+typedef struct kgit_verifier {
+	const unsigned char *data;
+	size_t size;
+	const kgit_packidx *pidx;
+	kgit_packentry *entries;  /* in .idx order */
+	size_t n;
+	git_oid checksum;         /* of the pack, without its trailer */
+	size_t bad;               /* a corrupted entry, or n */
+} kgit_verifier;
+
+static int kgit_offset_cmp(const void *a, const void *b)
+{
+	const kgit_packentry *x = *(const kgit_packentry **)a, *y = *(const kgit_packentry **)b;
+	return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+static void kgit_verify_worker(void *arg, size_t i)
+{
+	kgit_verifier *v = (kgit_verifier *)arg;
+	if (i == 0) {
+		kgit_sha1_ctx sha1;
+		kgit_sha1_init(&sha1);
+		kgit_sha1_update(&sha1, v->data, v->size - GIT_OID_RAWSZ);
+		kgit_sha1_final(&v->checksum, &sha1);
+		return;
+	}
+	i--;
+	kgit_packentry *e = &v->entries[i];
+	uint64_t off = e->offset, end = e->end;
+	uint32_t crc = 0;
+	size_t hdrlen = kgit_pack_header(e, v->data + off, (size_t)(end - off), off);
+	if (hdrlen == 0) {
+		__sync_bool_compare_and_swap(&v->bad, v->n, i);
+		return;
+	}
+	e->data_offset = off + hdrlen;
+	while (off < end) {
+		uInt len = (end - off > 0x40000000) ? 0x40000000 : (uInt)(end - off);
+		crc = (uint32_t)crc32(crc, v->data + off, len);
+		off += len;
+	}
+	e->crc = crc;
+	if (crc != kgit_be32(v->pidx->crcs + i * 4)) {
+		__sync_bool_compare_and_swap(&v->bad, v->n, i);
+	}
+}
+
+/* Verify the packfile at 'pack_path' against the .idx next to it; on
+ * success 'stats' holds the delta chain lengths, whose array the caller
+ * frees. On failure, 'stats->bad' is the id of the corrupted object, if
+ * the failure is about a single object. */
+int kgit_pack_verify(kgit_packstats *stats, const char *pack_path, int nthreads, const char **msg)
+{
+	kgit_packidx pidx;
+	kgit_verifier v;
+	kgit_indexer *idx = NULL;
+	kgit_packentry **sorted = NULL;
+	size_t i, len = strlen(pack_path);
+	char *idx_path;
+	int error;
+	memset(stats, 0, sizeof(kgit_packstats));
+	memset(&v, 0, sizeof(kgit_verifier));
+	*msg = "not a .pack file";
+	if (len < 5 || strcmp(pack_path + len - 5, ".pack") != 0) {
+		return GIT_ENOTFOUND;
+	}
+	if ((idx_path = (char *)malloc(len)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	memcpy(idx_path, pack_path, len - 5);
+	strcpy(idx_path + len - 5, ".idx");
+	error = kgit_packidx_open(&pidx, idx_path);
+	free(idx_path);
+	if (error < GIT_SUCCESS) {
+		*msg = (error == GIT_ENOTFOUND) ? "cannot read index file" : "corrupted index file";
+		return error;
+	}
+	*msg = "cannot read packfile";
+	error = GIT_ENOTFOUND;
+	if ((v.data = kgit_mapfile(pack_path, &v.size)) == NULL) {
+		goto cleanup;
+	}
+	*msg = "packfile does not match its index";
+	error = GIT_EOBJCORRUPTED;
+	if (v.size < 12 + GIT_OID_RAWSZ || memcmp(v.data, "PACK", 4) != 0 || kgit_be32(v.data + 8) != pidx.n) {
+		goto cleanup;
+	}
+	error = GIT_ENOMEM;
+	if ((idx = kgit_indexer_new(pack_path)) == NULL
+			|| (idx->entries = (kgit_packentry *)calloc(pidx.n + 1, sizeof(kgit_packentry))) == NULL
+			|| (sorted = (kgit_packentry **)malloc((pidx.n + 1) * sizeof(kgit_packentry *))) == NULL) {
+		goto cleanup;
+	}
+	idx->nentries = pidx.n;
+	idx->nthreads = nthreads;
+	*msg = "corrupted index file";
+	error = GIT_EOBJCORRUPTED;
+	for (i = 0; i < pidx.n; i++) {
+		kgit_packentry *e = &idx->entries[i];
+		if (i > 0 && memcmp(pidx.ids + (i - 1) * GIT_OID_RAWSZ, pidx.ids + i * GIT_OID_RAWSZ, GIT_OID_RAWSZ) >= 0) {
+			goto cleanup;
+		}
+		e->offset = kgit_packidx_offset(&pidx, (uint32_t)i);
+		if (e->offset < 12 || e->offset >= v.size - GIT_OID_RAWSZ) {
+			goto cleanup;
+		}
+		sorted[i] = e;
+	}
+	qsort(sorted, pidx.n, sizeof(kgit_packentry *), kgit_offset_cmp);
+	for (i = 0; i < pidx.n; i++) {
+		sorted[i]->end = (i + 1 < pidx.n) ? sorted[i + 1]->offset : v.size - GIT_OID_RAWSZ;
+		if (sorted[i]->end == sorted[i]->offset) {
+			goto cleanup;
+		}
+	}
+	v.pidx = &pidx;
+	v.entries = idx->entries;
+	v.n = pidx.n;
+	v.bad = pidx.n;
+	kgit_parallel_for(v.n + 1, nthreads, kgit_verify_worker, &v);
+	*msg = "object header or CRC32 mismatch";
+	if (v.bad != v.n) {
+		git_oid_fromraw(&stats->bad, pidx.ids + v.bad * GIT_OID_RAWSZ);
+		goto cleanup;
+	}
+	*msg = "pack checksum mismatch";
+	if (memcmp(v.checksum.id, v.data + v.size - GIT_OID_RAWSZ, GIT_OID_RAWSZ) != 0
+			|| git_oid_cmp(&v.checksum, &pidx.pack_checksum) != 0) {
+		goto cleanup;
+	}
+	*msg = "unresolved delta";
+	if ((error = kgit_indexer_resolve(idx, v.data, 1)) < GIT_SUCCESS) {
+		goto cleanup;
+	}
+	*msg = "object id mismatch";
+	error = GIT_EOBJCORRUPTED;
+	for (i = 0; i < pidx.n; i++) {
+		const kgit_packentry *e = &idx->entries[i];
+		if (memcmp(e->oid.id, pidx.ids + i * GIT_OID_RAWSZ, GIT_OID_RAWSZ) != 0) {
+			git_oid_fromraw(&stats->bad, pidx.ids + i * GIT_OID_RAWSZ);
+			goto cleanup;
+		}
+		if (e->depth > stats->maxdepth) {
+			stats->maxdepth = e->depth;
+		}
+		stats->deltas += kgit_pack_isdelta(e->type);
+	}
+	error = GIT_ENOMEM;
+	if ((stats->chains = (size_t *)calloc(stats->maxdepth + 1, sizeof(size_t))) == NULL) {
+		goto cleanup;
+	}
+	for (i = 0; i < pidx.n; i++) {
+		stats->chains[idx->entries[i].depth]++;
+	}
+	stats->objects = pidx.n;
+	error = GIT_SUCCESS;
+
+cleanup:
+	free(sorted);
+	if (idx != NULL) {
+		kgit_indexer_free(idx);
+	}
+	if (v.data != NULL) {
+		munmap((void *)v.data, v.size);
+	}
+	kgit_packidx_close(&pidx);
+	return error;
+}
+
+typedef struct kgit_progress_call {
+	kObject *self;
+	kFunc *fo;
+} kgit_progress_call;
+
+static int kgit_indexer_callback(void *arg)
+{
+	kgit_progress_call *call = (kgit_progress_call *)arg;
+	CTX lctx = knh_getCurrentContext();
+	ksfp_t *lsfp = lctx->esp;
+	KNH_SETv(lctx, lsfp[K_CALLDELTA + 1].o, call->self);
+	knh_Func_invoke(lctx, call->fo, lsfp, 1);
+	return (int)lsfp[K_RTNIDX].ivalue;
+}
+
+/* Call 'call' back from this thread while indexing, or stop if it is NULL */
+static void kgit_indexer_watch(kgit_indexer *idx, kgit_progress_call *call, int interval)
+{
+	idx->progress = (call != NULL) ? kgit_indexer_callback : NULL;
+	idx->progress_arg = call;
+	idx->interval = (interval > 0) ? (uint64_t)interval : 0;
+	idx->owner = pthread_self();
+}
+
+static kObject *kgit_indexer_stats(CTX ctx, ksfp_t *sfp, kgit_indexer *idx, int error, const char *fn, const char *msg)
+{
+	if (error < GIT_SUCCESS) {
+		KNH_NTRACE2(ctx, fn, K_FAILED, KNH_LDATA(LOG_i("errno", error), LOG_msg(msg)));
+		return KNH_NULL;
+	}
+	git_indexer_stats *stats = (git_indexer_stats *)KNH_MALLOC(ctx, sizeof(git_indexer_stats));
+	stats->total = (unsigned int)idx->nentries;
+	stats->processed = (unsigned int)idx->processed;
+	return new_ReturnRawPtr(ctx, sfp, stats);
+}
+
 /* ------------------------------------------------------------------------ */
 
 static void kGitIndexer_init(CTX ctx, kRawPtr *po)
@@ -46,11 +802,10 @@ static void kGitIndexer_init(CTX ctx, kRawPtr *po)
 static void kGitIndexer_free(CTX ctx, kRawPtr *po)
 {
 	if (po->rawptr != NULL) {
-		git_indexer_free((git_indexer *)po->rawptr);
+		kgit_indexer_free((kgit_indexer *)po->rawptr);
 		po->rawptr = NULL;
 	}
 }
-
 DEFAPI(void) defGitIndexer(CTX ctx, kclass_t cid, kclassdef_t *cdef)
 {
 	cdef->name = "GitIndexer";
@@ -80,6 +835,107 @@ DEFAPI(void) defGitIndexerStats(CTX ctx, kclass_t cid, kclassdef_t *cdef)
 
 /* ------------------------------------------------------------------------ */
 
+/* Feed the next bytes of a pack being received. The first call creates the
+ * packfile; the bytes are written to it and parsed as they arrive. */
+//## @Native boolean GitIndexer.append(Bytes data);
+KMETHOD GitIndexer_append(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	const unsigned char *p = (const unsigned char *)BA_totext(sfp[1].ba);
+	size_t len = BA_size(sfp[1].ba);
+	int error = GIT_SUCCESS;
+	if (idx == NULL) {
+		RETURNb_(0);
+	}
+	if (idx->fd < 0) {
+		idx->fd = open(idx->packname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (idx->fd < 0) {
+			KNH_NTRACE2(ctx, "git_indexer_append", K_FAILED, KNH_LDATA(LOG_msg("cannot create packfile")));
+			RETURNb_(0);
+		}
+		kgit_indexer_reset(idx);
+	}
+	size_t written = 0;
+	while (written < len) {
+		ssize_t n = write(idx->fd, p + written, len - written);
+		if (n < 0) {
+			error = GIT_ERROR;
+			break;
+		}
+		written += (size_t)n;
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_indexer_feed(idx, p, len);
+	}
+	if (error < GIT_SUCCESS) {
+		KNH_NTRACE2(ctx, "git_indexer_append", K_FAILED, KNH_LDATA(LOG_i("errno", error)));
+		RETURNb_(0);
+	}
+	RETURNb_(1);
+}
+
+/* Get the number of bytes of object data hashed so far */
+//## @Native int GitIndexer.bytesHashed();
+KMETHOD GitIndexer_bytesHashed(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	RETURNi_((idx != NULL) ? __sync_fetch_and_add(&idx->hashed, 0) : 0);
+}
+
+/* Finish a pack fed with append(): close the packfile and resolve its
+ * deltas. The index can then be written with write(). */
+//## @Native GitIndexerStats GitIndexer.commit();
+KMETHOD GitIndexer_commit(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	const char *msg;
+	int error = kgit_indexer_commit(idx, &msg);
+	RETURN_(kgit_indexer_stats(ctx, sfp, idx, error, "git_indexer_commit", msg));
+}
+
+/* Finish a pack fed with append() as commit() does, calling back every
+ * 'interval' milliseconds while deltas are resolved. */
+//## @Native GitIndexerStats GitIndexer.commitWithProgress(Func<GitIndexer=>int> callback, int interval);
+KMETHOD GitIndexer_commitWithProgress(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	kgit_progress_call call = {sfp[0].o, sfp[1].fo};
+	const char *msg;
+	int error;
+	if (idx != NULL) {
+		kgit_indexer_watch(idx, &call, Int_to(int, sfp[2]));
+	}
+	error = kgit_indexer_commit(idx, &msg);
+	if (idx != NULL) {
+		kgit_indexer_watch(idx, NULL, 0);
+	}
+	RETURN_(kgit_indexer_stats(ctx, sfp, idx, error, "git_indexer_commit", msg));
+}
+
+/* Get the number of deltas resolved so far */
+//## @Native int GitIndexer.deltas();
+KMETHOD GitIndexer_deltas(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	RETURNi_((idx != NULL) ? __sync_fetch_and_add(&idx->resolved, 0) : 0);
+}
+
+/* Get the milliseconds spent indexing, up to now if it is still running */
+//## @Native int GitIndexer.elapsed();
+KMETHOD GitIndexer_elapsed(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	uint64_t started = 0, stopped = 0;
+	if (idx != NULL) {
+		started = __sync_fetch_and_add(&idx->started, 0);
+		stopped = __sync_fetch_and_add(&idx->stopped, 0);
+	}
+	if (started == 0) {
+		RETURNi_(0);
+	}
+	RETURNi_(((stopped != 0) ? stopped : kgit_now()) - started);
+}
+
 /* Free the indexer and its resources */
 //## @Native void GitIndexer.free();
 KMETHOD GitIndexer_free(CTX ctx, ksfp_t *sfp _RIX)
@@ -92,56 +948,124 @@ KMETHOD GitIndexer_free(CTX ctx, ksfp_t *sfp _RIX)
 //## @Native GitOid GitIndexer.hash();
 KMETHOD GitIndexer_hash(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_indexer *idx = RawPtr_to(git_indexer *, sfp[0]);
-	const git_oid *id = git_indexer_hash(idx);
-	if (id == NULL) {
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	if (idx == NULL || !idx->indexed) {
 		KNH_NTRACE2(ctx, "git_indexer_hash", K_FAILED, KNH_LDATA0);
 		RETURN_(KNH_NULL);
 	}
-	RETURN_(new_ReturnRawPtr(ctx, sfp, (git_oid *)id));
+	RETURN_(new_GitOidCopy(ctx, sfp, &idx->hash));
 }
 
 /* Create a new indexer instance */
 //## @Native GitIndexer GitIndexer.new(String packname);
 KMETHOD GitIndexer_new(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_indexer *out = RawPtr_to(git_indexer *, sfp[0]);
-	const char *packname = S_totext(sfp[1].s);
-	int error = git_indexer_new(&out, packname);
-	if (error < GIT_SUCCESS) {
-		TRACE_ERROR(ctx, "git_indexer_new", error);
+	kgit_indexer *idx = kgit_indexer_new(S_totext(sfp[1].s));
+	if (idx == NULL) {
+		KNH_NTRACE2(ctx, "git_indexer_new", K_FAILED, KNH_LDATA(LOG_msg("out of memory")));
 		RETURN_(KNH_NULL);
 	}
-	RETURN_(new_ReturnRawPtr(ctx, sfp, out));
+	RETURN_(new_ReturnRawPtr(ctx, sfp, idx));
 }
 
-/* Iterate over the objects in the packfile and extract the information */
+/* Get the number of objects whose id is known so far */
+//## @Native int GitIndexer.processed();
+KMETHOD GitIndexer_processed(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	RETURNi_((idx != NULL) ? __sync_fetch_and_add(&idx->processed, 0) : 0);
+}
+
+/* Get the number of objects parsed so far */
+//## @Native int GitIndexer.received();
+KMETHOD GitIndexer_received(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	RETURNi_((idx != NULL) ? __sync_fetch_and_add(&idx->received, 0) : 0);
+}
+
+/* Iterate over the objects in the packfile and extract the information.
+ * Deltas are resolved on the number of threads set with setThreads(). */
 //## @Native GitIndexerStats GitIndexer.run();
 KMETHOD GitIndexer_run(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_indexer *idx = RawPtr_to(git_indexer *, sfp[0]);
-	git_indexer_stats *stats = (git_indexer_stats *)KNH_MALLOC(ctx, sizeof(git_indexer_stats));
-	int error = git_indexer_run(idx, stats);
-	if (error < GIT_SUCCESS) {
-		TRACE_ERROR(ctx, "git_indexer_run", error);
-		KNH_FREE(ctx, stats, sizeof(git_indexer_stats));
-		RETURN_(KNH_NULL);
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	const char *msg;
+	int error = kgit_indexer_run(idx, &msg);
+	RETURN_(kgit_indexer_stats(ctx, sfp, idx, error, "git_indexer_run", msg));
+}
+
+/* Run the indexer as run() does, calling back every 'interval' milliseconds
+ * with the indexer, whose counters tell how far it has gone. The callback
+ * runs on this thread and stops indexing when it returns non-zero. */
+//## @Native GitIndexerStats GitIndexer.runWithProgress(Func<GitIndexer=>int> callback, int interval);
+KMETHOD GitIndexer_runWithProgress(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	kgit_progress_call call = {sfp[0].o, sfp[1].fo};
+	const char *msg = "cannot read packfile";
+	int error = GIT_ERROR;
+	if (idx != NULL) {
+		kgit_indexer_watch(idx, &call, Int_to(int, sfp[2]));
+		error = kgit_indexer_run(idx, &msg);
+		kgit_indexer_watch(idx, NULL, 0);
 	}
-	RETURN_(new_ReturnRawPtr(ctx, sfp, stats));
+	RETURN_(kgit_indexer_stats(ctx, sfp, idx, error, "git_indexer_run", msg));
 }
 
-/* Write the index file to disk. */
+/* Set the number of threads used to resolve deltas; 0 uses one per core */
+//## @Native void GitIndexer.setThreads(int nthreads);
+KMETHOD GitIndexer_setThreads(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	if (idx != NULL) {
+		idx->nthreads = Int_to(int, sfp[1]);
+	}
+	RETURNvoid_();
+}
+
+/* Get the number of objects in the packfile, once its header is read */
+//## @Native int GitIndexer.total();
+KMETHOD GitIndexer_total(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	RETURNi_((idx != NULL) ? __sync_fetch_and_add(&idx->nentries, 0) : 0);
+}
+
+/* Write the index file to disk, as pack-<hash>.idx next to the packfile. */
 //## @Native void GitIndexer.write();
 KMETHOD GitIndexer_write(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_indexer *idx = RawPtr_to(git_indexer *, sfp[0]);
-	int error = git_indexer_write(idx);
+	kgit_indexer *idx = RawPtr_to(kgit_indexer *, sfp[0]);
+	if (idx == NULL || !idx->indexed) {
+		KNH_NTRACE2(ctx, "git_indexer_write", K_FAILED, KNH_LDATA(LOG_msg("packfile is not indexed")));
+		RETURNvoid_();
+	}
+	char *path = kgit_pack_sibling(idx->packname, &idx->hash, ".idx");
+	int error = (path != NULL) ? kgit_packidx_write(path, idx->entries, idx->nentries, &idx->hash) : GIT_ENOMEM;
+	free(path);
 	if (error < GIT_SUCCESS) {
-		TRACE_ERROR(ctx, "git_indexer_write", error);
+		KNH_NTRACE2(ctx, "git_indexer_write", K_FAILED, KNH_LDATA(LOG_i("errno", error)));
 	}
 	RETURNvoid_();
 }
 
+/* Get the number of objects indexed */
+//## @Native int GitIndexerStats.processed();
+KMETHOD GitIndexerStats_processed(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_indexer_stats *stats = RawPtr_to(git_indexer_stats *, sfp[0]);
+	RETURNi_(stats->processed);
+}
+
+/* Get the number of objects in the packfile */
+//## @Native int GitIndexerStats.total();
+KMETHOD GitIndexerStats_total(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_indexer_stats *stats = RawPtr_to(git_indexer_stats *, sfp[0]);
+	RETURNi_(stats->total);
+}
+
 /* ------------------------------------------------------------------------ */
 
 #ifdef __cplusplus
@@ -0,0 +1,263 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* A mapped index reads the index file in place. Opening it checks the header
+ * and records where each entry starts; the fields of an entry are decoded
+ * only when asked for, so the cost of a lookup does not depend on how many
+ * entries the file holds. */
+
+#define KGIT_ENTRY_MTIME   8
+#define KGIT_ENTRY_MODE    24
+#define KGIT_ENTRY_SIZE    36
+#define KGIT_ENTRY_OID     40
+#define KGIT_ENTRY_FLAGS   60
+#define KGIT_ENTRY_PATH    62
+
+typedef struct kgit_indexmap {
+	unsigned char *data;
+	size_t length;
+	uint32_t *offsets;
+	size_t size;
+	int version;
+} kgit_indexmap;
+
+static void kgit_indexmap_free(CTX ctx, kgit_indexmap *map)
+{
+	if (map->data != NULL) {
+		munmap(map->data, map->length);
+	}
+	free(map->offsets);
+	KNH_FREE(ctx, map, sizeof(kgit_indexmap));
+}
+
+static const unsigned char *kgit_indexmap_entry(const kgit_indexmap *map, size_t n)
+{
+	return map->data + map->offsets[n];
+}
+
+static const char *kgit_indexmap_path(const kgit_indexmap *map, size_t n)
+{
+	const unsigned char *e = kgit_indexmap_entry(map, n);
+	size_t off = KGIT_ENTRY_PATH;
+	if (map->version == 3 && (e[KGIT_ENTRY_FLAGS] & 0x40)) {
+		off += 2;
+	}
+	return (const char *)e + off;
+}
+
+static void kGitIndexMap_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitIndexMap_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_indexmap_free(ctx, (kgit_indexmap *)po->rawptr);
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitIndexMap(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitIndexMap";
+	cdef->init = kGitIndexMap_init;
+	cdef->free = kGitIndexMap_free;
+}
+
+static long GitIndexMap_index(ksfp_t *sfp)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	kint_t n = Int_to(kint_t, sfp[1]);
+	if (map == NULL || n < 0 || (size_t)n >= map->size) {
+		return -1;
+	}
+	return (long)n;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Get the file size of the n-th entry of a mapped index */
+//## @Native int GitIndexMap.fileSize(int n);
+KMETHOD GitIndexMap_fileSize(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	long n = GitIndexMap_index(sfp);
+	RETURNi_((n >= 0) ? (kint_t)kgit_be32(kgit_indexmap_entry(map, n) + KGIT_ENTRY_SIZE) : -1);
+}
+
+/* Find the first entry for a path in a mapped index by binary search; returns
+ * -1 when the path is not in the index */
+//## @Native int GitIndexMap.find(String path);
+KMETHOD GitIndexMap_find(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	const char *path = S_totext(sfp[1].s);
+	size_t lo = 0, hi = (map != NULL) ? map->size : 0;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(kgit_indexmap_path(map, mid), path) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (map != NULL && lo < map->size && strcmp(kgit_indexmap_path(map, lo), path) == 0) {
+		RETURNi_(lo);
+	}
+	RETURNi_(-1);
+}
+
+/* Unmap an index file */
+//## @Native void GitIndexMap.free();
+KMETHOD GitIndexMap_free(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kGitIndexMap_free(ctx, sfp[0].p);
+	RETURNvoid_();
+}
+
+/* Get the id of the n-th entry of a mapped index */
+//## @Native GitOid GitIndexMap.id(int n);
+KMETHOD GitIndexMap_id(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	long n = GitIndexMap_index(sfp);
+	if (n < 0) {
+		RETURN_(KNH_NULL);
+	}
+	git_oid oid;
+	git_oid_fromraw(&oid, kgit_indexmap_entry(map, n) + KGIT_ENTRY_OID);
+	RETURN_(new_GitOidCopy(ctx, sfp, &oid));
+}
+
+/* Get the mode of the n-th entry of a mapped index */
+//## @Native int GitIndexMap.mode(int n);
+KMETHOD GitIndexMap_mode(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	long n = GitIndexMap_index(sfp);
+	RETURNi_((n >= 0) ? (kint_t)kgit_be32(kgit_indexmap_entry(map, n) + KGIT_ENTRY_MODE) : -1);
+}
+
+/* Get the modification time of the n-th entry of a mapped index */
+//## @Native int GitIndexMap.mtime(int n);
+KMETHOD GitIndexMap_mtime(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	long n = GitIndexMap_index(sfp);
+	RETURNi_((n >= 0) ? (kint_t)kgit_be32(kgit_indexmap_entry(map, n) + KGIT_ENTRY_MTIME) : -1);
+}
+
+/* Map an index file read-only without parsing its entries. Only version 2
+ * and 3 index files are supported. */
+//## @Native @Static GitIndexMap GitIndexMap.open(Path index_path);
+KMETHOD GitIndexMap_open(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const char *index_path = sfp[1].pth->ospath;
+	struct stat st;
+	int fd = open(index_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		KNH_NTRACE2(ctx, "git_index_map", K_FAILED, KNH_LDATA(LOG_msg("cannot open")));
+		RETURN_(KNH_NULL);
+	}
+	kgit_indexmap *map = (kgit_indexmap *)KNH_MALLOC(ctx, sizeof(kgit_indexmap));
+	memset(map, 0, sizeof(kgit_indexmap));
+	map->length = (size_t)st.st_size;
+	if (map->length > 0) {
+		void *data = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, 0);
+		map->data = (data != MAP_FAILED) ? (unsigned char *)data : NULL;
+	}
+	close(fd);
+	if (map->data == NULL || map->length < 12) {
+		kgit_indexmap_free(ctx, map);
+		KNH_NTRACE2(ctx, "git_index_map", K_FAILED, KNH_LDATA(LOG_msg("cannot map")));
+		RETURN_(KNH_NULL);
+	}
+	map->version = (int)kgit_be32(map->data + 4);
+	map->size = kgit_be32(map->data + 8);
+	map->offsets = (uint32_t *)malloc((map->size + 1) * sizeof(uint32_t));
+	if (map->offsets == NULL || kgit_indexfile_extensions(map->data, map->length, map->offsets) == 0) {
+		kgit_indexmap_free(ctx, map);
+		KNH_NTRACE2(ctx, "git_index_map", K_FAILED, KNH_LDATA(LOG_msg("unsupported index file")));
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, map));
+}
+
+/* Get the path of the n-th entry of a mapped index */
+//## @Native String GitIndexMap.path(int n);
+KMETHOD GitIndexMap_path(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	long n = GitIndexMap_index(sfp);
+	if (n < 0) {
+		RETURN_(KNH_TNULL(String));
+	}
+	RETURN_(new_String(ctx, kgit_indexmap_path(map, n)));
+}
+
+/* Get the number of entries in a mapped index */
+//## @Native int GitIndexMap.size();
+KMETHOD GitIndexMap_size(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	RETURNi_((map != NULL) ? map->size : 0);
+}
+
+/* Get the stage of the n-th entry of a mapped index */
+//## @Native int GitIndexMap.stage(int n);
+KMETHOD GitIndexMap_stage(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_indexmap *map = RawPtr_to(kgit_indexmap *, sfp[0]);
+	long n = GitIndexMap_index(sfp);
+	RETURNi_((n >= 0) ? (kgit_indexmap_entry(map, n)[KGIT_ENTRY_FLAGS] >> 4) & 0x3 : -1);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -29,6 +29,8 @@
 //  chen_ji - Takuma Wakamori, Yokohama National University, Japan
 // **************************************************************************
 
+#include <pthread.h>
+#include <unistd.h>
 #include <konoha1.h>
 #include "libgit2.h"
 
@@ -39,6 +41,58 @@ extern "C" {
 /* ======================================================================== */
 // [PRIVATE FUNCTIONS]
 
+typedef struct kgit_parallel {
+	void (*fn)(void *arg, size_t i);
+	void *arg;
+	size_t n;
+	size_t next;
+} kgit_parallel;
+
+static void *kgit_parallel_worker(void *p)
+{
+	kgit_parallel *job = (kgit_parallel *)p;
+	size_t i;
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+		job->fn(job->arg, i);
+	}
+	return NULL;
+}
+
+/* Number of worker threads used when the caller does not ask for one. */
+int kgit_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n < 1) ? 1 : (n > KGIT_MAX_THREADS) ? KGIT_MAX_THREADS : (int)n;
+}
+
+/* Call fn(arg, i) for every i in [0, n) on up to 'nthreads' threads (0 for
+ * the default) and wait for all of them. Items are handed out one at a time,
+ * so fn must be safe to run concurrently on distinct items. */
+void kgit_parallel_for(size_t n, int nthreads, void (*fn)(void *arg, size_t i), void *arg)
+{
+	pthread_t threads[KGIT_MAX_THREADS];
+	kgit_parallel job = {fn, arg, n, 0};
+	int i, started = 0;
+	if (nthreads <= 0) {
+		nthreads = kgit_default_threads();
+	}
+	if (nthreads > KGIT_MAX_THREADS) {
+		nthreads = KGIT_MAX_THREADS;
+	}
+	if ((size_t)nthreads > n) {
+		nthreads = (int)n;
+	}
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, kgit_parallel_worker, &job) == 0) {
+			started++;
+		}
+	}
+	kgit_parallel_worker(&job);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
 /* ======================================================================== */
 // [KMETHODS]
 
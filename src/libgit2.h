@@ -4,3 +4,205 @@
 			KNH_NTRACE2(ctx, func, K_FAILED, \
 				KNH_LDATA(LOG_i("errno", error), \
 					LOG_s("git_lasterror", git_lasterror())))
+
+/* libgit2.c */
+#define KGIT_MAX_THREADS 64
+
+int kgit_default_threads(void);
+void kgit_parallel_for(size_t n, int nthreads, void (*fn)(void *arg, size_t i), void *arg);
+
+/* sha1.c */
+typedef struct kgit_sha1_ctx {
+	uint32_t h[5];
+	uint64_t len;
+	unsigned char buf[64];
+} kgit_sha1_ctx;
+
+void kgit_sha1_init(kgit_sha1_ctx *c);
+void kgit_sha1_update(kgit_sha1_ctx *c, const void *data, size_t len);
+void kgit_sha1_final(git_oid *out, kgit_sha1_ctx *c);
+
+/* pack.c */
+typedef struct kgit_packentry {
+	git_oid oid;
+	git_oid base_oid;      /* REF_DELTA */
+	uint64_t offset;
+	uint64_t base_offset;  /* OFS_DELTA */
+	uint64_t size;         /* inflated size */
+	uint64_t data_offset;  /* start of the zlib stream */
+	uint64_t end;          /* end of the compressed data */
+	uint32_t crc;
+	uint32_t depth;        /* delta chain length, 0 for base objects */
+	int type;              /* type as stored in the pack */
+	int real_type;         /* type of the object once resolved */
+} kgit_packentry;
+
+#define kgit_pack_isdelta(type)  ((type) == GIT_OBJ_OFS_DELTA || (type) == GIT_OBJ_REF_DELTA)
+#define KGIT_PACK_HEADER_MAX     (10 + GIT_OID_RAWSZ)
+
+size_t kgit_pack_header(kgit_packentry *e, const unsigned char *p, size_t avail, uint64_t off);
+int kgit_pack_inflate(const unsigned char *in, size_t inlen, unsigned char *out, size_t outlen, size_t *used);
+int kgit_delta_apply(unsigned char **out, size_t *outlen, const unsigned char *base, size_t baselen, const unsigned char *delta, size_t deltalen);
+void kgit_object_hash_init(kgit_sha1_ctx *sha1, int type, uint64_t len);
+void kgit_object_hash(git_oid *oid, int type, const unsigned char *data, size_t len);
+int kgit_packidx_write(const char *path, kgit_packentry *entries, size_t n, const git_oid *pack_checksum);
+char *kgit_pack_sibling(const char *pack_path, const git_oid *checksum, const char *ext);
+unsigned char *kgit_mapfile(const char *path, size_t *size);
+
+typedef struct kgit_packidx {
+	unsigned char *data;   /* the mapped .idx file */
+	size_t size;
+	uint32_t n;
+	const unsigned char *fanout;
+	const unsigned char *ids;
+	const unsigned char *crcs;
+	const unsigned char *offsets;
+	const unsigned char *large;
+	size_t nlarge;
+	git_oid pack_checksum;
+} kgit_packidx;
+
+int kgit_packidx_open(kgit_packidx *idx, const char *path);
+void kgit_packidx_close(kgit_packidx *idx);
+uint64_t kgit_packidx_offset(const kgit_packidx *idx, uint32_t i);
+long kgit_packidx_find(const kgit_packidx *idx, const git_oid *oid);
+
+typedef struct kgit_packstats {
+	size_t objects;
+	size_t deltas;
+	size_t maxdepth;
+	size_t *chains;        /* chains[d]: objects at delta chain length d */
+	git_oid bad;           /* first object found corrupted */
+} kgit_packstats;
+
+/* indexer.c */
+int kgit_pack_verify(kgit_packstats *stats, const char *pack_path, int nthreads, const char **msg);
+
+/* tree entry attributes */
+#define GIT_ATTR_DIR           0040000
+#define GIT_ATTR_ISDIR(attr)   (((attr) & 0170000) == GIT_ATTR_DIR)
+
+/* tree.c */
+const git_tree_entry *kgit_tree_entry_byname(git_tree *tree, const char *filename);
+int kgit_tree_resolve(git_repository *repo, const git_oid *root, git_tree *roottree, const char *path, git_oid *out, unsigned int *attr);
+void kgit_treecache_drop(git_repository *repo);
+
+/* index.c */
+void kgit_index_register(git_index *index, git_repository *repo, const char *path);
+int kgit_index_open(git_index **out, git_repository *repo, const char *path);
+void kgit_index_touch(git_index *index);
+int kgit_index_write_tree(git_oid *out, git_index *index);
+
+/* cachetree.c */
+typedef struct kgit_buf {
+	unsigned char *ptr;
+	size_t size;
+	size_t capacity;
+} kgit_buf;
+
+typedef struct kgit_cachetree {
+	char *name;
+	size_t namelen;
+	int entry_count;
+	git_oid oid;
+	struct kgit_cachetree **children;
+	size_t nchildren;
+} kgit_cachetree;
+
+uint32_t kgit_be32(const unsigned char *p);
+void kgit_put_be32(unsigned char *p, uint32_t v);
+unsigned char *kgit_readfile(const char *path, size_t *size);
+size_t kgit_indexfile_extensions(const unsigned char *data, size_t size, uint32_t *offsets);
+int kgit_buf_put(kgit_buf *buf, const void *data, size_t len);
+int kgit_writefile(const char *path, const void *data, size_t size);
+kgit_cachetree *kgit_cachetree_read(const char *index_path);
+int kgit_cachetree_write(const char *index_path, const kgit_cachetree *root);
+void kgit_cachetree_free(kgit_cachetree *node);
+void kgit_cachetree_invalidate(kgit_cachetree *root, const char *path);
+int kgit_cachetree_update(git_oid *out, git_repository *repo, git_index *index, kgit_cachetree **root);
+
+/* ewah.c */
+typedef struct kgit_bitmap {
+	uint64_t *words;
+	size_t nbits;
+} kgit_bitmap;
+
+#define KGIT_BITMAP_WORDS(nbits)  (((nbits) + 63) / 64)
+
+int kgit_bitmap_init(kgit_bitmap *bitmap, size_t nbits);
+void kgit_bitmap_free(kgit_bitmap *bitmap);
+void kgit_bitmap_set(kgit_bitmap *bitmap, size_t pos);
+int kgit_bitmap_get(const kgit_bitmap *bitmap, size_t pos);
+size_t kgit_bitmap_count(const kgit_bitmap *bitmap);
+int kgit_bitmap_grow(kgit_bitmap *bitmap, size_t nbits);
+void kgit_bitmap_or(kgit_bitmap *dst, const kgit_bitmap *src);
+void kgit_bitmap_andnot(kgit_bitmap *dst, const kgit_bitmap *src);
+void kgit_bitmap_xor(kgit_bitmap *dst, const kgit_bitmap *src);
+int kgit_ewah_write(kgit_buf *buf, const kgit_bitmap *bitmap);
+long kgit_ewah_read(kgit_bitmap *bitmap, const unsigned char *data, size_t size);
+
+/* splitindex.c */
+typedef struct kgit_indexfile kgit_indexfile;
+
+void kgit_indexfile_free(kgit_indexfile *file);
+char *kgit_splitindex_shared(const char *index_path);
+int kgit_splitindex_read(git_index *index, const char *path, kgit_indexfile **shared, int plain);
+int kgit_splitindex_write(git_index *index, const char *path, kgit_indexfile **shared, int split);
+
+/* treebuilder.c */
+typedef struct kgit_entry {
+	const char *name;
+	size_t namelen;
+	unsigned int attr;
+	size_t seq;
+	git_oid oid;
+} kgit_entry;
+
+int kgit_tree_write(git_oid *out, git_repository *repo, kgit_entry *entries, size_t n);
+
+/* treefilter.c */
+typedef struct kgit_filter kgit_filter;
+
+int kgit_filter_match(const kgit_filter *f, const git_tree_entry *entry);
+
+/* diff.c */
+#define GIT_DELTA_ADDED    1
+#define GIT_DELTA_DELETED  2
+#define GIT_DELTA_MODIFIED 3
+
+typedef struct kgit_delta {
+	int status;
+	char *path;
+	git_oid old_oid;
+	git_oid new_oid;
+	unsigned int old_attr;
+	unsigned int new_attr;
+} kgit_delta;
+
+typedef struct kgit_diff {
+	kgit_delta *deltas;
+	size_t size;
+	size_t capacity;
+} kgit_diff;
+
+kgit_diff *kgit_diff_new(CTX ctx);
+void kgit_diff_free(CTX ctx, kgit_diff *diff);
+int kgit_diff_push(kgit_diff *diff, int status, const char *path,
+		const git_oid *old_oid, unsigned int old_attr, const git_oid *new_oid, unsigned int new_attr);
+
+/* oid.c */
+typedef struct kgit_oidlist {
+	size_t size;
+	size_t capacity;
+	git_oid ids[1];
+} kgit_oidlist;
+
+#define kgit_oidlist_sizeof(capacity) \
+	(sizeof(kgit_oidlist) + ((capacity) > 0 ? (capacity) - 1 : 0) * sizeof(git_oid))
+
+kgit_oidlist *kgit_oidlist_new(CTX ctx, size_t capacity);
+kObject *new_GitOidCopy(CTX ctx, ksfp_t *sfp, const git_oid *src);
+kObject *new_GitOid(CTX ctx, const git_oid *src);
+
+/* revwalk.c */
+void kgit_countcache_drop(git_repository *repo);
@@ -0,0 +1,639 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* The multi-pack index, in git's format: one sorted table of the objects of
+ * all the packs of a directory, giving for each the pack it is in and its
+ * offset there, so that a lookup is one binary search instead of one per
+ * .idx. The file is a 12-byte header, a table of chunks (id and offset),
+ * the chunks, and a checksum:
+ *   PNAM  the .idx names of the packs, sorted, NUL-terminated
+ *   OIDF  fanout table, as in a .idx
+ *   OIDL  sorted object ids
+ *   OOFF  pack number and 31-bit offset of each object
+ *   LOFF  64-bit offsets, for packs larger than 2GB
+ * The odb backend built on it reads objects straight from the packs. */
+
+#define KGIT_MIDX_NAME        "multi-pack-index"
+#define KGIT_MIDX_HEADER      12
+#define KGIT_MIDX_LARGE       0x80000000U
+#define KGIT_MIDX_MAX_DEPTH   10000
+
+#define KGIT_CHUNK_PNAM  0x504e414dU
+#define KGIT_CHUNK_OIDF  0x4f494446U
+#define KGIT_CHUNK_OIDL  0x4f49444cU
+#define KGIT_CHUNK_OOFF  0x4f4f4646U
+#define KGIT_CHUNK_LOFF  0x4c4f4646U
+
+typedef struct kgit_midxpack {
+	char *path;            /* the .pack */
+	unsigned char *data;   /* mapped on first use */
+	size_t size;
+} kgit_midxpack;
+
+typedef struct kgit_midx {
+	unsigned char *data;
+	size_t size;
+	uint32_t n;
+	const unsigned char *fanout;
+	const unsigned char *ids;
+	const unsigned char *offsets;
+	const unsigned char *large;
+	size_t nlarge;
+	kgit_midxpack *packs;
+	uint32_t npacks;
+} kgit_midx;
+
+typedef struct kgit_midx_backend {
+	git_odb_backend parent;
+	kgit_midx midx;
+} kgit_midx_backend;
+
+static void kgit_midx_close(kgit_midx *m)
+{
+	uint32_t i;
+	for (i = 0; i < m->npacks; i++) {
+		if (m->packs[i].data != NULL) {
+			munmap(m->packs[i].data, m->packs[i].size);
+		}
+		free(m->packs[i].path);
+	}
+	free(m->packs);
+	if (m->data != NULL) {
+		munmap(m->data, m->size);
+	}
+	memset(m, 0, sizeof(kgit_midx));
+}
+
+static char *kgit_midx_path(const char *dir, const char *name, size_t namelen, const char *ext)
+{
+	size_t dirlen = strlen(dir);
+	char *path = (char *)malloc(dirlen + 1 + namelen + strlen(ext) + 1);
+	if (path != NULL) {
+		memcpy(path, dir, dirlen);
+		path[dirlen] = '/';
+		memcpy(path + dirlen + 1, name, namelen);
+		strcpy(path + dirlen + 1 + namelen, ext);
+	}
+	return path;
+}
+
+/* Open the multi-pack index of the pack directory 'dir'. */
+static int kgit_midx_open(kgit_midx *m, const char *dir)
+{
+	const unsigned char *names = NULL, *p;
+	size_t nameslen = 0, i, nchunks;
+	char *path = kgit_midx_path(dir, KGIT_MIDX_NAME, strlen(KGIT_MIDX_NAME), "");
+	memset(m, 0, sizeof(kgit_midx));
+	if (path == NULL) {
+		return GIT_ENOMEM;
+	}
+	m->data = kgit_mapfile(path, &m->size);
+	free(path);
+	if (m->data == NULL) {
+		return GIT_ENOTFOUND;
+	}
+	nchunks = m->data[6];
+	if (m->size < KGIT_MIDX_HEADER + (nchunks + 1) * 12 + GIT_OID_RAWSZ || memcmp(m->data, "MIDX", 4) != 0
+			|| m->data[4] != 1 || m->data[5] != 1 || m->data[7] != 0) {
+		kgit_midx_close(m);
+		return GIT_EOBJCORRUPTED;
+	}
+	for (i = 0; i < nchunks; i++) {
+		const unsigned char *c = m->data + KGIT_MIDX_HEADER + i * 12;
+		uint64_t start = ((uint64_t)kgit_be32(c + 4) << 32) | kgit_be32(c + 8);
+		uint64_t end = ((uint64_t)kgit_be32(c + 16) << 32) | kgit_be32(c + 20);
+		if (start > end || end > m->size - GIT_OID_RAWSZ) {
+			kgit_midx_close(m);
+			return GIT_EOBJCORRUPTED;
+		}
+		p = m->data + start;
+		switch (kgit_be32(c)) {
+		case KGIT_CHUNK_PNAM:
+			names = p;
+			nameslen = (size_t)(end - start);
+			break;
+		case KGIT_CHUNK_OIDF:
+			m->fanout = (end - start == 256 * 4) ? p : NULL;
+			break;
+		case KGIT_CHUNK_OIDL:
+			m->ids = p;
+			break;
+		case KGIT_CHUNK_OOFF:
+			m->offsets = p;
+			break;
+		case KGIT_CHUNK_LOFF:
+			m->large = p;
+			m->nlarge = (size_t)(end - start) / 8;
+			break;
+		}
+	}
+	if (names == NULL || m->fanout == NULL || m->ids == NULL || m->offsets == NULL) {
+		kgit_midx_close(m);
+		return GIT_EOBJCORRUPTED;
+	}
+	m->n = kgit_be32(m->fanout + 255 * 4);
+	m->npacks = kgit_be32(m->data + 8);
+	if (m->ids + (size_t)m->n * GIT_OID_RAWSZ > m->data + m->size || m->offsets + (size_t)m->n * 8 > m->data + m->size
+			|| (m->packs = (kgit_midxpack *)calloc(m->npacks + 1, sizeof(kgit_midxpack))) == NULL) {
+		m->npacks = 0;
+		kgit_midx_close(m);
+		return GIT_EOBJCORRUPTED;
+	}
+	for (i = 0, p = names; i < m->npacks; i++) {
+		const unsigned char *nul = (const unsigned char *)memchr(p, '\0', names + nameslen - p);
+		size_t len = (nul != NULL) ? (size_t)(nul - p) : 0;
+		if (len < 4 || memcmp(nul - 4, ".idx", 4) != 0
+				|| (m->packs[i].path = kgit_midx_path(dir, (const char *)p, len - 4, ".pack")) == NULL) {
+			kgit_midx_close(m);
+			return GIT_EOBJCORRUPTED;
+		}
+		p = nul + 1;
+	}
+	return GIT_SUCCESS;
+}
+
+/* Range of the entries whose ids start with the first 'len' hex digits of
+ * 'oid'; returns the first, and the number of them in 'count'. */
+static uint32_t kgit_midx_range(const kgit_midx *m, const git_oid *oid, unsigned int len, uint32_t *count)
+{
+	uint32_t lo = (oid->id[0] > 0) ? kgit_be32(m->fanout + (oid->id[0] - 1) * 4) : 0;
+	uint32_t hi = kgit_be32(m->fanout + oid->id[0] * 4), first, last;
+	unsigned int bytes = len / 2;
+	unsigned char mask = (len % 2) ? 0xf0 : 0;
+	unsigned char buf[GIT_OID_RAWSZ];
+	/* lower bound of the prefix padded with zeros */
+	memset(buf, 0, GIT_OID_RAWSZ);
+	memcpy(buf, oid->id, bytes);
+	if (mask) {
+		buf[bytes] = oid->id[bytes] & mask;
+	}
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (memcmp(m->ids + (size_t)mid * GIT_OID_RAWSZ, buf, GIT_OID_RAWSZ) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	first = last = lo;
+	while (last < m->n) {
+		const unsigned char *id = m->ids + (size_t)last * GIT_OID_RAWSZ;
+		if (memcmp(id, buf, bytes) != 0 || (mask && (id[bytes] & mask) != buf[bytes])) {
+			break;
+		}
+		last++;
+		if (last - first > 1) {
+			/* enough to know it is ambiguous */
+			break;
+		}
+	}
+	*count = last - first;
+	return first;
+}
+
+static int kgit_midx_find(const kgit_midx *m, const git_oid *oid, uint32_t *pack, uint64_t *offset)
+{
+	uint32_t count, i = kgit_midx_range(m, oid, GIT_OID_HEXSZ, &count);
+	const unsigned char *p;
+	uint32_t off;
+	if (count == 0) {
+		return GIT_ENOTFOUND;
+	}
+	p = m->offsets + (size_t)i * 8;
+	*pack = kgit_be32(p);
+	off = kgit_be32(p + 4);
+	if (m->large != NULL && (off & KGIT_MIDX_LARGE)) {
+		off &= ~KGIT_MIDX_LARGE;
+		if (off >= m->nlarge) {
+			return GIT_EOBJCORRUPTED;
+		}
+		*offset = ((uint64_t)kgit_be32(m->large + (size_t)off * 8) << 32) | kgit_be32(m->large + (size_t)off * 8 + 4);
+	} else {
+		*offset = off;
+	}
+	return (*pack < m->npacks) ? GIT_SUCCESS : GIT_EOBJCORRUPTED;
+}
+
+/* Read the object at 'offset' in a pack, resolving its delta chain. */
+static int kgit_midx_read_at(kgit_midx *m, uint32_t pack, uint64_t offset, unsigned char **out, size_t *len, git_otype *type, int depth)
+{
+	kgit_midxpack *mp = &m->packs[pack];
+	kgit_packentry e;
+	size_t hdrlen, used, baselen;
+	unsigned char *data, *base;
+	git_otype basetype;
+	int error;
+	if (mp->data == NULL && (mp->data = kgit_mapfile(mp->path, &mp->size)) == NULL) {
+		return GIT_ENOTFOUND;
+	}
+	if (depth > KGIT_MIDX_MAX_DEPTH || mp->size < GIT_OID_RAWSZ || offset >= mp->size - GIT_OID_RAWSZ) {
+		return GIT_EOBJCORRUPTED;
+	}
+	hdrlen = kgit_pack_header(&e, mp->data + offset, (size_t)(mp->size - GIT_OID_RAWSZ - offset), offset);
+	if (hdrlen == 0 || (data = (unsigned char *)malloc(e.size + 1)) == NULL) {
+		return (hdrlen == 0) ? GIT_EOBJCORRUPTED : GIT_ENOMEM;
+	}
+	error = kgit_pack_inflate(mp->data + offset + hdrlen, (size_t)(mp->size - GIT_OID_RAWSZ - offset - hdrlen), data, e.size, &used);
+	if (error < GIT_SUCCESS || !kgit_pack_isdelta(e.type)) {
+		if (error < GIT_SUCCESS) {
+			free(data);
+			return error;
+		}
+		data[e.size] = '\0';
+		*out = data;
+		*len = e.size;
+		*type = (git_otype)e.type;
+		return GIT_SUCCESS;
+	}
+	if (e.type == GIT_OBJ_REF_DELTA) {
+		error = kgit_midx_find(m, &e.base_oid, &pack, &offset);
+	} else {
+		offset = e.base_offset;
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_midx_read_at(m, pack, offset, &base, &baselen, &basetype, depth + 1);
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_delta_apply(out, len, base, baselen, data, e.size);
+		*type = basetype;
+		free(base);
+	}
+	free(data);
+	return error;
+}
+
+/* ------------------------------------------------------------------------ */
+/* git_odb_backend callbacks */
+
+static int kgit_midx_backend_read(void **out, size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid)
+{
+	kgit_midx *m = &((kgit_midx_backend *)backend)->midx;
+	uint32_t pack;
+	uint64_t offset;
+	int error = kgit_midx_find(m, oid, &pack, &offset);
+	if (error < GIT_SUCCESS) {
+		return error;
+	}
+	return kgit_midx_read_at(m, pack, offset, (unsigned char **)out, len, type, 0);
+}
+
+static int kgit_midx_backend_read_prefix(git_oid *full, void **out, size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid, unsigned int oidlen)
+{
+	kgit_midx *m = &((kgit_midx_backend *)backend)->midx;
+	uint32_t count, i = kgit_midx_range(m, oid, (oidlen > GIT_OID_HEXSZ) ? GIT_OID_HEXSZ : oidlen, &count);
+	if (count == 0) {
+		return GIT_ENOTFOUND;
+	}
+	if (count > 1) {
+		return GIT_EAMBIGUOUSOIDPREFIX;
+	}
+	git_oid_fromraw(full, m->ids + (size_t)i * GIT_OID_RAWSZ);
+	return kgit_midx_backend_read(out, len, type, backend, full);
+}
+
+static int kgit_midx_backend_read_header(size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid)
+{
+	void *data;
+	int error = kgit_midx_backend_read(&data, len, type, backend, oid);
+	if (error == GIT_SUCCESS) {
+		free(data);
+	}
+	return error;
+}
+
+static int kgit_midx_backend_exists(git_odb_backend *backend, const git_oid *oid)
+{
+	const kgit_midx *m = &((kgit_midx_backend *)backend)->midx;
+	uint32_t count;
+	kgit_midx_range(m, oid, GIT_OID_HEXSZ, &count);
+	return count > 0;
+}
+
+static void kgit_midx_backend_free(git_odb_backend *backend)
+{
+	kgit_midx_close(&((kgit_midx_backend *)backend)->midx);
+	free(backend);
+}
+
+/* ------------------------------------------------------------------------ */
+/* writer */
+
+typedef struct kgit_midxentry {
+	const unsigned char *id;
+	uint64_t offset;
+	uint32_t pack;
+	time_t mtime;
+} kgit_midxentry;
+
+static int kgit_midxentry_cmp(const void *a, const void *b)
+{
+	const kgit_midxentry *x = (const kgit_midxentry *)a, *y = (const kgit_midxentry *)b;
+	int cmp = memcmp(x->id, y->id, GIT_OID_RAWSZ);
+	if (cmp != 0) {
+		return cmp;
+	}
+	/* the copy in the newest pack comes first, and is the one kept */
+	if (x->mtime != y->mtime) {
+		return (x->mtime > y->mtime) ? -1 : 1;
+	}
+	return (x->pack < y->pack) ? -1 : (x->pack > y->pack);
+}
+
+static int kgit_strcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int kgit_midx_chunk(kgit_buf *buf, uint32_t id, uint64_t offset)
+{
+	unsigned char b[12];
+	kgit_put_be32(b, id);
+	kgit_put_be32(b + 4, (uint32_t)(offset >> 32));
+	kgit_put_be32(b + 8, (uint32_t)offset);
+	return kgit_buf_put(buf, b, 12);
+}
+
+/* Write the multi-pack index of every pack in 'dir'; returns the number
+ * of objects indexed. */
+static long kgit_midx_write(const char *dir, const char **msg)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	char **names = NULL;
+	kgit_packidx *idx = NULL;
+	time_t *mtimes = NULL;
+	kgit_midxentry *entries = NULL;
+	kgit_buf buf = {NULL, 0, 0};
+	unsigned char b[8];
+	size_t i, j, n = 0, total = 0, npacks = 0, capacity = 0, nameslen = 0, nlarge = 0, nchunks;
+	uint64_t off;
+	char *path = NULL;
+	int error = GIT_SUCCESS;
+	*msg = "cannot read pack directory";
+	if (d == NULL) {
+		return GIT_ENOTFOUND;
+	}
+	while (error == GIT_SUCCESS && (de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+		struct stat st;
+		char *pack;
+		if (len < 5 || strcmp(de->d_name + len - 4, ".idx") != 0) {
+			continue;
+		}
+		/* only packs that are there */
+		pack = kgit_midx_path(dir, de->d_name, len - 4, ".pack");
+		if (pack == NULL || stat(pack, &st) != 0) {
+			error = (pack == NULL) ? GIT_ENOMEM : GIT_SUCCESS;
+			free(pack);
+			continue;
+		}
+		free(pack);
+		if (npacks == capacity) {
+			capacity = (capacity == 0) ? 16 : capacity * 2;
+			char **tmp = (char **)realloc(names, capacity * sizeof(char *));
+			if (tmp == NULL) {
+				error = GIT_ENOMEM;
+				break;
+			}
+			names = tmp;
+		}
+		if ((names[npacks] = strdup(de->d_name)) == NULL) {
+			error = GIT_ENOMEM;
+			break;
+		}
+		npacks++;
+	}
+	closedir(d);
+	if (error == GIT_SUCCESS && npacks > 0) {
+		qsort(names, npacks, sizeof(char *), kgit_strcmp);
+		idx = (kgit_packidx *)calloc(npacks, sizeof(kgit_packidx));
+		mtimes = (time_t *)calloc(npacks, sizeof(time_t));
+		error = (idx != NULL && mtimes != NULL) ? GIT_SUCCESS : GIT_ENOMEM;
+	}
+	*msg = "cannot read index file";
+	for (i = 0; i < npacks && error == GIT_SUCCESS; i++) {
+		struct stat st;
+		path = kgit_midx_path(dir, names[i], strlen(names[i]) - 4, ".pack");
+		if (path == NULL) {
+			error = GIT_ENOMEM;
+			break;
+		}
+		mtimes[i] = (stat(path, &st) == 0) ? st.st_mtime : 0;
+		free(path);
+		path = kgit_midx_path(dir, names[i], strlen(names[i]), "");
+		error = (path != NULL) ? kgit_packidx_open(&idx[i], path) : GIT_ENOMEM;
+		free(path);
+		path = NULL;
+		total += (error == GIT_SUCCESS) ? idx[i].n : 0;
+		nameslen += strlen(names[i]) + 1;
+	}
+	*msg = "out of memory";
+	if (error == GIT_SUCCESS && (entries = (kgit_midxentry *)malloc((total + 1) * sizeof(kgit_midxentry))) == NULL) {
+		error = GIT_ENOMEM;
+	}
+	for (i = 0; i < npacks && error == GIT_SUCCESS; i++) {
+		for (j = 0; j < idx[i].n; j++) {
+			kgit_midxentry *e = &entries[n++];
+			e->id = idx[i].ids + j * GIT_OID_RAWSZ;
+			e->offset = kgit_packidx_offset(&idx[i], (uint32_t)j);
+			e->pack = (uint32_t)i;
+			e->mtime = mtimes[i];
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		qsort(entries, n, sizeof(kgit_midxentry), kgit_midxentry_cmp);
+		for (i = 0, j = 0; i < n; i++) {
+			if (j == 0 || memcmp(entries[j - 1].id, entries[i].id, GIT_OID_RAWSZ) != 0) {
+				entries[j++] = entries[i];
+				nlarge += (entries[i].offset >= KGIT_MIDX_LARGE);
+			}
+		}
+		n = j;
+	}
+	*msg = "cannot write multi-pack index";
+	if (error == GIT_SUCCESS) {
+		/* git only uses large offsets when some offset needs 32 bits */
+		int large = 0;
+		for (i = 0; i < n; i++) {
+			large |= (entries[i].offset > 0xffffffffULL);
+		}
+		if (!large) {
+			nlarge = 0;
+		}
+		nchunks = large ? 5 : 4;
+		nameslen = (nameslen + 3) & ~(size_t)3;
+		b[0] = 1;  /* version */
+		b[1] = 1;  /* SHA-1 */
+		b[2] = (unsigned char)nchunks;
+		b[3] = 0;  /* base files */
+		if ((error = kgit_buf_put(&buf, "MIDX", 4)) == GIT_SUCCESS && (error = kgit_buf_put(&buf, b, 4)) == GIT_SUCCESS) {
+			kgit_put_be32(b, (uint32_t)npacks);
+			error = kgit_buf_put(&buf, b, 4);
+		}
+		off = KGIT_MIDX_HEADER + (nchunks + 1) * 12;
+		if (error == GIT_SUCCESS) {
+			error = kgit_midx_chunk(&buf, KGIT_CHUNK_PNAM, off);
+		}
+		off += nameslen;
+		if (error == GIT_SUCCESS) {
+			error = kgit_midx_chunk(&buf, KGIT_CHUNK_OIDF, off);
+		}
+		off += 256 * 4;
+		if (error == GIT_SUCCESS) {
+			error = kgit_midx_chunk(&buf, KGIT_CHUNK_OIDL, off);
+		}
+		off += (uint64_t)n * GIT_OID_RAWSZ;
+		if (error == GIT_SUCCESS) {
+			error = kgit_midx_chunk(&buf, KGIT_CHUNK_OOFF, off);
+		}
+		off += (uint64_t)n * 8;
+		if (error == GIT_SUCCESS && large) {
+			error = kgit_midx_chunk(&buf, KGIT_CHUNK_LOFF, off);
+			off += (uint64_t)nlarge * 8;
+		}
+		if (error == GIT_SUCCESS) {
+			error = kgit_midx_chunk(&buf, 0, off);
+		}
+		for (i = 0; i < npacks && error == GIT_SUCCESS; i++) {
+			error = kgit_buf_put(&buf, names[i], strlen(names[i]) + 1);
+		}
+		while (error == GIT_SUCCESS && buf.size % 4 != 0) {
+			error = kgit_buf_put(&buf, "", 1);
+		}
+		for (i = 0, j = 0; i < 256 && error == GIT_SUCCESS; i++) {
+			while (j < n && entries[j].id[0] == i) {
+				j++;
+			}
+			kgit_put_be32(b, (uint32_t)j);
+			error = kgit_buf_put(&buf, b, 4);
+		}
+		for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+			error = kgit_buf_put(&buf, entries[i].id, GIT_OID_RAWSZ);
+		}
+		for (i = 0, j = 0; i < n && error == GIT_SUCCESS; i++) {
+			kgit_put_be32(b, entries[i].pack);
+			if (large && entries[i].offset >= KGIT_MIDX_LARGE) {
+				kgit_put_be32(b + 4, KGIT_MIDX_LARGE | (uint32_t)j++);
+			} else {
+				kgit_put_be32(b + 4, (uint32_t)entries[i].offset);
+			}
+			error = kgit_buf_put(&buf, b, 8);
+		}
+		for (i = 0; i < n && error == GIT_SUCCESS && large; i++) {
+			if (entries[i].offset >= KGIT_MIDX_LARGE) {
+				kgit_put_be32(b, (uint32_t)(entries[i].offset >> 32));
+				kgit_put_be32(b + 4, (uint32_t)entries[i].offset);
+				error = kgit_buf_put(&buf, b, 8);
+			}
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		kgit_sha1_ctx sha1;
+		git_oid checksum;
+		kgit_sha1_init(&sha1);
+		kgit_sha1_update(&sha1, buf.ptr, buf.size);
+		kgit_sha1_final(&checksum, &sha1);
+		error = kgit_buf_put(&buf, checksum.id, GIT_OID_RAWSZ);
+	}
+	if (error == GIT_SUCCESS) {
+		path = kgit_midx_path(dir, KGIT_MIDX_NAME, strlen(KGIT_MIDX_NAME), "");
+		error = (path != NULL) ? kgit_writefile(path, buf.ptr, buf.size) : GIT_ENOMEM;
+		free(path);
+	}
+	for (i = 0; i < npacks; i++) {
+		if (idx != NULL) {
+			kgit_packidx_close(&idx[i]);
+		}
+		free(names[i]);
+	}
+	free(names);
+	free(idx);
+	free(mtimes);
+	free(entries);
+	free(buf.ptr);
+	return (error < GIT_SUCCESS) ? error : (long)n;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Create an odb backend that finds objects through the multi-pack index of
+ * a pack directory, written by GitPack.writeMidx(). Add it to a GitOdb
+ * with a priority above the one of the packs (1) to look objects up with
+ * one binary search instead of one per pack. */
+//## @Native @Static GitOdbBackend GitOdbBackend.midx(Path pack_dir);
+KMETHOD GitOdbBackend_midx(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const char *dir = sfp[1].pth->ospath;
+	kgit_midx_backend *backend = (kgit_midx_backend *)calloc(1, sizeof(kgit_midx_backend));
+	int error = (backend != NULL) ? kgit_midx_open(&backend->midx, dir) : GIT_ENOMEM;
+	if (error < GIT_SUCCESS) {
+		free(backend);
+		KNH_NTRACE2(ctx, "git_odb_backend_midx", K_FAILED, KNH_LDATA(LOG_i("errno", error), LOG_s("path", dir)));
+		RETURN_(KNH_NULL);
+	}
+	backend->parent.read = kgit_midx_backend_read;
+	backend->parent.read_prefix = kgit_midx_backend_read_prefix;
+	backend->parent.read_header = kgit_midx_backend_read_header;
+	backend->parent.exists = kgit_midx_backend_exists;
+	backend->parent.free = kgit_midx_backend_free;
+	RETURN_(new_ReturnRawPtr(ctx, sfp, backend));
+}
+
+/* Write the multi-pack index of all the packs in a pack directory, as
+ * git does, and return the number of objects in it, or -1 on error. */
+//## @Native @Static int GitPack.writeMidx(Path pack_dir);
+KMETHOD GitPack_writeMidx(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const char *msg;
+	long n = kgit_midx_write(sfp[1].pth->ospath, &msg);
+	if (n < GIT_SUCCESS) {
+		KNH_NTRACE2(ctx, "git_pack_write_midx", K_FAILED, KNH_LDATA(LOG_i("errno", n), LOG_msg(msg)));
+		RETURNi_(-1);
+	}
+	RETURNi_(n);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -68,7 +68,12 @@ static void kGitOdbBackend_init(CTX ctx, kRawPtr *po)
 static void kGitOdbBackend_free(CTX ctx, kRawPtr *po)
 {
 	if (po->rawptr != NULL) {
-		KNH_FREE(ctx, po->rawptr, sizeof(git_odb_backend));
+		git_odb_backend *backend = (git_odb_backend *)po->rawptr;
+		if (backend->free != NULL) {
+			backend->free(backend);
+		} else {
+			KNH_FREE(ctx, po->rawptr, sizeof(git_odb_backend));
+		}
 		po->rawptr = NULL;
 	}
 }
@@ -113,6 +118,9 @@ KMETHOD GitOdb_addAlternate(CTX ctx, ksfp_t *sfp _RIX)
 	int error = git_odb_add_alternate(odb, backend, priority);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_odb_add_alternate", error);
+	} else {
+		/* the odb owns the backend now */
+		sfp[1].p->rawptr = NULL;
 	}
 	RETURNvoid_();
 }
@@ -127,6 +135,9 @@ KMETHOD GitOdb_addBackend(CTX ctx, ksfp_t *sfp _RIX)
 	int error = git_odb_add_backend(odb, backend, priority);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_odb_add_backend", error);
+	} else {
+		/* the odb owns the backend now */
+		sfp[1].p->rawptr = NULL;
 	}
 	RETURNvoid_();
 }
@@ -67,6 +67,27 @@ DEFAPI(void) defGitOid(CTX ctx, kclass_t cid, kclassdef_t *cdef)
 	cdef->compareTo = kGitOid_compareTo;
 }
 
+static void kGitOidList_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitOidList_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_oidlist *list = (kgit_oidlist *)po->rawptr;
+		KNH_FREE(ctx, list, kgit_oidlist_sizeof(list->capacity));
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitOidList(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitOidList";
+	cdef->init = kGitOidList_init;
+	cdef->free = kGitOidList_free;
+}
+
 static void kGitOidShorten_init(CTX ctx, kRawPtr *po)
 {
 	po->rawptr = NULL;
@@ -87,6 +108,31 @@ DEFAPI(void) defGitOidShorten(CTX ctx, kclass_t cid, kclassdef_t *cdef)
 	cdef->free = kGitOidShorten_free;
 }
 
+/* Return a newly allocated copy of an oid owned by some other object */
+kObject *new_GitOidCopy(CTX ctx, ksfp_t *sfp, const git_oid *src)
+{
+	git_oid *oid = (git_oid *)KNH_MALLOC(ctx, sizeof(git_oid));
+	git_oid_cpy(oid, src);
+	return new_ReturnRawPtr(ctx, sfp, oid);
+}
+
+/* Return a new GitOid holding a copy of an oid, e.g. to fill an array */
+kObject *new_GitOid(CTX ctx, const git_oid *src)
+{
+	git_oid *oid = (git_oid *)KNH_MALLOC(ctx, sizeof(git_oid));
+	git_oid_cpy(oid, src);
+	return (kObject *)new_RawPtr(ctx, ctx->share->ClassTBL[knh_getcid(ctx, STEXT("GitOid"))], oid);
+}
+
+/* Allocate a list of up to 'capacity' oids in one block */
+kgit_oidlist *kgit_oidlist_new(CTX ctx, size_t capacity)
+{
+	kgit_oidlist *list = (kgit_oidlist *)KNH_MALLOC(ctx, kgit_oidlist_sizeof(capacity));
+	list->size = 0;
+	list->capacity = capacity;
+	return list;
+}
+
 /* ------------------------------------------------------------------------ */
 
 /* fields */
@@ -189,6 +235,63 @@ KMETHOD GitOid_pathfmt(CTX ctx, ksfp_t *sfp _RIX)
 	RETURN_(new_String(ctx, str));
 }
 
+/* Format every oid of the list into one string of hex ids, each followed
+ * by a newline, as git rev-list prints them */
+//## @Native String GitOidList.fmt();
+KMETHOD GitOidList_fmt(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const kgit_oidlist *list = RawPtr_to(const kgit_oidlist *, sfp[0]);
+	size_t i, n = (list != NULL) ? list->size : 0;
+	char *str = (char *)malloc(n * (GIT_OID_HEXSZ + 1) + 1);
+	if (str == NULL) {
+		KNH_NTRACE2(ctx, "git_oid_fmt", K_FAILED, KNH_LDATA(LOG_msg("out of memory")));
+		RETURN_(KNH_TNULL(String));
+	}
+	for (i = 0; i < n; i++) {
+		git_oid_fmt(str + i * (GIT_OID_HEXSZ + 1), &list->ids[i]);
+		str[i * (GIT_OID_HEXSZ + 1) + GIT_OID_HEXSZ] = '\n';
+	}
+	str[n * (GIT_OID_HEXSZ + 1)] = '\0';
+	kString *s = new_String(ctx, str);
+	free(str);
+	RETURN_(s);
+}
+
+/* Get the n-th oid of the list, or null when n is out of range */
+//## @Native GitOid GitOidList.get(int n);
+KMETHOD GitOidList_get(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const kgit_oidlist *list = RawPtr_to(const kgit_oidlist *, sfp[0]);
+	kint_t n = Int_to(kint_t, sfp[1]);
+	if (list == NULL || n < 0 || (size_t)n >= list->size) {
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_GitOidCopy(ctx, sfp, &list->ids[n]));
+}
+
+/* Get every oid of the list as raw bytes, GIT_OID_RAWSZ (20) per oid and
+ * in list order, copied in one block */
+//## @Native Bytes GitOidList.raw();
+KMETHOD GitOidList_raw(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const kgit_oidlist *list = RawPtr_to(const kgit_oidlist *, sfp[0]);
+	size_t size = (list != NULL) ? list->size * GIT_OID_RAWSZ : 0;
+	kBytes *ba = new_Bytes(ctx, "git_oid_list_raw", size);
+	if (size > 0) {
+		/* git_oid is only its raw id, so the list is already packed */
+		knh_Bytes_write2(ctx, ba, (const char *)list->ids, size);
+	}
+	RETURN_(ba);
+}
+
+/* Get the number of oids in the list */
+//## @Native int GitOidList.size();
+KMETHOD GitOidList_size(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const kgit_oidlist *list = RawPtr_to(const kgit_oidlist *, sfp[0]);
+	RETURNi_(list != NULL ? list->size : 0);
+}
+
 /* Add a new OID to set of shortened OIDs and calculate the minimal length to
  * uniquely identify all the OIDs in the set. */
 //## @Native void GitOidShorten.add(String text_oid);
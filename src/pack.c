@@ -0,0 +1,519 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Helpers for reading packfiles and writing their .idx files, shared by the
+ * native indexer and the pack verifier. */
+
+#define KGIT_ZLIB_CHUNK  0x40000000U
+
+static const char *kgit_type_names[] = {
+	NULL, "commit", "tree", "blob", "tag"
+};
+
+/* Parse the header of the object at pack offset 'off', whose first 'avail'
+ * bytes are at 'p'; returns the header length (including the delta base),
+ * or 0 when it is invalid or does not fit in 'avail'. */
+size_t kgit_pack_header(kgit_packentry *e, const unsigned char *p, size_t avail, uint64_t off)
+{
+	size_t i = 0;
+	unsigned int shift = 4;
+	unsigned char c;
+	if (avail == 0) {
+		return 0;
+	}
+	c = p[i++];
+	e->offset = off;
+	e->type = (c >> 4) & 0x7;
+	e->size = c & 0xf;
+	while (c & 0x80) {
+		if (i == avail || shift > 57) {
+			return 0;
+		}
+		c = p[i++];
+		e->size += (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	}
+	if (e->type == GIT_OBJ_OFS_DELTA) {
+		uint64_t base;
+		if (i == avail) {
+			return 0;
+		}
+		c = p[i++];
+		base = c & 0x7f;
+		while (c & 0x80) {
+			if (i == avail || base > (UINT64_MAX >> 8)) {
+				return 0;
+			}
+			c = p[i++];
+			base = ((base + 1) << 7) | (c & 0x7f);
+		}
+		if (base == 0 || base > off) {
+			return 0;
+		}
+		e->base_offset = off - base;
+	} else if (e->type == GIT_OBJ_REF_DELTA) {
+		if (avail - i < GIT_OID_RAWSZ) {
+			return 0;
+		}
+		git_oid_fromraw(&e->base_oid, p + i);
+		i += GIT_OID_RAWSZ;
+	} else if (e->type < GIT_OBJ_COMMIT || e->type > GIT_OBJ_TAG) {
+		return 0;
+	}
+	e->real_type = kgit_pack_isdelta(e->type) ? GIT_OBJ_BAD : e->type;
+	return i;
+}
+
+/* Inflate a zlib stream whose inflated size is known; '*used' receives the
+ * number of compressed bytes. */
+int kgit_pack_inflate(const unsigned char *in, size_t inlen, unsigned char *out, size_t outlen, size_t *used)
+{
+	unsigned char dummy;
+	unsigned char *base = (outlen > 0) ? out : &dummy;
+	z_stream s;
+	int status;
+	memset(&s, 0, sizeof(z_stream));
+	if (inflateInit(&s) != Z_OK) {
+		return GIT_ENOMEM;
+	}
+	s.next_in = (Bytef *)in;
+	s.next_out = base;
+	do {
+		/* zlib counts in uInt, so large objects are fed in slices */
+		size_t in_left = inlen - (size_t)(s.next_in - in);
+		size_t out_left = outlen - (size_t)(s.next_out - base);
+		s.avail_in = (in_left > KGIT_ZLIB_CHUNK) ? KGIT_ZLIB_CHUNK : (uInt)in_left;
+		s.avail_out = (out_left > KGIT_ZLIB_CHUNK) ? KGIT_ZLIB_CHUNK : (uInt)out_left;
+		status = inflate(&s, Z_NO_FLUSH);
+	} while (status == Z_OK);
+	*used = (size_t)(s.next_in - in);
+	inflateEnd(&s);
+	return (status == Z_STREAM_END && (size_t)(s.next_out - base) == outlen) ? GIT_SUCCESS : GIT_EOBJCORRUPTED;
+}
+
+static int kgit_delta_size(const unsigned char **p, const unsigned char *end, size_t *size)
+{
+	unsigned int shift = 0;
+	unsigned char c;
+	*size = 0;
+	do {
+		if (*p == end || shift > 57) {
+			return GIT_EOBJCORRUPTED;
+		}
+		c = *(*p)++;
+		*size |= (size_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return GIT_SUCCESS;
+}
+
+/* Apply a git delta to 'base'; the result is malloc'ed. */
+int kgit_delta_apply(unsigned char **out, size_t *outlen, const unsigned char *base, size_t baselen, const unsigned char *delta, size_t deltalen)
+{
+	const unsigned char *p = delta, *end = delta + deltalen;
+	size_t srclen, dstlen, n = 0;
+	unsigned char *dst;
+	if (kgit_delta_size(&p, end, &srclen) < GIT_SUCCESS || srclen != baselen ||
+			kgit_delta_size(&p, end, &dstlen) < GIT_SUCCESS) {
+		return GIT_EOBJCORRUPTED;
+	}
+	if ((dst = (unsigned char *)malloc(dstlen + 1)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	while (p < end) {
+		unsigned char cmd = *p++;
+		if (cmd & 0x80) {
+			size_t off = 0, len = 0;
+			int i;
+			for (i = 0; i < 4; i++) {
+				if ((cmd & (1 << i)) && p < end) off |= (size_t)*p++ << (8 * i);
+			}
+			for (i = 0; i < 3; i++) {
+				if ((cmd & (0x10 << i)) && p < end) len |= (size_t)*p++ << (8 * i);
+			}
+			if (len == 0) {
+				len = 0x10000;
+			}
+			if (off + len < off || off + len > baselen || len > dstlen - n) {
+				break;
+			}
+			memcpy(dst + n, base + off, len);
+			n += len;
+		} else if (cmd != 0) {
+			if (cmd > (size_t)(end - p) || cmd > dstlen - n) {
+				break;
+			}
+			memcpy(dst + n, p, cmd);
+			p += cmd;
+			n += cmd;
+		} else {
+			break;
+		}
+	}
+	if (p != end || n != dstlen) {
+		free(dst);
+		return GIT_EOBJCORRUPTED;
+	}
+	*out = dst;
+	*outlen = dstlen;
+	return GIT_SUCCESS;
+}
+
+/* Start hashing an object of the given type and size; the data follows. */
+void kgit_object_hash_init(kgit_sha1_ctx *sha1, int type, uint64_t len)
+{
+	char header[64];
+	int hlen = sprintf(header, "%s %lu", kgit_type_names[type], (unsigned long)len) + 1;
+	kgit_sha1_init(sha1);
+	kgit_sha1_update(sha1, header, hlen);
+}
+
+/* Compute the id of an object of the given type. */
+void kgit_object_hash(git_oid *oid, int type, const unsigned char *data, size_t len)
+{
+	kgit_sha1_ctx sha1;
+	kgit_object_hash_init(&sha1, type, len);
+	kgit_sha1_update(&sha1, data, len);
+	kgit_sha1_final(oid, &sha1);
+}
+
+static int kgit_packentry_oidcmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&(*(const kgit_packentry **)a)->oid, &(*(const kgit_packentry **)b)->oid);
+}
+
+/* Write a version 2 pack index for 'n' resolved entries to 'path'. */
+int kgit_packidx_write(const char *path, kgit_packentry *entries, size_t n, const git_oid *pack_checksum)
+{
+	static const unsigned char header[8] = {0xff, 't', 'O', 'c', 0, 0, 0, 2};
+	kgit_buf buf = {NULL, 0, 0};
+	unsigned char b[8];
+	git_oid checksum;
+	size_t i, nlarge = 0;
+	int byte, error;
+	kgit_packentry **sorted = (kgit_packentry **)malloc((n + 1) * sizeof(kgit_packentry *));
+	if (sorted == NULL) {
+		return GIT_ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		sorted[i] = &entries[i];
+	}
+	qsort(sorted, n, sizeof(kgit_packentry *), kgit_packentry_oidcmp);
+	error = kgit_buf_put(&buf, header, 8);
+	for (byte = 0, i = 0; byte < 256 && error == GIT_SUCCESS; byte++) {
+		while (i < n && sorted[i]->oid.id[0] == byte) {
+			i++;
+		}
+		kgit_put_be32(b, (uint32_t)i);
+		error = kgit_buf_put(&buf, b, 4);
+	}
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		error = kgit_buf_put(&buf, sorted[i]->oid.id, GIT_OID_RAWSZ);
+	}
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		kgit_put_be32(b, sorted[i]->crc);
+		error = kgit_buf_put(&buf, b, 4);
+	}
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		if (sorted[i]->offset < 0x80000000ULL) {
+			kgit_put_be32(b, (uint32_t)sorted[i]->offset);
+		} else {
+			kgit_put_be32(b, 0x80000000U | (uint32_t)nlarge++);
+		}
+		error = kgit_buf_put(&buf, b, 4);
+	}
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		if (sorted[i]->offset >= 0x80000000ULL) {
+			kgit_put_be32(b, (uint32_t)(sorted[i]->offset >> 32));
+			kgit_put_be32(b + 4, (uint32_t)sorted[i]->offset);
+			error = kgit_buf_put(&buf, b, 8);
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_buf_put(&buf, pack_checksum->id, GIT_OID_RAWSZ);
+	}
+	if (error == GIT_SUCCESS) {
+		kgit_sha1_ctx sha1;
+		kgit_sha1_init(&sha1);
+		kgit_sha1_update(&sha1, buf.ptr, buf.size);
+		kgit_sha1_final(&checksum, &sha1);
+		error = kgit_buf_put(&buf, checksum.id, GIT_OID_RAWSZ);
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_writefile(path, buf.ptr, buf.size);
+	}
+	free(buf.ptr);
+	free(sorted);
+	return error;
+}
+
+/* Build the path of the file 'pack-<checksum><ext>' next to 'pack_path'. */
+char *kgit_pack_sibling(const char *pack_path, const git_oid *checksum, const char *ext)
+{
+	const char *slash = strrchr(pack_path, '/');
+	size_t dirlen = (slash != NULL) ? (size_t)(slash - pack_path) + 1 : 0;
+	char *path = (char *)malloc(dirlen + 5 + GIT_OID_HEXSZ + strlen(ext) + 1);
+	if (path != NULL) {
+		memcpy(path, pack_path, dirlen);
+		memcpy(path + dirlen, "pack-", 5);
+		git_oid_fmt(path + dirlen + 5, checksum);
+		strcpy(path + dirlen + 5 + GIT_OID_HEXSZ, ext);
+	}
+	return path;
+}
+
+/* Map a whole file read-only; NULL when it cannot be read or is empty. */
+unsigned char *kgit_mapfile(const char *path, size_t *size)
+{
+	struct stat st;
+	void *data = MAP_FAILED;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		*size = (size_t)st.st_size;
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	return (data != MAP_FAILED) ? (unsigned char *)data : NULL;
+}
+
+/* Open a version 2 .idx file and check its layout and checksum. */
+int kgit_packidx_open(kgit_packidx *idx, const char *path)
+{
+	static const unsigned char header[8] = {0xff, 't', 'O', 'c', 0, 0, 0, 2};
+	kgit_sha1_ctx sha1;
+	git_oid checksum;
+	size_t i, min;
+	memset(idx, 0, sizeof(kgit_packidx));
+	if ((idx->data = kgit_mapfile(path, &idx->size)) == NULL) {
+		return GIT_ENOTFOUND;
+	}
+	if (idx->size < 8 + 256 * 4 + 2 * GIT_OID_RAWSZ || memcmp(idx->data, header, 8) != 0) {
+		kgit_packidx_close(idx);
+		return GIT_EOBJCORRUPTED;
+	}
+	idx->fanout = idx->data + 8;
+	idx->n = kgit_be32(idx->fanout + 255 * 4);
+	idx->ids = idx->fanout + 256 * 4;
+	idx->crcs = idx->ids + (size_t)idx->n * GIT_OID_RAWSZ;
+	idx->offsets = idx->crcs + (size_t)idx->n * 4;
+	idx->large = idx->offsets + (size_t)idx->n * 4;
+	min = 8 + 256 * 4 + (size_t)idx->n * (GIT_OID_RAWSZ + 8) + 2 * GIT_OID_RAWSZ;
+	if (idx->size < min || (idx->size - min) % 8 != 0) {
+		kgit_packidx_close(idx);
+		return GIT_EOBJCORRUPTED;
+	}
+	idx->nlarge = (idx->size - min) / 8;
+	for (i = 1; i < 256; i++) {
+		if (kgit_be32(idx->fanout + i * 4) < kgit_be32(idx->fanout + (i - 1) * 4)) {
+			kgit_packidx_close(idx);
+			return GIT_EOBJCORRUPTED;
+		}
+	}
+	git_oid_fromraw(&idx->pack_checksum, idx->data + idx->size - 2 * GIT_OID_RAWSZ);
+	kgit_sha1_init(&sha1);
+	kgit_sha1_update(&sha1, idx->data, idx->size - GIT_OID_RAWSZ);
+	kgit_sha1_final(&checksum, &sha1);
+	if (memcmp(checksum.id, idx->data + idx->size - GIT_OID_RAWSZ, GIT_OID_RAWSZ) != 0) {
+		kgit_packidx_close(idx);
+		return GIT_EOBJCORRUPTED;
+	}
+	return GIT_SUCCESS;
+}
+
+void kgit_packidx_close(kgit_packidx *idx)
+{
+	if (idx->data != NULL) {
+		munmap(idx->data, idx->size);
+		idx->data = NULL;
+	}
+}
+
+/* Pack offset of the i-th object of the index; 0 when it is corrupted. */
+uint64_t kgit_packidx_offset(const kgit_packidx *idx, uint32_t i)
+{
+	uint32_t off = kgit_be32(idx->offsets + (size_t)i * 4);
+	if (off & 0x80000000U) {
+		const unsigned char *p;
+		off &= 0x7fffffffU;
+		if (off >= idx->nlarge) {
+			return 0;
+		}
+		p = idx->large + (size_t)off * 8;
+		return ((uint64_t)kgit_be32(p) << 32) | kgit_be32(p + 4);
+	}
+	return off;
+}
+
+/* Position of 'oid' in the index, or -1 when it is not there. */
+long kgit_packidx_find(const kgit_packidx *idx, const git_oid *oid)
+{
+	uint32_t lo = (oid->id[0] > 0) ? kgit_be32(idx->fanout + (oid->id[0] - 1) * 4) : 0;
+	uint32_t hi = kgit_be32(idx->fanout + oid->id[0] * 4);
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(idx->ids + (size_t)mid * GIT_OID_RAWSZ, oid->id, GIT_OID_RAWSZ);
+		if (cmp == 0) {
+			return (long)mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void kGitPack_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitPack_free(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+DEFAPI(void) defGitPack(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitPack";
+	cdef->init = kGitPack_init;
+	cdef->free = kGitPack_free;
+}
+
+static void kGitPackStats_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitPackStats_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_packstats *stats = (kgit_packstats *)po->rawptr;
+		free(stats->chains);
+		KNH_FREE(ctx, stats, sizeof(kgit_packstats));
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitPackStats(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitPackStats";
+	cdef->init = kGitPackStats_init;
+	cdef->free = kGitPackStats_free;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Check a packfile against its .idx: the pack and index checksums, the CRC32
+ * of every object, and the id of every object once its deltas are resolved.
+ * The work is spread over one thread per core. Returns null, and logs the
+ * corrupted object it found, when the pack does not verify. */
+//## @Native @Static GitPackStats GitPack.verify(Path pack);
+KMETHOD GitPack_verify(CTX ctx, ksfp_t *sfp _RIX)
+{
+	const char *pack_path = sfp[1].pth->ospath;
+	const char *msg;
+	kgit_packstats *stats = (kgit_packstats *)KNH_MALLOC(ctx, sizeof(kgit_packstats));
+	int error = kgit_pack_verify(stats, pack_path, 0, &msg);
+	if (error < GIT_SUCCESS) {
+		static const unsigned char zero[GIT_OID_RAWSZ];
+		char bad[GIT_OID_HEXSZ + 1] = {0};
+		if (memcmp(stats->bad.id, zero, GIT_OID_RAWSZ) != 0) {
+			git_oid_fmt(bad, &stats->bad);
+		}
+		free(stats->chains);
+		KNH_FREE(ctx, stats, sizeof(kgit_packstats));
+		KNH_NTRACE2(ctx, "git_pack_verify", K_FAILED, KNH_LDATA(LOG_i("errno", error), LOG_s("path", pack_path), LOG_msg(msg), LOG_s("oid", bad)));
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, stats));
+}
+
+/* Get the number of objects at delta chain length 'depth' */
+//## @Native int GitPackStats.chainLength(int depth);
+KMETHOD GitPackStats_chainLength(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_packstats *stats = RawPtr_to(kgit_packstats *, sfp[0]);
+	int depth = Int_to(int, sfp[1]);
+	if (depth < 0 || (size_t)depth > stats->maxdepth) {
+		RETURNi_(0);
+	}
+	RETURNi_(stats->chains[depth]);
+}
+
+/* Get the number of deltified objects */
+//## @Native int GitPackStats.deltas();
+KMETHOD GitPackStats_deltas(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_packstats *stats = RawPtr_to(kgit_packstats *, sfp[0]);
+	RETURNi_(stats->deltas);
+}
+
+/* Get the length of the longest delta chain */
+//## @Native int GitPackStats.maxDepth();
+KMETHOD GitPackStats_maxDepth(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_packstats *stats = RawPtr_to(kgit_packstats *, sfp[0]);
+	RETURNi_(stats->maxdepth);
+}
+
+/* Get the number of objects in the packfile */
+//## @Native int GitPackStats.objects();
+KMETHOD GitPackStats_objects(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_packstats *stats = RawPtr_to(kgit_packstats *, sfp[0]);
+	RETURNi_(stats->objects);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -47,6 +47,8 @@ static void kGitRepository_init(CTX ctx, kRawPtr *po)
 static void kGitRepository_free(CTX ctx, kRawPtr *po)
 {
 	if (po->rawptr != NULL) {
+		kgit_treecache_drop((git_repository *)po->rawptr);
+		kgit_countcache_drop((git_repository *)po->rawptr);
 		git_repository_free((git_repository *)po->rawptr);
 		po->rawptr = NULL;
 	}
@@ -189,7 +191,19 @@ KMETHOD GitRepository_index(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_index *index;
 	git_repository *repo = RawPtr_to(git_repository *, sfp[0]);
-	int error = git_repository_index(&index, repo);
+	const char *path = git_repository_path(repo, GIT_REPO_PATH_INDEX);
+	char *shared = kgit_splitindex_shared(path);
+	int error;
+	if (shared == NULL) {
+		error = git_repository_index(&index, repo);
+		if (error == GIT_SUCCESS) {
+			kgit_index_register(index, repo, path);
+		}
+	} else {
+		/* libgit2 cannot parse a split index file */
+		free(shared);
+		error = kgit_index_open(&index, repo, path);
+	}
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_repository_index", error);
 		RETURN_(KNH_NULL);
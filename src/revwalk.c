@@ -29,13 +29,1136 @@
 //  chen_ji - Takuma Wakamori, Yokohama National University, Japan
 // **************************************************************************
 
+
 #include <konoha1.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "libgit2.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* ------------------------------------------------------------------------ */
+/* A GitRevwalk wraps libgit2's walker and keeps what was pushed and hidden,
+ * so that the walk can also be run natively: libgit2 0.16 gives no say over
+ * which parents get enqueued, and path limiting needs it. The native walk
+ * reads commits straight from the odb into a queue ordered by commit time,
+ * ties in insertion order, as git rev-list does; it is used as soon as an
+ * option libgit2 lacks is set. Commits listed in git's commit-graph file
+ * are read from it instead, without inflating them. */
+
+#define KGIT_REVWALK_BATCH    1024
+
+/* walk modes, given along with the sorting mode */
+#define KGIT_SORT_FIRST_PARENT  (1 << 8)
+#define KGIT_SORT_MERGES        (1 << 9)
+#define KGIT_SORT_NO_MERGES     (1 << 10)
+#define KGIT_SORT_MODES         (KGIT_SORT_FIRST_PARENT | KGIT_SORT_MERGES | KGIT_SORT_NO_MERGES)
+
+#define KGIT_COMMIT_PARSED    (1 << 0)
+#define KGIT_COMMIT_ADDED     (1 << 1)  /* queued, which happens once */
+#define KGIT_COMMIT_HIDDEN    (1 << 2)
+#define KGIT_COMMIT_SHOWN     (1 << 3)
+#define KGIT_COMMIT_BOTTOM    (1 << 4)  /* hidden by hide() itself */
+#define KGIT_COMMIT_VISITED   (1 << 5)
+#define KGIT_COMMIT_QUEUED    (1 << 6)
+
+/* hidden commits below the ones hide() was given do not count when
+ * simplifying history, as in git */
+#define kgit_commit_relevant(node) \
+	(((node)->flags & (KGIT_COMMIT_HIDDEN | KGIT_COMMIT_BOTTOM)) != KGIT_COMMIT_HIDDEN)
+
+#define KGIT_GRAPH_CHUNK_OIDF  0x4f494446U
+#define KGIT_GRAPH_CHUNK_OIDL  0x4f49444cU
+#define KGIT_GRAPH_CHUNK_CDAT  0x43444154U
+#define KGIT_GRAPH_CHUNK_EDGE  0x45444745U
+#define KGIT_GRAPH_NONE        0x70000000U
+#define KGIT_GRAPH_EXTRA       0x80000000U
+#define KGIT_GRAPH_CDAT_SIZE   (GIT_OID_RAWSZ + 16)
+
+/* objects/info/commit-graph: for each commit, its tree, its parents as
+ * positions in the file, and its generation and commit time */
+typedef struct kgit_commitgraph {
+	unsigned char *data;
+	size_t size;
+	uint32_t n;
+	const unsigned char *fanout;
+	const unsigned char *ids;
+	const unsigned char *commits;
+	const unsigned char *edges;
+	size_t nedges;
+} kgit_commitgraph;
+
+typedef struct kgit_pathstate {
+	git_oid oid;
+	unsigned int attr;  /* 0 when the path does not exist */
+} kgit_pathstate;
+
+typedef struct kgit_commitnode {
+	struct kgit_commitnode *next;  /* hash chain */
+	git_oid oid;
+	git_oid tree;
+	git_time_t time;
+	unsigned long seq;
+	unsigned int flags;
+	unsigned int indegree;
+	uint32_t graphpos;             /* position in the commit-graph + 1 */
+	unsigned int nparents;
+	struct kgit_commitnode **parents;
+	kgit_pathstate *paths;         /* resolved on first use */
+} kgit_commitnode;
+
+typedef struct kgit_revtip {
+	git_oid oid;
+	int hide;
+} kgit_revtip;
+
+typedef struct kgit_revwalk {
+	git_revwalk *walk;
+	git_repository *repo;
+	unsigned int sorting;
+	kgit_revtip *tips;
+	size_t ntips;
+	size_t tipscap;
+	int started;                   /* libgit2's walk has yielded commits */
+	/* native walk */
+	int native;                    /* forced by count() */
+	kgit_commitgraph graph;
+	int graph_loaded;
+	int prepared;
+	kgit_commitnode **buckets;
+	size_t nbuckets;
+	size_t nnodes;
+	kgit_commitnode **queue;
+	size_t nqueue;
+	size_t queuecap;
+	unsigned long seq;
+	/* the whole output, when it is sorted before being returned */
+	int buffered;
+	kgit_commitnode **output;
+	size_t noutput;
+	size_t outputcap;
+	size_t outputpos;
+	/* limitPaths(), since(), until() and maxCount() */
+	char **paths;
+	size_t npaths;
+	git_time_t since;
+	git_time_t until;
+	kint_t maxcount;
+	size_t nshown;
+	/* resume() */
+	unsigned char *cursor;
+	size_t cursorsize;
+} kgit_revwalk;
+
+static int kgit_revwalk_isnative(const kgit_revwalk *w)
+{
+	return w->native || (w->sorting & KGIT_SORT_MODES) || w->npaths > 0 || w->since >= 0 || w->until >= 0
+		|| w->cursor != NULL;
+}
+
+static int kgit_revwalk_grow(void **array, size_t *capacity, size_t size, size_t unit)
+{
+	void *tmp;
+	size_t n;
+	if (size < *capacity) {
+		return GIT_SUCCESS;
+	}
+	n = (*capacity == 0) ? 64 : *capacity * 2;
+	if ((tmp = realloc(*array, n * unit)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	*array = tmp;
+	*capacity = n;
+	return GIT_SUCCESS;
+}
+
+/* Forget the commits of the native walk, keeping the tips and options. */
+static void kgit_revwalk_clear(kgit_revwalk *w)
+{
+	size_t i;
+	for (i = 0; i < w->nbuckets; i++) {
+		kgit_commitnode *node = w->buckets[i];
+		while (node != NULL) {
+			kgit_commitnode *next = node->next;
+			free(node->parents);
+			free(node->paths);
+			free(node);
+			node = next;
+		}
+	}
+	free(w->buckets);
+	free(w->queue);
+	free(w->output);
+	w->buckets = NULL;
+	w->nbuckets = w->nnodes = 0;
+	w->queue = NULL;
+	w->nqueue = w->queuecap = 0;
+	w->output = NULL;
+	w->noutput = w->outputcap = w->outputpos = 0;
+	w->buffered = 0;
+	w->prepared = 0;
+	w->seq = 0;
+	w->nshown = 0;
+}
+
+static void kgit_commitgraph_open(kgit_commitgraph *g, git_repository *repo)
+{
+	const char *objects = git_repository_path(repo, GIT_REPO_PATH_ODB);
+	size_t len = strlen(objects), i, nchunks;
+	char *path = (char *)malloc(len + sizeof("/info/commit-graph"));
+	memset(g, 0, sizeof(kgit_commitgraph));
+	if (path == NULL) {
+		return;
+	}
+	strcpy(path, objects);
+	strcpy(path + len, (len > 0 && objects[len - 1] == '/') ? "info/commit-graph" : "/info/commit-graph");
+	g->data = kgit_mapfile(path, &g->size);
+	free(path);
+	if (g->data == NULL) {
+		return;
+	}
+	nchunks = g->data[6];
+	/* a single file holding the whole graph, not a chain of them */
+	if (g->size < 8 + (nchunks + 1) * 12 + GIT_OID_RAWSZ || memcmp(g->data, "CGPH", 4) != 0
+			|| g->data[4] != 1 || g->data[5] != 1 || g->data[7] != 0) {
+		goto corrupted;
+	}
+	for (i = 0; i < nchunks; i++) {
+		const unsigned char *c = g->data + 8 + i * 12;
+		uint64_t start = ((uint64_t)kgit_be32(c + 4) << 32) | kgit_be32(c + 8);
+		uint64_t end = ((uint64_t)kgit_be32(c + 16) << 32) | kgit_be32(c + 20);
+		if (start > end || end > g->size - GIT_OID_RAWSZ) {
+			goto corrupted;
+		}
+		switch (kgit_be32(c)) {
+		case KGIT_GRAPH_CHUNK_OIDF:
+			g->fanout = (end - start == 256 * 4) ? g->data + start : NULL;
+			break;
+		case KGIT_GRAPH_CHUNK_OIDL:
+			g->ids = g->data + start;
+			break;
+		case KGIT_GRAPH_CHUNK_CDAT:
+			g->commits = g->data + start;
+			break;
+		case KGIT_GRAPH_CHUNK_EDGE:
+			g->edges = g->data + start;
+			g->nedges = (size_t)(end - start) / 4;
+			break;
+		}
+	}
+	if (g->fanout == NULL || g->ids == NULL || g->commits == NULL) {
+		goto corrupted;
+	}
+	g->n = kgit_be32(g->fanout + 255 * 4);
+	if (g->ids + (size_t)g->n * GIT_OID_RAWSZ > g->data + g->size
+			|| g->commits + (size_t)g->n * KGIT_GRAPH_CDAT_SIZE > g->data + g->size) {
+		goto corrupted;
+	}
+	return;
+
+corrupted:
+	/* walk without it */
+	munmap(g->data, g->size);
+	memset(g, 0, sizeof(kgit_commitgraph));
+}
+
+static void kgit_commitgraph_close(kgit_commitgraph *g)
+{
+	if (g->data != NULL) {
+		munmap(g->data, g->size);
+	}
+	memset(g, 0, sizeof(kgit_commitgraph));
+}
+
+static long kgit_commitgraph_find(const kgit_commitgraph *g, const git_oid *oid)
+{
+	uint32_t lo = (oid->id[0] > 0) ? kgit_be32(g->fanout + (oid->id[0] - 1) * 4) : 0;
+	uint32_t hi = kgit_be32(g->fanout + oid->id[0] * 4);
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(g->ids + (size_t)mid * GIT_OID_RAWSZ, oid->id, GIT_OID_RAWSZ);
+		if (cmp == 0) {
+			return (long)mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+static kgit_commitnode *kgit_revwalk_node(kgit_revwalk *w, const git_oid *oid)
+{
+	kgit_commitnode *node;
+	size_t h;
+	if (w->nnodes >= w->nbuckets) {
+		size_t nbuckets = (w->nbuckets == 0) ? 1024 : w->nbuckets * 2, i;
+		kgit_commitnode **buckets = (kgit_commitnode **)calloc(nbuckets, sizeof(kgit_commitnode *));
+		if (buckets == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < w->nbuckets; i++) {
+			while ((node = w->buckets[i]) != NULL) {
+				w->buckets[i] = node->next;
+				h = kgit_be32(node->oid.id) & (nbuckets - 1);
+				node->next = buckets[h];
+				buckets[h] = node;
+			}
+		}
+		free(w->buckets);
+		w->buckets = buckets;
+		w->nbuckets = nbuckets;
+	}
+	h = kgit_be32(oid->id) & (w->nbuckets - 1);
+	for (node = w->buckets[h]; node != NULL; node = node->next) {
+		if (git_oid_cmp(&node->oid, oid) == 0) {
+			return node;
+		}
+	}
+	if ((node = (kgit_commitnode *)calloc(1, sizeof(kgit_commitnode))) == NULL) {
+		return NULL;
+	}
+	git_oid_cpy(&node->oid, oid);
+	node->next = w->buckets[h];
+	w->buckets[h] = node;
+	w->nnodes++;
+	return node;
+}
+
+static int kgit_revwalk_parent(kgit_revwalk *w, kgit_commitnode *node, uint32_t pos)
+{
+	git_oid id;
+	kgit_commitnode *parent;
+	if (pos >= w->graph.n) {
+		return GIT_EOBJCORRUPTED;
+	}
+	git_oid_fromraw(&id, w->graph.ids + (size_t)pos * GIT_OID_RAWSZ);
+	if ((parent = kgit_revwalk_node(w, &id)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	parent->graphpos = pos + 1;
+	node->parents[node->nparents++] = parent;
+	return GIT_SUCCESS;
+}
+
+/* Read a commit from the commit-graph. */
+static int kgit_revwalk_parse_graph(kgit_revwalk *w, kgit_commitnode *node, uint32_t pos)
+{
+	const unsigned char *c = w->graph.commits + (size_t)pos * KGIT_GRAPH_CDAT_SIZE;
+	uint32_t first = kgit_be32(c + GIT_OID_RAWSZ), second = kgit_be32(c + GIT_OID_RAWSZ + 4);
+	size_t edge = 0, n = (first != KGIT_GRAPH_NONE) + (second != KGIT_GRAPH_NONE);
+	int error = GIT_SUCCESS;
+	if (second != KGIT_GRAPH_NONE && (second & KGIT_GRAPH_EXTRA)) {
+		/* octopus: the other parents are listed in the EDGE chunk */
+		edge = second & ~KGIT_GRAPH_EXTRA;
+		for (n = 1; edge + n - 1 < w->graph.nedges; n++) {
+			if (kgit_be32(w->graph.edges + (edge + n - 1) * 4) & KGIT_GRAPH_EXTRA) {
+				break;
+			}
+		}
+		if (edge + n - 1 >= w->graph.nedges) {
+			return GIT_EOBJCORRUPTED;
+		}
+		n++;
+	}
+	if (n > 0 && (node->parents = (kgit_commitnode **)malloc(n * sizeof(kgit_commitnode *))) == NULL) {
+		return GIT_ENOMEM;
+	}
+	if (first != KGIT_GRAPH_NONE) {
+		error = kgit_revwalk_parent(w, node, first);
+	}
+	if (error == GIT_SUCCESS && second != KGIT_GRAPH_NONE && !(second & KGIT_GRAPH_EXTRA)) {
+		error = kgit_revwalk_parent(w, node, second);
+	}
+	while (error == GIT_SUCCESS && node->nparents < n) {
+		error = kgit_revwalk_parent(w, node, kgit_be32(w->graph.edges + edge++ * 4) & ~KGIT_GRAPH_EXTRA);
+	}
+	if (error < GIT_SUCCESS) {
+		free(node->parents);
+		node->parents = NULL;
+		node->nparents = 0;
+		return error;
+	}
+	git_oid_fromraw(&node->tree, c);
+	/* the low 34 bits of the last 8 bytes, under the generation number */
+	node->time = (git_time_t)(((uint64_t)(kgit_be32(c + GIT_OID_RAWSZ + 8) & 0x3) << 32) | kgit_be32(c + GIT_OID_RAWSZ + 12));
+	node->flags |= KGIT_COMMIT_PARSED;
+	return GIT_SUCCESS;
+}
+
+/* Read the tree, parents and committer time of a commit. */
+static int kgit_revwalk_parse(kgit_revwalk *w, kgit_commitnode *node)
+{
+	git_odb_object *obj;
+	const char *p, *end, *q, *gt = NULL;
+	unsigned int n = 0;
+	int error;
+	if (node->flags & KGIT_COMMIT_PARSED) {
+		return GIT_SUCCESS;
+	}
+	if (w->graph.data != NULL) {
+		long pos = (node->graphpos > 0) ? (long)node->graphpos - 1 : kgit_commitgraph_find(&w->graph, &node->oid);
+		if (pos >= 0) {
+			return kgit_revwalk_parse_graph(w, node, (uint32_t)pos);
+		}
+	}
+	if ((error = git_odb_read(&obj, git_repository_database(w->repo), &node->oid)) < GIT_SUCCESS) {
+		return error;
+	}
+	p = (const char *)git_odb_object_data(obj);
+	end = p + git_odb_object_size(obj);
+	error = GIT_EOBJCORRUPTED;
+	if (git_odb_object_type(obj) != GIT_OBJ_COMMIT || end - p < 46 || memcmp(p, "tree ", 5) != 0
+			|| p[45] != '\n' || git_oid_fromstr(&node->tree, p + 5) < GIT_SUCCESS) {
+		goto cleanup;
+	}
+	for (p += 46, q = p; end - q >= 48 && memcmp(q, "parent ", 7) == 0; q += 48) {
+		n++;
+	}
+	if (n > 0 && (node->parents = (kgit_commitnode **)malloc(n * sizeof(kgit_commitnode *))) == NULL) {
+		error = GIT_ENOMEM;
+		goto cleanup;
+	}
+	for (; node->nparents < n; p += 48) {
+		git_oid id;
+		kgit_commitnode *parent;
+		if (git_oid_fromstr(&id, p + 7) < GIT_SUCCESS) {
+			goto cleanup;
+		}
+		if ((parent = kgit_revwalk_node(w, &id)) == NULL) {
+			error = GIT_ENOMEM;
+			goto cleanup;
+		}
+		node->parents[node->nparents++] = parent;
+	}
+	/* the time follows the email on the committer line */
+	while (end - p > 10 && memcmp(p, "committer ", 10) != 0) {
+		if ((q = (const char *)memchr(p, '\n', end - p)) == NULL) {
+			goto cleanup;
+		}
+		p = q + 1;
+	}
+	for (; p < end && *p != '\n'; p++) {
+		if (*p == '>') {
+			gt = p;
+		}
+	}
+	if (gt == NULL) {
+		goto cleanup;
+	}
+	node->time = (git_time_t)strtoll(gt + 1, NULL, 10);
+	node->flags |= KGIT_COMMIT_PARSED;
+	error = GIT_SUCCESS;
+
+cleanup:
+	if (error < GIT_SUCCESS) {
+		free(node->parents);
+		node->parents = NULL;
+		node->nparents = 0;
+	}
+	git_odb_object_close(obj);
+	return error;
+}
+
+static int kgit_revwalk_before(const kgit_commitnode *a, const kgit_commitnode *b)
+{
+	return a->time > b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static int kgit_revwalk_enqueue(kgit_revwalk *w, kgit_commitnode *node)
+{
+	size_t i;
+	int error;
+	if (node->flags & KGIT_COMMIT_ADDED) {
+		return GIT_SUCCESS;
+	}
+	if ((error = kgit_revwalk_parse(w, node)) < GIT_SUCCESS
+			|| (error = kgit_revwalk_grow((void **)&w->queue, &w->queuecap, w->nqueue, sizeof(kgit_commitnode *))) < GIT_SUCCESS) {
+		return error;
+	}
+	node->flags |= KGIT_COMMIT_ADDED | KGIT_COMMIT_QUEUED;
+	node->seq = w->seq++;
+	for (i = w->nqueue++; i > 0 && kgit_revwalk_before(node, w->queue[(i - 1) / 2]); i = (i - 1) / 2) {
+		w->queue[i] = w->queue[(i - 1) / 2];
+	}
+	w->queue[i] = node;
+	return GIT_SUCCESS;
+}
+
+static kgit_commitnode *kgit_revwalk_pop(kgit_revwalk *w)
+{
+	kgit_commitnode *top, *last;
+	size_t i = 0, child;
+	if (w->nqueue == 0) {
+		return NULL;
+	}
+	top = w->queue[0];
+	top->flags &= ~KGIT_COMMIT_QUEUED;
+	last = w->queue[--w->nqueue];
+	while ((child = 2 * i + 1) < w->nqueue) {
+		if (child + 1 < w->nqueue && kgit_revwalk_before(w->queue[child + 1], w->queue[child])) {
+			child++;
+		}
+		if (!kgit_revwalk_before(w->queue[child], last)) {
+			break;
+		}
+		w->queue[i] = w->queue[child];
+		i = child;
+	}
+	if (w->nqueue > 0) {
+		w->queue[i] = last;
+	}
+	return top;
+}
+
+/* Hide a commit and the ancestors of it read so far; the others are hidden
+ * as the walk reaches them. */
+static int kgit_revwalk_hide(kgit_commitnode *node)
+{
+	kgit_commitnode **stack = NULL;
+	size_t n = 0, capacity = 0;
+	unsigned int i;
+	node->flags |= KGIT_COMMIT_HIDDEN;
+	for (;;) {
+		for (i = 0; i < node->nparents; i++) {
+			kgit_commitnode *parent = node->parents[i];
+			if (parent->flags & KGIT_COMMIT_HIDDEN) {
+				continue;
+			}
+			parent->flags |= KGIT_COMMIT_HIDDEN;
+			if (parent->nparents == 0) {
+				continue;
+			}
+			if (kgit_revwalk_grow((void **)&stack, &capacity, n, sizeof(kgit_commitnode *)) < GIT_SUCCESS) {
+				free(stack);
+				return GIT_ENOMEM;
+			}
+			stack[n++] = parent;
+		}
+		if (n == 0) {
+			break;
+		}
+		node = stack[--n];
+	}
+	free(stack);
+	return GIT_SUCCESS;
+}
+
+/* Whether some queued commit is still to be shown */
+static int kgit_revwalk_interesting(const kgit_revwalk *w)
+{
+	size_t i;
+	for (i = 0; i < w->nqueue; i++) {
+		if (!(w->queue[i]->flags & KGIT_COMMIT_HIDDEN)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int kgit_revwalk_pathstate(kgit_revwalk *w, kgit_commitnode *node)
+{
+	size_t i;
+	if (node->paths != NULL) {
+		return GIT_SUCCESS;
+	}
+	if ((node->paths = (kgit_pathstate *)calloc(w->npaths, sizeof(kgit_pathstate))) == NULL) {
+		return GIT_ENOMEM;
+	}
+	for (i = 0; i < w->npaths; i++) {
+		int error = kgit_tree_resolve(w->repo, &node->tree, NULL, w->paths[i], &node->paths[i].oid, &node->paths[i].attr);
+		if (error == GIT_ENOTFOUND) {
+			node->paths[i].attr = 0;
+		} else if (error < GIT_SUCCESS) {
+			free(node->paths);
+			node->paths = NULL;
+			return error;
+		}
+	}
+	return GIT_SUCCESS;
+}
+
+/* Whether a commit leaves the limited paths as its parent, or the empty
+ * tree when 'parent' is NULL, had them. Only the ids of the entries the
+ * paths name are compared, never the trees below them. */
+static int kgit_revwalk_treesame(kgit_revwalk *w, kgit_commitnode *node, kgit_commitnode *parent, int *same)
+{
+	size_t i;
+	int error;
+	if ((error = kgit_revwalk_pathstate(w, node)) < GIT_SUCCESS
+			|| (parent != NULL && (error = kgit_revwalk_pathstate(w, parent)) < GIT_SUCCESS)) {
+		return error;
+	}
+	*same = 1;
+	for (i = 0; i < w->npaths && *same; i++) {
+		const kgit_pathstate *a = &node->paths[i];
+		if (parent == NULL) {
+			*same = (a->attr == 0);
+		} else {
+			const kgit_pathstate *b = &parent->paths[i];
+			*same = (a->attr == b->attr && (a->attr == 0 || git_oid_cmp(&a->oid, &b->oid) == 0));
+		}
+	}
+	return GIT_SUCCESS;
+}
+
+/* Pick the next commit of the native walk in time order. With paths
+ * limited, history is simplified as git log -- <path> does: a commit that
+ * leaves the paths as one of its parents had them is not shown, and the
+ * walk only goes on through that parent. With FIRST_PARENT, the other
+ * parents of a shown commit are never queued nor read; hidden commits
+ * still hide all their parents. With 'all' set, the commits that are
+ * walked through without being shown are returned too. */
+static int kgit_revwalk_step(kgit_revwalk *w, kgit_commitnode **out, int all)
+{
+	while (w->nqueue > 0 && kgit_revwalk_interesting(w)) {
+		kgit_commitnode *node = kgit_revwalk_pop(w);
+		unsigned int i, first = 0, last = node->nparents, relevant = 0, nparents = node->nparents;
+		int error, show = 1, same, irrelevant_change = 0;
+		if (w->since >= 0 && node->time < w->since) {
+			/* the queue is ordered by time: nothing left is recent enough */
+			w->nqueue = 0;
+			break;
+		}
+		if (node->flags & KGIT_COMMIT_HIDDEN) {
+			if ((error = kgit_revwalk_hide(node)) < GIT_SUCCESS) {
+				return error;
+			}
+			show = 0;
+		} else {
+			if ((w->sorting & KGIT_SORT_FIRST_PARENT) && nparents > 1) {
+				last = nparents = 1;
+			}
+			if (w->npaths > 0) {
+				if (node->nparents == 0) {
+					if ((error = kgit_revwalk_treesame(w, node, NULL, &same)) < GIT_SUCCESS) {
+						return error;
+					}
+					show = !same;
+				}
+				for (i = 0; i < nparents; i++) {
+					kgit_commitnode *parent = node->parents[i];
+					if ((error = kgit_revwalk_parse(w, parent)) < GIT_SUCCESS
+							|| (error = kgit_revwalk_treesame(w, node, parent, &same)) < GIT_SUCCESS) {
+						return error;
+					}
+					if (!kgit_commit_relevant(parent)) {
+						irrelevant_change |= !same;
+					} else if (same) {
+						first = i;
+						last = i + 1;
+						break;
+					} else {
+						relevant++;
+					}
+				}
+				if (i < nparents) {
+					show = 0;
+				} else if (nparents > 0) {
+					/* irrelevant parents only count when there are no others */
+					show = (relevant > 0) ? 1 : irrelevant_change;
+				}
+			}
+		}
+		for (i = first; i < last; i++) {
+			if ((error = kgit_revwalk_enqueue(w, node->parents[i])) < GIT_SUCCESS) {
+				return error;
+			}
+		}
+		if ((w->until >= 0 && node->time > w->until)
+				|| ((w->sorting & KGIT_SORT_MERGES) && node->nparents < 2)
+				|| ((w->sorting & KGIT_SORT_NO_MERGES) && node->nparents > 1)) {
+			show = 0;
+		}
+		if (!(node->flags & KGIT_COMMIT_HIDDEN)) {
+			node->flags |= KGIT_COMMIT_VISITED | (show ? KGIT_COMMIT_SHOWN : 0);
+			if (show || all) {
+				*out = node;
+				return GIT_SUCCESS;
+			}
+		}
+	}
+	return GIT_EREVWALKOVER;
+}
+
+/* Sort the output so that no commit comes after one of its parents,
+ * following the newest branch first as git log --topo-order does. The
+ * output holds every commit walked through, so that the order also holds
+ * between shown commits linked by unshown ones. */
+static int kgit_revwalk_topo(kgit_revwalk *w)
+{
+	kgit_commitnode **stack;
+	size_t i, n = 0, sorted = 0;
+	unsigned int j;
+	for (i = 0; i < w->noutput; i++) {
+		for (j = 0; j < w->output[i]->nparents; j++) {
+			kgit_commitnode *parent = w->output[i]->parents[j];
+			if (parent->flags & KGIT_COMMIT_VISITED) {
+				parent->indegree++;
+			}
+		}
+	}
+	if ((stack = (kgit_commitnode **)malloc((w->noutput + 1) * sizeof(kgit_commitnode *))) == NULL) {
+		return GIT_ENOMEM;
+	}
+	for (i = w->noutput; i > 0; i--) {
+		if (w->output[i - 1]->indegree == 0) {
+			stack[n++] = w->output[i - 1];
+		}
+	}
+	while (n > 0) {
+		kgit_commitnode *node = stack[--n];
+		w->output[sorted++] = node;
+		for (j = 0; j < node->nparents; j++) {
+			kgit_commitnode *parent = node->parents[j];
+			if ((parent->flags & KGIT_COMMIT_VISITED) && --parent->indegree == 0) {
+				stack[n++] = parent;
+			}
+		}
+	}
+	free(stack);
+	return GIT_SUCCESS;
+}
+
+/* Queue a pushed or hidden commit on the native walk. */
+static int kgit_revwalk_start(kgit_revwalk *w, const kgit_revtip *tip)
+{
+	kgit_commitnode *node = kgit_revwalk_node(w, &tip->oid);
+	int error;
+	if (node == NULL) {
+		return GIT_ENOMEM;
+	}
+	if (tip->hide) {
+		node->flags |= KGIT_COMMIT_BOTTOM;
+	}
+	if ((error = kgit_revwalk_parse(w, node)) < GIT_SUCCESS
+			|| (tip->hide && (error = kgit_revwalk_hide(node)) < GIT_SUCCESS)) {
+		return error;
+	}
+	return kgit_revwalk_enqueue(w, node);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Cursors: the state of a time-ordered native walk, for another walker to
+ * take it up later on. After a version byte, a cursor holds 21 bytes per
+ * commit: its raw id and KGIT_CURSOR_* flags. The queued commits come
+ * first, in the order they are to be popped. Then come the commits already
+ * walked that the queue may still reach, so that none of them is shown
+ * twice: those not newer than the head of the queue, which are all of them
+ * as long as no commit is older than one of its parents. The bytes are
+ * written in URL-safe base64. */
+
+#define KGIT_CURSOR_VERSION  1
+#define KGIT_CURSOR_ENTRY    (GIT_OID_RAWSZ + 1)
+#define KGIT_CURSOR_QUEUED   (1 << 0)
+#define KGIT_CURSOR_HIDDEN   (1 << 1)
+#define KGIT_CURSOR_BOTTOM   (1 << 2)
+
+static const char kgit_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static char *kgit_base64_encode(const unsigned char *in, size_t len)
+{
+	char *out = (char *)malloc(len / 3 * 4 + 4), *p = out;
+	size_t i;
+	uint32_t v;
+	if (out == NULL) {
+		return NULL;
+	}
+	for (i = 0; i + 2 < len; i += 3) {
+		v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+		*p++ = kgit_base64[v >> 18];
+		*p++ = kgit_base64[(v >> 12) & 0x3f];
+		*p++ = kgit_base64[(v >> 6) & 0x3f];
+		*p++ = kgit_base64[v & 0x3f];
+	}
+	if (i < len) {
+		/* no padding */
+		v = ((uint32_t)in[i] << 16) | ((i + 1 < len) ? (uint32_t)in[i + 1] << 8 : 0);
+		*p++ = kgit_base64[v >> 18];
+		*p++ = kgit_base64[(v >> 12) & 0x3f];
+		if (i + 1 < len) {
+			*p++ = kgit_base64[(v >> 6) & 0x3f];
+		}
+	}
+	*p = '\0';
+	return out;
+}
+
+static int kgit_base64_decode(unsigned char **out, size_t *len, const char *in)
+{
+	size_t n = strlen(in), i, o = 0;
+	uint32_t v = 0;
+	if (n % 4 == 1) {
+		return GIT_EINVALIDARGS;
+	}
+	if ((*out = (unsigned char *)malloc(n / 4 * 3 + 2)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		const char *c = strchr(kgit_base64, in[i]);
+		if (c == NULL) {
+			free(*out);
+			*out = NULL;
+			return GIT_EINVALIDARGS;
+		}
+		v = (v << 6) | (uint32_t)(c - kgit_base64);
+		if (i % 4 == 3) {
+			(*out)[o++] = (unsigned char)(v >> 16);
+			(*out)[o++] = (unsigned char)(v >> 8);
+			(*out)[o++] = (unsigned char)v;
+			v = 0;
+		}
+	}
+	if (n % 4 == 2) {
+		(*out)[o++] = (unsigned char)(v >> 4);
+	} else if (n % 4 == 3) {
+		(*out)[o++] = (unsigned char)(v >> 10);
+		(*out)[o++] = (unsigned char)(v >> 2);
+	}
+	*len = o;
+	return GIT_SUCCESS;
+}
+
+static int kgit_revwalk_cmp(const void *a, const void *b)
+{
+	const kgit_commitnode *x = *(kgit_commitnode * const *)a, *y = *(kgit_commitnode * const *)b;
+	return kgit_revwalk_before(x, y) ? -1 : kgit_revwalk_before(y, x);
+}
+
+/* Whether a commit already walked goes into the cursor */
+static int kgit_revwalk_seen(const kgit_revwalk *w, const kgit_commitnode *node)
+{
+	return (node->flags & (KGIT_COMMIT_ADDED | KGIT_COMMIT_QUEUED)) == KGIT_COMMIT_ADDED
+		&& node->time <= w->queue[0]->time;
+}
+
+/* Write the cursor of a prepared, unbuffered walk, or set it to NULL when
+ * nothing is left to show. */
+static int kgit_revwalk_cursor(kgit_revwalk *w, char **cursor)
+{
+	kgit_commitnode **nodes, *node;
+	unsigned char *data, *p;
+	size_t i, n = w->nqueue;
+	*cursor = NULL;
+	if (!kgit_revwalk_interesting(w)) {
+		return GIT_SUCCESS;
+	}
+	for (i = 0; i < w->nbuckets; i++) {
+		for (node = w->buckets[i]; node != NULL; node = node->next) {
+			n += kgit_revwalk_seen(w, node);
+		}
+	}
+	if ((nodes = (kgit_commitnode **)malloc(n * sizeof(kgit_commitnode *))) == NULL) {
+		return GIT_ENOMEM;
+	}
+	memcpy(nodes, w->queue, w->nqueue * sizeof(kgit_commitnode *));
+	qsort(nodes, w->nqueue, sizeof(kgit_commitnode *), kgit_revwalk_cmp);
+	for (i = 0, n = w->nqueue; i < w->nbuckets; i++) {
+		for (node = w->buckets[i]; node != NULL; node = node->next) {
+			if (kgit_revwalk_seen(w, node)) {
+				nodes[n++] = node;
+			}
+		}
+	}
+	if ((data = (unsigned char *)malloc(1 + n * KGIT_CURSOR_ENTRY)) == NULL) {
+		free(nodes);
+		return GIT_ENOMEM;
+	}
+	data[0] = KGIT_CURSOR_VERSION;
+	for (i = 0, p = data + 1; i < n; i++, p += KGIT_CURSOR_ENTRY) {
+		memcpy(p, nodes[i]->oid.id, GIT_OID_RAWSZ);
+		p[GIT_OID_RAWSZ] = ((i < w->nqueue) ? KGIT_CURSOR_QUEUED : 0)
+			| ((nodes[i]->flags & KGIT_COMMIT_HIDDEN) ? KGIT_CURSOR_HIDDEN : 0)
+			| ((nodes[i]->flags & KGIT_COMMIT_BOTTOM) ? KGIT_CURSOR_BOTTOM : 0);
+	}
+	*cursor = kgit_base64_encode(data, 1 + n * KGIT_CURSOR_ENTRY);
+	free(data);
+	free(nodes);
+	return (*cursor != NULL) ? GIT_SUCCESS : GIT_ENOMEM;
+}
+
+/* Check a cursor given to resume() and keep its bytes for the walk. */
+static int kgit_revwalk_setcursor(kgit_revwalk *w, const char *cursor)
+{
+	unsigned char *data;
+	size_t size, i;
+	int error = kgit_base64_decode(&data, &size, cursor);
+	if (error < GIT_SUCCESS) {
+		return error;
+	}
+	if (size == 0 || data[0] != KGIT_CURSOR_VERSION || (size - 1) % KGIT_CURSOR_ENTRY != 0) {
+		free(data);
+		return GIT_EINVALIDARGS;
+	}
+	for (i = 1 + GIT_OID_RAWSZ; i < size; i += KGIT_CURSOR_ENTRY) {
+		if (data[i] & ~(KGIT_CURSOR_QUEUED | KGIT_CURSOR_HIDDEN | KGIT_CURSOR_BOTTOM)) {
+			free(data);
+			return GIT_EINVALIDARGS;
+		}
+	}
+	free(w->cursor);
+	w->cursor = data;
+	w->cursorsize = size;
+	return GIT_SUCCESS;
+}
+
+/* Put the commits of the cursor back as they were; the ones already walked
+ * are read again, for hidden commits to hide their parents through them. */
+static int kgit_revwalk_restore(kgit_revwalk *w)
+{
+	const unsigned char *p;
+	for (p = w->cursor + 1; p < w->cursor + w->cursorsize; p += KGIT_CURSOR_ENTRY) {
+		unsigned char flags = p[GIT_OID_RAWSZ];
+		kgit_commitnode *node;
+		git_oid oid;
+		int error;
+		git_oid_fromraw(&oid, p);
+		if ((node = kgit_revwalk_node(w, &oid)) == NULL) {
+			return GIT_ENOMEM;
+		}
+		node->flags |= ((flags & KGIT_CURSOR_HIDDEN) ? KGIT_COMMIT_HIDDEN : 0)
+			| ((flags & KGIT_CURSOR_BOTTOM) ? KGIT_COMMIT_BOTTOM : 0);
+		if (flags & KGIT_CURSOR_QUEUED) {
+			error = kgit_revwalk_enqueue(w, node);
+		} else if ((error = kgit_revwalk_parse(w, node)) == GIT_SUCCESS) {
+			node->flags |= KGIT_COMMIT_ADDED;
+		}
+		if (error < GIT_SUCCESS) {
+			return error;
+		}
+	}
+	return GIT_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int kgit_revwalk_prepare(kgit_revwalk *w)
+{
+	size_t i;
+	int error;
+	if (!w->graph_loaded) {
+		kgit_commitgraph_open(&w->graph, w->repo);
+		w->graph_loaded = 1;
+	}
+	if (w->cursor != NULL) {
+		/* the cursor holds all that is left of the tips; starting them
+		 * again would walk the pages before it once more */
+		if ((error = kgit_revwalk_restore(w)) < GIT_SUCCESS) {
+			return error;
+		}
+	} else {
+		for (i = 0; i < w->ntips; i++) {
+			if ((error = kgit_revwalk_start(w, &w->tips[i])) < GIT_SUCCESS) {
+				return error;
+			}
+		}
+	}
+	w->prepared = 1;
+	if (w->sorting & (GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE)) {
+		kgit_commitnode *node;
+		size_t n = 0;
+		while ((error = kgit_revwalk_step(w, &node, 1)) == GIT_SUCCESS) {
+			if ((error = kgit_revwalk_grow((void **)&w->output, &w->outputcap, w->noutput, sizeof(kgit_commitnode *))) < GIT_SUCCESS) {
+				return error;
+			}
+			w->output[w->noutput++] = node;
+		}
+		if (error != GIT_EREVWALKOVER) {
+			return error;
+		}
+		if ((w->sorting & GIT_SORT_TOPOLOGICAL) && (error = kgit_revwalk_topo(w)) < GIT_SUCCESS) {
+			return error;
+		}
+		for (i = 0; i < w->noutput; i++) {
+			if (w->output[i]->flags & KGIT_COMMIT_SHOWN) {
+				w->output[n++] = w->output[i];
+			}
+		}
+		w->noutput = n;
+		if (w->maxcount >= 0 && w->noutput > (size_t)w->maxcount) {
+			/* the first ones in walk order, as with git log -n --reverse */
+			w->noutput = (size_t)w->maxcount;
+		}
+		if (w->sorting & GIT_SORT_REVERSE) {
+			for (i = 0; i < w->noutput / 2; i++) {
+				node = w->output[i];
+				w->output[i] = w->output[w->noutput - 1 - i];
+				w->output[w->noutput - 1 - i] = node;
+			}
+		}
+		w->buffered = 1;
+	}
+	return GIT_SUCCESS;
+}
+
+static int kgit_revwalk_next(kgit_revwalk *w, git_oid *oid)
+{
+	kgit_commitnode *node;
+	int error;
+	if (w->maxcount >= 0 && w->nshown >= (size_t)w->maxcount) {
+		return GIT_EREVWALKOVER;
+	}
+	if (!kgit_revwalk_isnative(w)) {
+		if ((error = git_revwalk_next(oid, w->walk)) == GIT_SUCCESS) {
+			w->started = 1;
+			w->nshown++;
+		}
+		return error;
+	}
+	if (!w->prepared && (error = kgit_revwalk_prepare(w)) < GIT_SUCCESS) {
+		return error;
+	}
+	if (w->buffered) {
+		if (w->outputpos == w->noutput) {
+			return GIT_EREVWALKOVER;
+		}
+		node = w->output[w->outputpos++];
+	} else if ((error = kgit_revwalk_step(w, &node, 0)) < GIT_SUCCESS) {
+		return error;
+	}
+	git_oid_cpy(oid, &node->oid);
+	w->nshown++;
+	return GIT_SUCCESS;
+}
+
+static int kgit_revwalk_tip(kgit_revwalk *w, const git_oid *oid, int hide)
+{
+	int error = kgit_revwalk_grow((void **)&w->tips, &w->tipscap, w->ntips, sizeof(kgit_revtip));
+	if (error < GIT_SUCCESS) {
+		return error;
+	}
+	git_oid_cpy(&w->tips[w->ntips].oid, oid);
+	w->tips[w->ntips].hide = hide;
+	w->ntips++;
+	/* a walk under way takes it at once, unless it was resumed */
+	return (w->prepared && !w->buffered && w->cursor == NULL) ? kgit_revwalk_start(w, &w->tips[w->ntips - 1]) : GIT_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Commit counts: tip -> number of commits reachable from it, kept per
+ * repository for count() on walks from a single commit. Commits never
+ * change, so a count never goes stale; the table is direct-mapped, and a
+ * newer count simply takes the slot of an older one. */
+
+#define KGIT_COUNTCACHE_SIZE  1024
+
+typedef struct kgit_countslot {
+	git_oid oid;
+	size_t count;
+	int used;
+} kgit_countslot;
+
+typedef struct kgit_countcache {
+	struct kgit_countcache *next;
+	git_repository *repo;
+	kgit_countslot slots[KGIT_COUNTCACHE_SIZE];
+} kgit_countcache;
+
+static kgit_countcache *countcaches = NULL;
+static pthread_mutex_t countcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static kgit_countslot *kgit_countcache_slot(git_repository *repo, const git_oid *oid, int create)
+{
+	kgit_countcache *cache;
+	for (cache = countcaches; cache != NULL; cache = cache->next) {
+		if (cache->repo == repo) {
+			break;
+		}
+	}
+	if (cache == NULL && create && (cache = (kgit_countcache *)calloc(1, sizeof(kgit_countcache))) != NULL) {
+		cache->repo = repo;
+		cache->next = countcaches;
+		countcaches = cache;
+	}
+	return (cache != NULL) ? &cache->slots[kgit_be32(oid->id) % KGIT_COUNTCACHE_SIZE] : NULL;
+}
+
+static int kgit_countcache_lookup(git_repository *repo, const git_oid *oid, size_t *count)
+{
+	kgit_countslot *slot;
+	int found = 0;
+	pthread_mutex_lock(&countcache_lock);
+	slot = kgit_countcache_slot(repo, oid, 0);
+	if (slot != NULL && slot->used && git_oid_cmp(&slot->oid, oid) == 0) {
+		*count = slot->count;
+		found = 1;
+	}
+	pthread_mutex_unlock(&countcache_lock);
+	return found;
+}
+
+static void kgit_countcache_store(git_repository *repo, const git_oid *oid, size_t count)
+{
+	kgit_countslot *slot;
+	pthread_mutex_lock(&countcache_lock);
+	slot = kgit_countcache_slot(repo, oid, 1);
+	if (slot != NULL) {
+		git_oid_cpy(&slot->oid, oid);
+		slot->count = count;
+		slot->used = 1;
+	}
+	pthread_mutex_unlock(&countcache_lock);
+}
+
+/* Forget the commit counts of a repository that is being freed. */
+void kgit_countcache_drop(git_repository *repo)
+{
+	kgit_countcache **p;
+	pthread_mutex_lock(&countcache_lock);
+	for (p = &countcaches; *p != NULL; p = &(*p)->next) {
+		if ((*p)->repo == repo) {
+			kgit_countcache *cache = *p;
+			*p = cache->next;
+			free(cache);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&countcache_lock);
+}
+
+/* Count what is left of the walk, which is over afterwards. */
+static int kgit_revwalk_count(kgit_revwalk *w, size_t *count)
+{
+	int plain = (w->ntips == 1 && !w->tips[0].hide && !kgit_revwalk_isnative(w) && w->maxcount < 0 && !w->started);
+	git_oid oid;
+	int error;
+	*count = 0;
+	if (!w->started) {
+		/* the native walk reads no more of the commits than it needs */
+		w->native = 1;
+	}
+	if (plain && kgit_countcache_lookup(w->repo, &w->tips[0].oid, count)) {
+		kgit_revwalk_clear(w);
+		w->prepared = 1;
+		return GIT_SUCCESS;
+	}
+	while ((error = kgit_revwalk_next(w, &oid)) == GIT_SUCCESS) {
+		(*count)++;
+	}
+	if (error != GIT_EREVWALKOVER) {
+		return error;
+	}
+	if (plain) {
+		kgit_countcache_store(w->repo, &w->tips[0].oid, *count);
+	}
+	return GIT_SUCCESS;
+}
+
+static void kgit_revwalk_setpaths(kgit_revwalk *w, char **paths, size_t npaths)
+{
+	size_t i;
+	for (i = 0; i < w->npaths; i++) {
+		free(w->paths[i]);
+	}
+	free(w->paths);
+	w->paths = paths;
+	w->npaths = npaths;
+}
+
 /* ------------------------------------------------------------------------ */
 
 static void kGitRevwalk_init(CTX ctx, kRawPtr *po)
@@ -46,7 +1169,14 @@ static void kGitRevwalk_init(CTX ctx, kRawPtr *po)
 static void kGitRevwalk_free(CTX ctx, kRawPtr *po)
 {
 	if (po->rawptr != NULL) {
-		git_revwalk_free((git_revwalk *)po->rawptr);
+		kgit_revwalk *w = (kgit_revwalk *)po->rawptr;
+		kgit_revwalk_clear(w);
+		kgit_revwalk_setpaths(w, NULL, 0);
+		kgit_commitgraph_close(&w->graph);
+		free(w->cursor);
+		free(w->tips);
+		git_revwalk_free(w->walk);
+		KNH_FREE(ctx, w, sizeof(kgit_revwalk));
 		po->rawptr = NULL;
 	}
 }
@@ -68,6 +1198,9 @@ static knh_IntData_t GitSortConstInt[] = {
 	{"TOPOLOGICAL", GIT_SORT_TOPOLOGICAL},
 	{"TIME", GIT_SORT_TIME},
 	{"REVERSE", GIT_SORT_REVERSE},
+	{"FIRST_PARENT", KGIT_SORT_FIRST_PARENT},
+	{"MERGES", KGIT_SORT_MERGES},
+	{"NO_MERGES", KGIT_SORT_NO_MERGES},
 	{NULL}
 };
 
@@ -78,6 +1211,85 @@ DEFAPI(void) constGitSort(CTX ctx, kclass_t cid, const knh_LoaderAPI_t *kapi)
 
 /* ------------------------------------------------------------------------ */
 
+/* Count the commits the walk yields, as git rev-list --count does, without
+ * creating any object for them; the walk is over afterwards. The count of
+ * the whole history of a commit is kept, so asking again is answered at
+ * once. Returns -1 on error. */
+//## @Native int GitRevwalk.count();
+KMETHOD GitRevwalk_count(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	size_t count;
+	int error = kgit_revwalk_count(w, &count);
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_revwalk_count", error);
+		RETURNi_(-1);
+	}
+	RETURNi_(count);
+}
+
+/* Hide the given commits and count the commits the walk yields, as
+ * git rev-list --count <pushed> ^<hidden> does. Returns -1 on error. */
+//## @Native int GitRevwalk.countUntil(Array<GitOid> hidden);
+KMETHOD GitRevwalk_countUntil(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	kArray *a = sfp[1].a;
+	size_t i, count, n = knh_Array_size(a);
+	int error = GIT_SUCCESS;
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		const git_oid *oid = (const git_oid *)a->ptrs[i]->rawptr;
+		if ((error = git_revwalk_hide(w->walk, oid)) == GIT_SUCCESS) {
+			error = kgit_revwalk_tip(w, oid, 1);
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_revwalk_count(w, &count);
+	}
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_revwalk_count", error);
+		RETURNi_(-1);
+	}
+	RETURNi_(count);
+}
+
+/* Save where the walk stands in a short string, for a later walk to go on
+ * from there with resume(); a paginated log takes one per page instead of
+ * walking the pages before it again. Take it before the first next(), or
+ * from a walk that is native anyway, as the ones bounded by paths or times
+ * or resumed ones are; not from a topological or reverse walk. Returns
+ * null at the end of the walk, or on error. */
+//## @Native String GitRevwalk.cursor();
+KMETHOD GitRevwalk_cursor(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	char *cursor = NULL;
+	kString *s;
+	int error = GIT_SUCCESS;
+	if (!kgit_revwalk_isnative(w)) {
+		if (w->started) {
+			/* libgit2's walk keeps its queue to itself */
+			error = GIT_EINVALIDARGS;
+		}
+		w->native = !w->started;
+	}
+	if (error == GIT_SUCCESS && !w->prepared) {
+		error = kgit_revwalk_prepare(w);
+	}
+	if (error == GIT_SUCCESS) {
+		error = w->buffered ? GIT_EINVALIDARGS : kgit_revwalk_cursor(w, &cursor);
+	}
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_revwalk_cursor", error);
+	}
+	if (cursor == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	s = new_String(ctx, cursor);
+	free(cursor);
+	RETURN_(s);
+}
+
 /* Free a revision walker previously allocated. */
 //## @Native void GitRevwalk.free();
 KMETHOD GitRevwalk_free(CTX ctx, ksfp_t *sfp _RIX)
@@ -90,50 +1302,176 @@ KMETHOD GitRevwalk_free(CTX ctx, ksfp_t *sfp _RIX)
 //## @Native void GitRevwalk.hide(GitOid oid);
 KMETHOD GitRevwalk_hide(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_revwalk *walk = RawPtr_to(git_revwalk *, sfp[0]);
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
 	const git_oid *oid = RawPtr_to(const git_oid *, sfp[1]);
-	int error = git_revwalk_hide(walk, oid);
+	int error = git_revwalk_hide(w->walk, oid);
+	if (error == GIT_SUCCESS) {
+		error = kgit_revwalk_tip(w, oid, 1);
+	}
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_revwalk_hide", error);
 	}
 	RETURNvoid_();
 }
 
+/* Only walk the history of the given paths, files or directories, as
+ * git log -- <paths> does: the walk yields the commits that changed one of
+ * them, and skips the side branches of merges that did not bring a change.
+ * An empty array removes the limit; either way the walk starts over from
+ * the pushed commits. */
+//## @Native void GitRevwalk.limitPaths(Array<String> paths);
+KMETHOD GitRevwalk_limitPaths(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	kArray *a = sfp[1].a;
+	size_t i, n = 0, npaths = knh_Array_size(a);
+	char **paths = NULL;
+	if (npaths > 0 && (paths = (char **)calloc(npaths, sizeof(char *))) == NULL) {
+		TRACE_ERROR(ctx, "git_revwalk_limit_paths", GIT_ENOMEM);
+		RETURNvoid_();
+	}
+	for (i = 0; i < npaths; i++) {
+		const char *path = S_totext(a->strings[i]);
+		size_t len;
+		while (*path == '/') {
+			path++;
+		}
+		for (len = strlen(path); len > 0 && path[len - 1] == '/'; len--) {
+		}
+		if ((paths[n] = strndup(path, len)) == NULL) {
+			break;
+		}
+		n++;
+	}
+	if (n < npaths) {
+		while (n > 0) {
+			free(paths[--n]);
+		}
+		free(paths);
+		TRACE_ERROR(ctx, "git_revwalk_limit_paths", GIT_ENOMEM);
+		RETURNvoid_();
+	}
+	kgit_revwalk_clear(w);
+	kgit_revwalk_setpaths(w, paths, n);
+	RETURNvoid_();
+}
+
+/* Stop the walk after n commits, as git log -n does; a negative n removes
+ * the limit. */
+//## @Native void GitRevwalk.maxCount(int n);
+KMETHOD GitRevwalk_maxCount(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	kint_t n = Int_to(kint_t, sfp[1]);
+	w->maxcount = (n >= 0) ? n : -1;
+	RETURNvoid_();
+}
+
 /* Allocate a new revision walker to iterate through a repo. */
 //## @Native GitRevwalk GitRevwalk.new(GitRepository repo);
 KMETHOD GitRevwalk_new(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_revwalk *walker;
 	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	kgit_revwalk *w;
 	int error = git_revwalk_new(&walker, repo);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_revwalk_new", error);
 		RETURN_(KNH_NULL);
 	}
-	RETURN_(new_ReturnRawPtr(ctx, sfp, walker));
+	w = (kgit_revwalk *)KNH_MALLOC(ctx, sizeof(kgit_revwalk));
+	memset(w, 0, sizeof(kgit_revwalk));
+	w->walk = walker;
+	w->repo = repo;
+	w->since = w->until = -1;
+	w->maxcount = -1;
+	RETURN_(new_ReturnRawPtr(ctx, sfp, w));
 }
 
-/* Get the next commit from the revision walk. */
+/* Get the next commit from the revision walk, or null at the end of it. */
 //## @Native GitOid GitRevwalk.next();
 KMETHOD GitRevwalk_next(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_oid *oid;
-	git_revwalk *walk = RawPtr_to(git_revwalk *, sfp[0]);
-	int error = git_revwalk_next(oid, walk);
+	git_oid oid;
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	int error = kgit_revwalk_next(w, &oid);
 	if (error < GIT_SUCCESS) {
-		TRACE_ERROR(ctx, "git_revwalk_next", error);
+		if (error != GIT_EREVWALKOVER) {
+			TRACE_ERROR(ctx, "git_revwalk_next", error);
+		}
 		RETURN_(KNH_NULL);
 	}
-	RETURN_(new_ReturnRawPtr(ctx, sfp, oid));
+	RETURN_(new_GitOidCopy(ctx, sfp, &oid));
+}
+
+/* Get up to n next commits from the revision walk at once, in a list
+ * holding all their ids in one block; the list is short, or empty, at the
+ * end of the walk. raw() and fmt() read the whole list back at once. */
+//## @Native GitOidList GitRevwalk.nextMany(int n);
+KMETHOD GitRevwalk_nextMany(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	kint_t n = Int_to(kint_t, sfp[1]);
+	size_t capacity = (n > 0) ? (size_t)n : 0;
+	kgit_oidlist *list;
+	int error = GIT_SUCCESS;
+	if (capacity > KGIT_REVWALK_BATCH) {
+		/* grown as the walk goes, not sized for a walk that may be short */
+		capacity = KGIT_REVWALK_BATCH;
+	}
+	list = kgit_oidlist_new(ctx, capacity);
+	while (n > 0 && (size_t)n > list->size) {
+		if (list->size == list->capacity) {
+			kgit_oidlist *grown;
+			capacity = list->capacity * 2;
+			if (capacity > (size_t)n) {
+				capacity = (size_t)n;
+			}
+			grown = kgit_oidlist_new(ctx, capacity);
+			memcpy(grown->ids, list->ids, list->size * sizeof(git_oid));
+			grown->size = list->size;
+			KNH_FREE(ctx, list, kgit_oidlist_sizeof(list->capacity));
+			list = grown;
+		}
+		if ((error = kgit_revwalk_next(w, &list->ids[list->size])) < GIT_SUCCESS) {
+			break;
+		}
+		list->size++;
+	}
+	if (error < GIT_SUCCESS && error != GIT_EREVWALKOVER) {
+		TRACE_ERROR(ctx, "git_revwalk_next", error);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, list));
+}
+
+static ITRNEXT kgit_revwalk_itrnext(CTX ctx, ksfp_t *sfp, long rtnidx)
+{
+	kRawPtr *po = (kRawPtr *)DP(ITR(sfp))->source;
+	git_oid oid;
+	if (po->rawptr != NULL && kgit_revwalk_next((kgit_revwalk *)po->rawptr, &oid) == GIT_SUCCESS) {
+		ITRNEXT_(new_GitOid(ctx, &oid));
+	}
+	ITREND_();
+}
+
+/* Iterate over the commits of the revision walk, as in
+ * foreach (GitOid oid in walk) { ... } */
+//## @Native Iterator<GitOid> GitRevwalk.opITR();
+KMETHOD GitRevwalk_opITR(CTX ctx, ksfp_t *sfp _RIX)
+{
+	RETURN_(new_Iterator(ctx, knh_getcid(ctx, STEXT("GitOid")), sfp[0].o, kgit_revwalk_itrnext));
 }
 
 /* Mark a commit to start traversal from. */
 //## @Native void GitRevwalk.push(GitOid oid);
 KMETHOD GitRevwalk_push(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_revwalk *walk = RawPtr_to(git_revwalk *, sfp[0]);
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
 	const git_oid *oid = RawPtr_to(const git_oid *, sfp[1]);
-	int error = git_revwalk_push(walk, oid);
+	int error = git_revwalk_push(w->walk, oid);
+	if (error == GIT_SUCCESS) {
+		error = kgit_revwalk_tip(w, oid, 0);
+	}
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_revwalk_push", error);
 	}
@@ -144,26 +1482,79 @@ KMETHOD GitRevwalk_push(CTX ctx, ksfp_t *sfp _RIX)
 //## @Native GitRepository GitRevwalk.repository();
 KMETHOD GitRevwalk_repository(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_revwalk *walk = RawPtr_to(git_revwalk *, sfp[0]);
-	RETURN_(new_ReturnRawPtr(ctx, sfp, git_revwalk_repository(walk)));
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	RETURN_(new_ReturnRawPtr(ctx, sfp, git_revwalk_repository(w->walk)));
 }
 
 /* Reset the revision walker for reuse. */
 //## @Native void GitRevwalk.reset();
 KMETHOD GitRevwalk_reset(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_revwalk *walker = RawPtr_to(git_revwalk *, sfp[0]);
-	git_revwalk_reset(walker);
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	git_revwalk_reset(w->walk);
+	kgit_revwalk_clear(w);
+	free(w->cursor);
+	w->cursor = NULL;
+	w->cursorsize = 0;
+	w->ntips = 0;
+	w->started = 0;
+	w->native = 0;
+	RETURNvoid_();
+}
+
+/* Go on with the walk a cursor() was taken from, before this one starts.
+ * Set the same sorting and limits as that walk had; maxCount() counts from
+ * here, which gives the next page. The cursor takes the place of the pushed
+ * and hidden commits: a resumed walk ignores them, so it may be set up just
+ * as the first page was. */
+//## @Native void GitRevwalk.resume(String cursor);
+KMETHOD GitRevwalk_resume(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	int error = (w->started || w->prepared) ? GIT_EINVALIDARGS : kgit_revwalk_setcursor(w, S_totext(sfp[1].s));
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_revwalk_resume", error);
+	}
+	RETURNvoid_();
+}
+
+/* Only yield commits made at or after 'time' (seconds since the epoch),
+ * as git log --since does. The walk ends at the first older commit it
+ * reaches, since every commit left in its queue is older still. A negative
+ * time removes the bound. Set it before the walk starts. */
+//## @Native void GitRevwalk.since(int time);
+KMETHOD GitRevwalk_since(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	kint_t time = Int_to(kint_t, sfp[1]);
+	w->since = (time >= 0) ? (git_time_t)time : -1;
 	RETURNvoid_();
 }
 
-/* Change the sorting mode when iterating through the repository's contents. */
+/* Change the sorting mode when iterating through the repository's contents.
+ * It may also hold walk modes: GitSort.FIRST_PARENT only follows the first
+ * parent of merges, as git log --first-parent does, and GitSort.MERGES or
+ * GitSort.NO_MERGES only yield merges, or all but merges. Set it before
+ * the walk starts. */
 //## @Native void GitRevwalk.sorting(int sort_mode);
 KMETHOD GitRevwalk_sorting(CTX ctx, ksfp_t *sfp _RIX)
 {
-	git_revwalk *walk = RawPtr_to(git_revwalk *, sfp[0]);
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
 	unsigned int sort_mode = Int_to(unsigned int, sfp[1]);
-	git_revwalk_sorting(walk, sort_mode);
+	git_revwalk_sorting(w->walk, sort_mode & ~KGIT_SORT_MODES);
+	w->sorting = sort_mode;
+	RETURNvoid_();
+}
+
+/* Skip the commits made after 'time' (seconds since the epoch), as git log
+ * --until does; their history is still walked. A negative time removes the
+ * bound. Set it before the walk starts. */
+//## @Native void GitRevwalk.until(int time);
+KMETHOD GitRevwalk_until(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_revwalk *w = RawPtr_to(kgit_revwalk *, sfp[0]);
+	kint_t time = Int_to(kint_t, sfp[1]);
+	w->until = (time >= 0) ? (git_time_t)time : -1;
 	RETURNvoid_();
 }
 
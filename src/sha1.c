@@ -0,0 +1,135 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <string.h>
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Plain SHA-1 (FIPS 180-1) for checksums over index and pack files, which
+ * libgit2 does not export. */
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void kgit_sha1_block(kgit_sha1_ctx *c, const unsigned char *p)
+{
+	uint32_t w[80], a, b, d, e, f, k, t, cc;
+	int i;
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+			((uint32_t)p[i * 4 + 2] << 8) | (uint32_t)p[i * 4 + 3];
+	}
+	for (i = 16; i < 80; i++) {
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+	a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3]; e = c->h[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & cc) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ cc ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & cc) | (b & d) | (cc & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ cc ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d; d = cc; cc = ROL(b, 30); b = a; a = t;
+	}
+	c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d; c->h[4] += e;
+}
+
+void kgit_sha1_init(kgit_sha1_ctx *c)
+{
+	c->h[0] = 0x67452301;
+	c->h[1] = 0xEFCDAB89;
+	c->h[2] = 0x98BADCFE;
+	c->h[3] = 0x10325476;
+	c->h[4] = 0xC3D2E1F0;
+	c->len = 0;
+}
+
+void kgit_sha1_update(kgit_sha1_ctx *c, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	size_t used = (size_t)(c->len & 63);
+	c->len += len;
+	if (used > 0) {
+		size_t n = 64 - used;
+		if (len < n) {
+			memcpy(c->buf + used, p, len);
+			return;
+		}
+		memcpy(c->buf + used, p, n);
+		kgit_sha1_block(c, c->buf);
+		p += n;
+		len -= n;
+	}
+	for (; len >= 64; p += 64, len -= 64) {
+		kgit_sha1_block(c, p);
+	}
+	memcpy(c->buf, p, len);
+}
+
+void kgit_sha1_final(git_oid *out, kgit_sha1_ctx *c)
+{
+	unsigned char pad[72];
+	uint64_t bits = c->len * 8;
+	size_t used = (size_t)(c->len & 63);
+	size_t n = (used < 56) ? 56 - used : 120 - used;
+	int i;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++) {
+		pad[n + i] = (unsigned char)(bits >> (56 - i * 8));
+	}
+	kgit_sha1_update(c, pad, n + 8);
+	for (i = 0; i < 5; i++) {
+		out->id[i * 4] = (unsigned char)(c->h[i] >> 24);
+		out->id[i * 4 + 1] = (unsigned char)(c->h[i] >> 16);
+		out->id[i * 4 + 2] = (unsigned char)(c->h[i] >> 8);
+		out->id[i * 4 + 3] = (unsigned char)c->h[i];
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,411 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+/* A flattened tree keeps every blob of a tree in a handful of contiguous
+ * arrays. Directory paths are stored once in the string table and shared by
+ * all of their entries, so a path costs its own name plus two offsets. The
+ * entries are kept in git order, which for full paths is plain byte order. */
+typedef struct kgit_snapshot {
+	char *strings;
+	size_t strings_size;
+	size_t strings_capacity;
+	uint32_t *dirs;
+	uint32_t *names;
+	uint32_t *attrs;
+	git_oid *oids;
+	size_t size;
+	size_t capacity;
+} kgit_snapshot;
+
+typedef struct kgit_pathbuf {
+	char *ptr;
+	size_t capacity;
+} kgit_pathbuf;
+
+static void kgit_snapshot_free(CTX ctx, kgit_snapshot *snap)
+{
+	free(snap->strings);
+	free(snap->dirs);
+	free(snap->names);
+	free(snap->attrs);
+	free(snap->oids);
+	KNH_FREE(ctx, snap, sizeof(kgit_snapshot));
+}
+
+/* Append a string to the string table; returns its offset or -1. */
+static long kgit_snapshot_intern(kgit_snapshot *snap, const char *a, size_t alen, const char *b, size_t blen)
+{
+	size_t len = alen + ((alen > 0 && blen > 0) ? 1 : 0) + blen + 1;
+	if (snap->strings_size + len > snap->strings_capacity) {
+		size_t capacity = (snap->strings_capacity == 0) ? 4096 : snap->strings_capacity;
+		while (snap->strings_size + len > capacity) {
+			capacity *= 2;
+		}
+		char *strings = (char *)realloc(snap->strings, capacity);
+		if (strings == NULL) {
+			return -1;
+		}
+		snap->strings = strings;
+		snap->strings_capacity = capacity;
+	}
+	long offset = (long)snap->strings_size;
+	char *p = snap->strings + offset;
+	memcpy(p, a, alen);
+	p += alen;
+	if (alen > 0 && blen > 0) {
+		*p++ = '/';
+	}
+	memcpy(p, b, blen);
+	p[blen] = '\0';
+	snap->strings_size += len;
+	return offset;
+}
+
+static int kgit_snapshot_push(kgit_snapshot *snap, uint32_t dir, const git_tree_entry *entry)
+{
+	if (snap->size == snap->capacity) {
+		size_t capacity = (snap->capacity == 0) ? 256 : snap->capacity * 2;
+		uint32_t *dirs = (uint32_t *)realloc(snap->dirs, capacity * sizeof(uint32_t));
+		if (dirs != NULL) snap->dirs = dirs;
+		uint32_t *names = (uint32_t *)realloc(snap->names, capacity * sizeof(uint32_t));
+		if (names != NULL) snap->names = names;
+		uint32_t *attrs = (uint32_t *)realloc(snap->attrs, capacity * sizeof(uint32_t));
+		if (attrs != NULL) snap->attrs = attrs;
+		git_oid *oids = (git_oid *)realloc(snap->oids, capacity * sizeof(git_oid));
+		if (oids != NULL) snap->oids = oids;
+		if (dirs == NULL || names == NULL || attrs == NULL || oids == NULL) {
+			return GIT_ENOMEM;
+		}
+		snap->capacity = capacity;
+	}
+	const char *name = git_tree_entry_name(entry);
+	long offset = kgit_snapshot_intern(snap, name, strlen(name), "", 0);
+	if (offset < 0) {
+		return GIT_ENOMEM;
+	}
+	snap->dirs[snap->size] = dir;
+	snap->names[snap->size] = (uint32_t)offset;
+	snap->attrs[snap->size] = git_tree_entry_attributes(entry);
+	git_oid_cpy(&snap->oids[snap->size], git_tree_entry_id(entry));
+	snap->size++;
+	return GIT_SUCCESS;
+}
+
+static int kgit_snapshot_walk(kgit_snapshot *snap, git_repository *repo, git_tree *tree, uint32_t dir)
+{
+	unsigned int i, n = git_tree_entrycount(tree);
+	int error = GIT_SUCCESS;
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		const git_tree_entry *entry = git_tree_entry_byindex(tree, i);
+		if (GIT_ATTR_ISDIR(git_tree_entry_attributes(entry))) {
+			git_tree *subtree;
+			const char *name = git_tree_entry_name(entry);
+			/* the string table may move; re-read the base after interning */
+			size_t dirlen = strlen(snap->strings + dir);
+			char *base = strndup(snap->strings + dir, dirlen);
+			if (base == NULL) {
+				return GIT_ENOMEM;
+			}
+			long subdir = kgit_snapshot_intern(snap, base, dirlen, name, strlen(name));
+			free(base);
+			if (subdir < 0) {
+				return GIT_ENOMEM;
+			}
+			error = git_tree_lookup(&subtree, repo, git_tree_entry_id(entry));
+			if (error < GIT_SUCCESS) {
+				return error;
+			}
+			error = kgit_snapshot_walk(snap, repo, subtree, (uint32_t)subdir);
+			git_tree_close(subtree);
+		} else {
+			error = kgit_snapshot_push(snap, dir, entry);
+		}
+	}
+	return error;
+}
+
+static const char *kgit_snapshot_path(const kgit_snapshot *snap, size_t n, kgit_pathbuf *buf)
+{
+	const char *dir = snap->strings + snap->dirs[n];
+	const char *name = snap->strings + snap->names[n];
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	size_t len = dlen + nlen + 2;
+	if (dlen == 0) {
+		return name;
+	}
+	if (len > buf->capacity) {
+		char *ptr = (char *)realloc(buf->ptr, len);
+		if (ptr == NULL) {
+			return NULL;
+		}
+		buf->ptr = ptr;
+		buf->capacity = len;
+	}
+	memcpy(buf->ptr, dir, dlen);
+	buf->ptr[dlen] = '/';
+	memcpy(buf->ptr + dlen + 1, name, nlen + 1);
+	return buf->ptr;
+}
+
+/* Compare the path of the n-th entry with 'path' without building it. */
+static int kgit_snapshot_cmp(const kgit_snapshot *snap, size_t n, const char *path)
+{
+	const unsigned char *dir = (const unsigned char *)snap->strings + snap->dirs[n];
+	const unsigned char *name = (const unsigned char *)snap->strings + snap->names[n];
+	const unsigned char *p = (const unsigned char *)path;
+	if (*dir != '\0') {
+		for (; *dir != '\0'; dir++, p++) {
+			if (*dir != *p) {
+				return (int)*dir - (int)*p;
+			}
+		}
+		if (*p != '/') {
+			return (int)'/' - (int)*p;
+		}
+		p++;
+	}
+	for (; *name != '\0'; name++, p++) {
+		if (*name != *p) {
+			return (int)*name - (int)*p;
+		}
+	}
+	return -(int)*p;
+}
+
+static long kgit_snapshot_find(const kgit_snapshot *snap, const char *path)
+{
+	size_t lo = 0, hi = snap->size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = kgit_snapshot_cmp(snap, mid, path);
+		if (cmp == 0) {
+			return (long)mid;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+/* Merge two snapshots in a single linear pass. */
+static int kgit_snapshot_diff(kgit_diff *diff, const kgit_snapshot *a, const kgit_snapshot *b)
+{
+	kgit_pathbuf pa = {NULL, 0}, pb = {NULL, 0};
+	size_t i = 0, j = 0;
+	int error = GIT_SUCCESS;
+	while (error == GIT_SUCCESS && (i < a->size || j < b->size)) {
+		const char *path_a = (i < a->size) ? kgit_snapshot_path(a, i, &pa) : NULL;
+		const char *path_b = (j < b->size) ? kgit_snapshot_path(b, j, &pb) : NULL;
+		int cmp;
+		if ((i < a->size && path_a == NULL) || (j < b->size && path_b == NULL)) {
+			error = GIT_ENOMEM;
+			break;
+		}
+		cmp = (path_a == NULL) ? 1 : (path_b == NULL) ? -1 : strcmp(path_a, path_b);
+		if (cmp < 0) {
+			error = kgit_diff_push(diff, GIT_DELTA_DELETED, path_a, &a->oids[i], a->attrs[i], NULL, 0);
+			i++;
+		} else if (cmp > 0) {
+			error = kgit_diff_push(diff, GIT_DELTA_ADDED, path_b, NULL, 0, &b->oids[j], b->attrs[j]);
+			j++;
+		} else {
+			if (git_oid_cmp(&a->oids[i], &b->oids[j]) != 0 || a->attrs[i] != b->attrs[j]) {
+				error = kgit_diff_push(diff, GIT_DELTA_MODIFIED, path_a, &a->oids[i], a->attrs[i], &b->oids[j], b->attrs[j]);
+			}
+			i++;
+			j++;
+		}
+	}
+	free(pa.ptr);
+	free(pb.ptr);
+	return error;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void kGitTreeSnapshot_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitTreeSnapshot_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_snapshot_free(ctx, (kgit_snapshot *)po->rawptr);
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitTreeSnapshot(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitTreeSnapshot";
+	cdef->init = kGitTreeSnapshot_init;
+	cdef->free = kGitTreeSnapshot_free;
+}
+
+static long GitTreeSnapshot_index(ksfp_t *sfp)
+{
+	kgit_snapshot *snap = RawPtr_to(kgit_snapshot *, sfp[0]);
+	kint_t n = Int_to(kint_t, sfp[1]);
+	if (snap == NULL || n < 0 || (size_t)n >= snap->size) {
+		return -1;
+	}
+	return (long)n;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Flatten a tree and all of its subtrees into a snapshot of blob entries */
+//## @Native GitTreeSnapshot GitTree.flatten(GitRepository repo);
+KMETHOD GitTree_flatten(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_tree *tree = RawPtr_to(git_tree *, sfp[0]);
+	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	if (tree == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	kgit_snapshot *snap = (kgit_snapshot *)KNH_MALLOC(ctx, sizeof(kgit_snapshot));
+	memset(snap, 0, sizeof(kgit_snapshot));
+	int error = GIT_SUCCESS;
+	if (kgit_snapshot_intern(snap, "", 0, "", 0) < 0) {
+		error = GIT_ENOMEM;
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_snapshot_walk(snap, repo, tree, 0);
+	}
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_tree_lookup", error);
+		kgit_snapshot_free(ctx, snap);
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, snap));
+}
+
+/* Get the UNIX file attributes of the n-th entry */
+//## @Native int GitTreeSnapshot.attributes(int n);
+KMETHOD GitTreeSnapshot_attributes(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_snapshot *snap = RawPtr_to(kgit_snapshot *, sfp[0]);
+	long n = GitTreeSnapshot_index(sfp);
+	RETURNi_((n >= 0) ? snap->attrs[n] : 0);
+}
+
+/* Compute the changes from this snapshot to another one */
+//## @Native GitDiff GitTreeSnapshot.diff(GitTreeSnapshot other);
+KMETHOD GitTreeSnapshot_diff(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_snapshot *a = RawPtr_to(kgit_snapshot *, sfp[0]);
+	kgit_snapshot *b = RawPtr_to(kgit_snapshot *, sfp[1]);
+	if (a == NULL || b == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	kgit_diff *diff = kgit_diff_new(ctx);
+	int error = kgit_snapshot_diff(diff, a, b);
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "kgit_snapshot_diff", error);
+		kgit_diff_free(ctx, diff);
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, diff));
+}
+
+/* Find the position of an entry by its full path, or -1 */
+//## @Native int GitTreeSnapshot.find(String path);
+KMETHOD GitTreeSnapshot_find(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_snapshot *snap = RawPtr_to(kgit_snapshot *, sfp[0]);
+	const char *path = String_to(const char *, sfp[1]);
+	if (snap == NULL) {
+		RETURNi_(-1);
+	}
+	RETURNi_(kgit_snapshot_find(snap, path));
+}
+
+/* Free a snapshot */
+//## @Native void GitTreeSnapshot.free();
+KMETHOD GitTreeSnapshot_free(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kGitTreeSnapshot_free(ctx, sfp[0].p);
+	RETURNvoid_();
+}
+
+/* Get the id of the n-th entry */
+//## @Native GitOid GitTreeSnapshot.id(int n);
+KMETHOD GitTreeSnapshot_id(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_snapshot *snap = RawPtr_to(kgit_snapshot *, sfp[0]);
+	long n = GitTreeSnapshot_index(sfp);
+	if (n < 0) {
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_GitOidCopy(ctx, sfp, &snap->oids[n]));
+}
+
+/* Get the full path of the n-th entry */
+//## @Native String GitTreeSnapshot.path(int n);
+KMETHOD GitTreeSnapshot_path(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_pathbuf buf = {NULL, 0};
+	kgit_snapshot *snap = RawPtr_to(kgit_snapshot *, sfp[0]);
+	long n = GitTreeSnapshot_index(sfp);
+	const char *path = (n >= 0) ? kgit_snapshot_path(snap, n, &buf) : NULL;
+	if (path == NULL) {
+		RETURN_(KNH_TNULL(String));
+	}
+	kString *s = new_String(ctx, path);
+	free(buf.ptr);
+	RETURN_(s);
+}
+
+/* Get the number of entries in a snapshot */
+//## @Native int GitTreeSnapshot.size();
+KMETHOD GitTreeSnapshot_size(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_snapshot *snap = RawPtr_to(kgit_snapshot *, sfp[0]);
+	RETURNi_((snap != NULL) ? snap->size : 0);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,546 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* A split index keeps most entries in a shared index file that rarely
+ * changes, named sharedindex.<checksum> next to the index. The index file
+ * itself only lists what differs from it and a "link" extension holding the
+ * id of the shared file and two bitmaps over its entries: the entries that
+ * were deleted and the entries that were replaced. Replaced entries come
+ * first in the index file, in shared order and without their path; entries
+ * that are not in the shared file follow. This is the layout git uses, so
+ * either can read what the other wrote.
+ *
+ * libgit2 neither reads nor writes this extension, so both directions are
+ * handled here: a split index is expanded into a git_index on read, and on
+ * write the entries are compared with the shared file kept in memory. */
+
+#define KGIT_ENTRY_FIXED          62
+#define KGIT_ENTRY_EXTENDED       0x4000
+#define KGIT_ENTRY_EXTENDED_FLAGS 0x6000
+#define KGIT_ENTRY_NAMEMASK       0x0fff
+/* rewrite the shared index when more than this percentage of it changed */
+#define KGIT_SPLIT_MAX_CHANGE     20
+#define KGIT_SPLIT_ADDED          1
+#define KGIT_SPLIT_REPLACED       2
+
+struct kgit_indexfile {
+	unsigned char *data;
+	size_t size;
+	int version;
+	size_t count;
+	uint32_t *offsets;
+	size_t extensions;
+	git_oid id;
+};
+
+void kgit_indexfile_free(kgit_indexfile *file)
+{
+	if (file != NULL) {
+		free(file->data);
+		free(file->offsets);
+		free(file);
+	}
+}
+
+/* Take ownership of an index file image and find its entries. */
+static kgit_indexfile *kgit_indexfile_parse(unsigned char *data, size_t size)
+{
+	kgit_indexfile *file = (kgit_indexfile *)calloc(1, sizeof(kgit_indexfile));
+	if (file == NULL) {
+		free(data);
+		return NULL;
+	}
+	file->data = data;
+	file->size = size;
+	if (size >= 12 + GIT_OID_RAWSZ) {
+		file->version = (int)kgit_be32(data + 4);
+		file->count = kgit_be32(data + 8);
+		file->offsets = (uint32_t *)malloc((file->count + 1) * sizeof(uint32_t));
+	}
+	if (file->offsets == NULL || (file->extensions = kgit_indexfile_extensions(data, size, file->offsets)) == 0) {
+		kgit_indexfile_free(file);
+		return NULL;
+	}
+	git_oid_fromraw(&file->id, data + size - GIT_OID_RAWSZ);
+	return file;
+}
+
+static kgit_indexfile *kgit_indexfile_load(const char *path)
+{
+	size_t size;
+	unsigned char *data = kgit_readfile(path, &size);
+	return (data != NULL) ? kgit_indexfile_parse(data, size) : NULL;
+}
+
+static const unsigned char *kgit_indexfile_extension(const kgit_indexfile *file, const char *signature, uint32_t *len)
+{
+	size_t off = file->extensions, end = file->size - GIT_OID_RAWSZ;
+	while (off + 8 <= end) {
+		*len = kgit_be32(file->data + off + 4);
+		if (off + 8 + *len > end) {
+			break;
+		}
+		if (memcmp(file->data + off, signature, 4) == 0) {
+			return file->data + off + 8;
+		}
+		off += 8 + *len;
+	}
+	return NULL;
+}
+
+static uint16_t kgit_be16(const unsigned char *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static size_t kgit_indexfile_fixed(const kgit_indexfile *file, size_t n)
+{
+	const unsigned char *p = file->data + file->offsets[n];
+	return (file->version == 3 && (p[60] & 0x40)) ? KGIT_ENTRY_FIXED + 2 : KGIT_ENTRY_FIXED;
+}
+
+static const char *kgit_indexfile_path(const kgit_indexfile *file, size_t n)
+{
+	return (const char *)file->data + file->offsets[n] + kgit_indexfile_fixed(file, n);
+}
+
+/* Decode the n-th entry; the path points into the file image. */
+static void kgit_indexfile_entry(const kgit_indexfile *file, size_t n, git_index_entry *e)
+{
+	const unsigned char *p = file->data + file->offsets[n];
+	memset(e, 0, sizeof(git_index_entry));
+	e->ctime.seconds = kgit_be32(p);
+	e->ctime.nanoseconds = kgit_be32(p + 4);
+	e->mtime.seconds = kgit_be32(p + 8);
+	e->mtime.nanoseconds = kgit_be32(p + 12);
+	e->dev = kgit_be32(p + 16);
+	e->ino = kgit_be32(p + 20);
+	e->mode = kgit_be32(p + 24);
+	e->uid = kgit_be32(p + 28);
+	e->gid = kgit_be32(p + 32);
+	e->file_size = kgit_be32(p + 36);
+	git_oid_fromraw(&e->oid, p + 40);
+	e->flags = kgit_be16(p + 60);
+	if (kgit_indexfile_fixed(file, n) > KGIT_ENTRY_FIXED) {
+		e->flags_extended = kgit_be16(p + 62);
+	}
+	e->path = (char *)kgit_indexfile_path(file, n);
+}
+
+/* Encode the fixed part of an entry as it is stored in a file of the given
+ * version; returns its length. */
+static size_t kgit_entry_encode(unsigned char *p, const git_index_entry *e, size_t namelen, int version)
+{
+	unsigned int flags = (e->flags & ~(KGIT_ENTRY_EXTENDED | KGIT_ENTRY_NAMEMASK)) |
+		((namelen < KGIT_ENTRY_NAMEMASK) ? namelen : KGIT_ENTRY_NAMEMASK);
+	unsigned int extended = e->flags_extended & KGIT_ENTRY_EXTENDED_FLAGS;
+	if (version >= 3 && extended != 0) {
+		flags |= KGIT_ENTRY_EXTENDED;
+	}
+	kgit_put_be32(p, (uint32_t)e->ctime.seconds);
+	kgit_put_be32(p + 4, e->ctime.nanoseconds);
+	kgit_put_be32(p + 8, (uint32_t)e->mtime.seconds);
+	kgit_put_be32(p + 12, e->mtime.nanoseconds);
+	kgit_put_be32(p + 16, e->dev);
+	kgit_put_be32(p + 20, e->ino);
+	kgit_put_be32(p + 24, e->mode);
+	kgit_put_be32(p + 28, e->uid);
+	kgit_put_be32(p + 32, e->gid);
+	kgit_put_be32(p + 36, (uint32_t)e->file_size);
+	memcpy(p + 40, e->oid.id, GIT_OID_RAWSZ);
+	p[60] = (unsigned char)(flags >> 8);
+	p[61] = (unsigned char)flags;
+	if (flags & KGIT_ENTRY_EXTENDED) {
+		p[62] = (unsigned char)(extended >> 8);
+		p[63] = (unsigned char)extended;
+		return KGIT_ENTRY_FIXED + 2;
+	}
+	return KGIT_ENTRY_FIXED;
+}
+
+/* Append an entry; a stripped entry is written without its path. */
+static int kgit_entry_put(kgit_buf *buf, const git_index_entry *e, int strip, int version)
+{
+	static const unsigned char padding[8] = {0};
+	unsigned char fixed[KGIT_ENTRY_FIXED + 2];
+	size_t namelen = strip ? 0 : strlen(e->path);
+	size_t len = kgit_entry_encode(fixed, e, namelen, version);
+	size_t pad = ((len + namelen + 8) & ~(size_t)7) - (len + namelen);
+	int error = kgit_buf_put(buf, fixed, len);
+	if (error == GIT_SUCCESS) {
+		error = kgit_buf_put(buf, e->path, namelen);
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_buf_put(buf, padding, pad);
+	}
+	return error;
+}
+
+static int kgit_indexfile_header(kgit_buf *buf, int version, size_t count)
+{
+	unsigned char header[12];
+	memcpy(header, "DIRC", 4);
+	kgit_put_be32(header + 4, (uint32_t)version);
+	kgit_put_be32(header + 8, (uint32_t)count);
+	return kgit_buf_put(buf, header, 12);
+}
+
+static int kgit_indexfile_trailer(kgit_buf *buf, git_oid *id)
+{
+	kgit_sha1_ctx sha1;
+	kgit_sha1_init(&sha1);
+	kgit_sha1_update(&sha1, buf->ptr, buf->size);
+	kgit_sha1_final(id, &sha1);
+	return kgit_buf_put(buf, id->id, GIT_OID_RAWSZ);
+}
+
+static int kgit_entry_cmp(const void *a, const void *b)
+{
+	const git_index_entry *ea = *(const git_index_entry **)a;
+	const git_index_entry *eb = *(const git_index_entry **)b;
+	int cmp = strcmp(ea->path, eb->path);
+	return (cmp != 0) ? cmp : git_index_entry_stage(ea) - git_index_entry_stage(eb);
+}
+
+/* Collect the entries of an index in file order; returns the file version
+ * they need, or -1. */
+static int kgit_index_entries(git_index *index, git_index_entry ***out, size_t *count)
+{
+	size_t i, n = git_index_entrycount(index);
+	int version = 2;
+	git_index_entry **entries = (git_index_entry **)malloc((n + 1) * sizeof(git_index_entry *));
+	if (entries == NULL) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		entries[i] = git_index_get(index, (unsigned int)i);
+		if (entries[i]->flags_extended & KGIT_ENTRY_EXTENDED_FLAGS) {
+			version = 3;
+		}
+	}
+	qsort(entries, n, sizeof(git_index_entry *), kgit_entry_cmp);
+	*out = entries;
+	*count = n;
+	return version;
+}
+
+static char *kgit_sharedindex_path(const char *index_path, const git_oid *id)
+{
+	const char *slash = strrchr(index_path, '/');
+	size_t dirlen = (slash != NULL) ? (size_t)(slash - index_path) + 1 : 0;
+	char *path = (char *)malloc(dirlen + sizeof("sharedindex.") + GIT_OID_HEXSZ);
+	if (path != NULL) {
+		memcpy(path, index_path, dirlen);
+		memcpy(path + dirlen, "sharedindex.", sizeof("sharedindex.") - 1);
+		git_oid_fmt(path + dirlen + sizeof("sharedindex.") - 1, id);
+		path[dirlen + sizeof("sharedindex.") - 1 + GIT_OID_HEXSZ] = '\0';
+	}
+	return path;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Return the path of the shared index an index file is split against, or
+ * NULL when the file is not split. */
+char *kgit_splitindex_shared(const char *index_path)
+{
+	uint32_t len;
+	char *path = NULL;
+	kgit_indexfile *file = kgit_indexfile_load(index_path);
+	if (file == NULL) {
+		return NULL;
+	}
+	const unsigned char *link = kgit_indexfile_extension(file, "link", &len);
+	if (link != NULL && len >= GIT_OID_RAWSZ) {
+		git_oid id;
+		git_oid_fromraw(&id, link);
+		path = kgit_sharedindex_path(index_path, &id);
+	}
+	kgit_indexfile_free(file);
+	return path;
+}
+
+/* Replace the entries of 'index' with those of the split index file at
+ * 'path'. '*shared' caches the shared index between calls. Returns
+ * GIT_ENOTFOUND when the file is not split, unless 'plain' is set: libgit2
+ * would then read another file than 'path', so the plain file is loaded
+ * here too. */
+int kgit_splitindex_read(git_index *index, const char *path, kgit_indexfile **shared, int plain)
+{
+	kgit_bitmap deleted = {NULL, 0}, replaced = {NULL, 0};
+	kgit_indexfile *base = NULL, *file = kgit_indexfile_load(path);
+	git_index_entry e;
+	size_t i, j = 0;
+	uint32_t len;
+	int error = GIT_SUCCESS;
+	if (file == NULL) {
+		return GIT_ENOTFOUND;
+	}
+	const unsigned char *link = kgit_indexfile_extension(file, "link", &len);
+	if (link == NULL || len < GIT_OID_RAWSZ) {
+		if (!plain) {
+			kgit_indexfile_free(file);
+			return GIT_ENOTFOUND;
+		}
+		git_index_clear(index);
+		for (j = 0; j < file->count && error == GIT_SUCCESS; j++) {
+			kgit_indexfile_entry(file, j, &e);
+			error = git_index_append2(index, &e);
+		}
+		kgit_indexfile_free(*shared);
+		*shared = NULL;
+		kgit_indexfile_free(file);
+		return error;
+	}
+	if (len > GIT_OID_RAWSZ) {
+		long used = kgit_ewah_read(&deleted, link + GIT_OID_RAWSZ, len - GIT_OID_RAWSZ);
+		long rest = (used < 0) ? -1 : kgit_ewah_read(&replaced, link + GIT_OID_RAWSZ + used, len - GIT_OID_RAWSZ - used);
+		if (rest < 0 || GIT_OID_RAWSZ + used + rest != len) {
+			error = GIT_EOBJCORRUPTED;
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		git_oid id;
+		git_oid_fromraw(&id, link);
+		if (*shared != NULL && git_oid_cmp(&(*shared)->id, &id) == 0) {
+			base = *shared;
+		} else {
+			char *shared_path = kgit_sharedindex_path(path, &id);
+			base = (shared_path != NULL) ? kgit_indexfile_load(shared_path) : NULL;
+			free(shared_path);
+			if (base == NULL) {
+				error = GIT_ENOTFOUND;
+			}
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		git_index_clear(index);
+	}
+	for (i = 0; error == GIT_SUCCESS && i < base->count; i++) {
+		if (kgit_bitmap_get(&deleted, i)) {
+			continue;
+		}
+		if (kgit_bitmap_get(&replaced, i)) {
+			if (j >= file->count || *kgit_indexfile_path(file, j) != '\0') {
+				error = GIT_EOBJCORRUPTED;
+				break;
+			}
+			kgit_indexfile_entry(file, j++, &e);
+			e.path = (char *)kgit_indexfile_path(base, i);
+			e.flags = (e.flags & ~KGIT_ENTRY_NAMEMASK) | (kgit_be16(base->data + base->offsets[i] + 60) & KGIT_ENTRY_NAMEMASK);
+		} else {
+			kgit_indexfile_entry(base, i, &e);
+		}
+		error = git_index_append2(index, &e);
+	}
+	for (; error == GIT_SUCCESS && j < file->count; j++) {
+		if (*kgit_indexfile_path(file, j) == '\0') {
+			error = GIT_EOBJCORRUPTED;
+			break;
+		}
+		kgit_indexfile_entry(file, j, &e);
+		error = git_index_append2(index, &e);
+	}
+	if (base != NULL && base != *shared) {
+		if (error == GIT_SUCCESS) {
+			kgit_indexfile_free(*shared);
+			*shared = base;
+		} else {
+			kgit_indexfile_free(base);
+		}
+	}
+	kgit_bitmap_free(&deleted);
+	kgit_bitmap_free(&replaced);
+	kgit_indexfile_free(file);
+	return error;
+}
+
+/* Write every entry of an index to a plain index file image. */
+static int kgit_indexfile_build(kgit_buf *buf, git_index_entry **entries, size_t n, int version, git_oid *id)
+{
+	size_t i;
+	int error = kgit_indexfile_header(buf, version, n);
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		error = kgit_entry_put(buf, entries[i], 0, version);
+	}
+	return (error == GIT_SUCCESS) ? kgit_indexfile_trailer(buf, id) : error;
+}
+
+/* Write a new shared index holding every entry and make it the base. */
+static int kgit_sharedindex_write(const char *index_path, git_index_entry **entries, size_t n, int version, kgit_indexfile **shared)
+{
+	kgit_buf buf = {NULL, 0, 0};
+	git_oid id;
+	int error = kgit_indexfile_build(&buf, entries, n, version, &id);
+	char *path = (error == GIT_SUCCESS) ? kgit_sharedindex_path(index_path, &id) : NULL;
+	if (error == GIT_SUCCESS) {
+		error = (path != NULL) ? kgit_writefile(path, buf.ptr, buf.size) : GIT_ENOMEM;
+	}
+	free(path);
+	if (error < GIT_SUCCESS) {
+		free(buf.ptr);
+		return error;
+	}
+	kgit_indexfile *base = kgit_indexfile_parse(buf.ptr, buf.size);
+	if (base == NULL) {
+		return GIT_ENOMEM;
+	}
+	kgit_indexfile_free(*shared);
+	*shared = base;
+	return GIT_SUCCESS;
+}
+
+/* Write 'index' to 'path'. When 'split' is set, only the entries that differ
+ * from the shared index are written, and the shared index is rewritten when
+ * it is missing or too much of it changed. Otherwise a plain index file is
+ * written and '*shared' is released. */
+int kgit_splitindex_write(git_index *index, const char *path, kgit_indexfile **shared, int split)
+{
+	kgit_bitmap deleted = {NULL, 0}, replaced = {NULL, 0};
+	kgit_buf buf = {NULL, 0, 0};
+	git_index_entry **entries;
+	unsigned char fixed[KGIT_ENTRY_FIXED + 2], ext[8];
+	size_t i, j, n, nreplaced = 0, ndeleted = 0, nadded = 0;
+	char *kind = NULL; /* KGIT_SPLIT_ADDED or KGIT_SPLIT_REPLACED per entry */
+	git_oid id;
+	int error = GIT_SUCCESS, version = kgit_index_entries(index, &entries, &n);
+	kgit_indexfile *base = *shared;
+	if (version < 0) {
+		return GIT_ENOMEM;
+	}
+	if (!split) {
+		kgit_indexfile_free(*shared);
+		*shared = NULL;
+		error = kgit_indexfile_build(&buf, entries, n, version, &id);
+		if (error == GIT_SUCCESS) {
+			error = kgit_writefile(path, buf.ptr, buf.size);
+		}
+		free(buf.ptr);
+		free(entries);
+		return error;
+	}
+	if (base != NULL && base->version == version) {
+		/* compare with the shared index; both sides are in file order */
+		kind = (char *)calloc(n + 1, 1);
+		if (kind == NULL || kgit_bitmap_init(&deleted, base->count) < GIT_SUCCESS ||
+				kgit_bitmap_init(&replaced, base->count) < GIT_SUCCESS) {
+			error = GIT_ENOMEM;
+		}
+		for (i = 0, j = 0; error == GIT_SUCCESS && (i < base->count || j < n);) {
+			int cmp;
+			if (i == base->count) {
+				cmp = 1;
+			} else if (j == n) {
+				cmp = -1;
+			} else {
+				git_index_entry e;
+				kgit_indexfile_entry(base, i, &e);
+				const git_index_entry *pe = &e;
+				cmp = kgit_entry_cmp(&pe, &entries[j]);
+			}
+			if (cmp < 0) {
+				kgit_bitmap_set(&deleted, i++);
+				ndeleted++;
+			} else if (cmp > 0) {
+				kind[j++] = KGIT_SPLIT_ADDED;
+				nadded++;
+			} else {
+				size_t len = kgit_entry_encode(fixed, entries[j], strlen(entries[j]->path), version);
+				if (len != kgit_indexfile_fixed(base, i) || memcmp(fixed, base->data + base->offsets[i], len) != 0) {
+					kgit_bitmap_set(&replaced, i);
+					kind[j] = KGIT_SPLIT_REPLACED;
+					nreplaced++;
+				}
+				i++;
+				j++;
+			}
+		}
+	}
+	if (error == GIT_SUCCESS && (base == NULL || base->version != version ||
+			(nreplaced + ndeleted + nadded) * 100 > base->count * KGIT_SPLIT_MAX_CHANGE)) {
+		kgit_bitmap_free(&deleted);
+		kgit_bitmap_free(&replaced);
+		error = kgit_sharedindex_write(path, entries, n, version, shared);
+		nreplaced = nadded = 0;
+		base = *shared;
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_indexfile_header(&buf, version, nreplaced + nadded);
+	}
+	/* replaced entries first, then the new ones; entries and the shared
+	 * index are in the same order, so the former come out in shared order */
+	for (j = 0; error == GIT_SUCCESS && nreplaced > 0 && j < n; j++) {
+		if (kind[j] == KGIT_SPLIT_REPLACED) {
+			error = kgit_entry_put(&buf, entries[j], 1, version);
+		}
+	}
+	for (j = 0; error == GIT_SUCCESS && nadded > 0 && j < n; j++) {
+		if (kind[j] == KGIT_SPLIT_ADDED) {
+			error = kgit_entry_put(&buf, entries[j], 0, version);
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		size_t start = buf.size;
+		memcpy(ext, "link", 4);
+		error = kgit_buf_put(&buf, ext, 8);
+		if (error == GIT_SUCCESS) error = kgit_buf_put(&buf, base->id.id, GIT_OID_RAWSZ);
+		/* git expects both bitmaps, empty ones after a new shared index */
+		if (error == GIT_SUCCESS) error = kgit_ewah_write(&buf, &deleted);
+		if (error == GIT_SUCCESS) error = kgit_ewah_write(&buf, &replaced);
+		if (error == GIT_SUCCESS) {
+			kgit_put_be32(buf.ptr + start + 4, (uint32_t)(buf.size - start - 8));
+			error = kgit_indexfile_trailer(&buf, &id);
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_writefile(path, buf.ptr, buf.size);
+	}
+	kgit_bitmap_free(&deleted);
+	kgit_bitmap_free(&replaced);
+	free(buf.ptr);
+	free(kind);
+	free(entries);
+	return error;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
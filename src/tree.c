@@ -29,6 +29,7 @@
 //  chen_ji - Takuma Wakamori, Yokohama National University, Japan
 // **************************************************************************
 
+#include <pthread.h>
 #include <konoha1.h>
 #include "libgit2.h"
 
@@ -36,6 +37,137 @@
 extern "C" {
 #endif
 
+/* ------------------------------------------------------------------------ */
+/* Name index: an open addressing table from entry name to entry position,
+ * kept beside a git_tree once GitTree.useNameIndex(true) asks for it and
+ * built on the first lookup by name. It goes with the GitTree that holds
+ * the tree; other trees use libgit2's binary search. Lookups share a read
+ * lock, so they run in parallel. */
+
+#define KGIT_NAMEINDEX_BUCKETS 64
+
+typedef struct kgit_nameindex {
+	struct kgit_nameindex *next;
+	const git_tree *tree;
+	uint32_t mask;
+	uint32_t *slots; /* entry position + 1, or 0 when empty; NULL until built */
+} kgit_nameindex;
+
+static kgit_nameindex *nameindexes[KGIT_NAMEINDEX_BUCKETS];
+static pthread_rwlock_t nameindex_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define kgit_nameindex_bucket(tree)  ((((uintptr_t)(tree)) >> 4) % KGIT_NAMEINDEX_BUCKETS)
+
+static uint32_t kgit_name_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+	for (; *name != '\0'; name++) {
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	}
+	return h;
+}
+
+/* must be called with nameindex_lock held */
+static kgit_nameindex *kgit_nameindex_get(const git_tree *tree)
+{
+	kgit_nameindex *index;
+	for (index = nameindexes[kgit_nameindex_bucket(tree)]; index != NULL; index = index->next) {
+		if (index->tree == tree) {
+			return index;
+		}
+	}
+	return NULL;
+}
+
+/* must be called with nameindex_lock held for writing */
+static int kgit_nameindex_build(kgit_nameindex *index, git_tree *tree)
+{
+	unsigned int i, n = git_tree_entrycount(tree);
+	uint32_t size = 1;
+	while (size < n * 2) {
+		size <<= 1;
+	}
+	if ((index->slots = (uint32_t *)calloc(size, sizeof(uint32_t))) == NULL) {
+		return GIT_ENOMEM;
+	}
+	index->mask = size - 1;
+	for (i = 0; i < n; i++) {
+		uint32_t h = kgit_name_hash(git_tree_entry_name(git_tree_entry_byindex(tree, i))) & index->mask;
+		while (index->slots[h] != 0) {
+			h = (h + 1) & index->mask;
+		}
+		index->slots[h] = i + 1;
+	}
+	return GIT_SUCCESS;
+}
+
+static int kgit_nameindex_add(const git_tree *tree)
+{
+	kgit_nameindex *index;
+	int error = GIT_SUCCESS;
+	pthread_rwlock_wrlock(&nameindex_lock);
+	if (kgit_nameindex_get(tree) == NULL) {
+		if ((index = (kgit_nameindex *)calloc(1, sizeof(kgit_nameindex))) != NULL) {
+			index->tree = tree;
+			index->next = nameindexes[kgit_nameindex_bucket(tree)];
+			nameindexes[kgit_nameindex_bucket(tree)] = index;
+		} else {
+			error = GIT_ENOMEM;
+		}
+	}
+	pthread_rwlock_unlock(&nameindex_lock);
+	return error;
+}
+
+static void kgit_nameindex_drop(const git_tree *tree)
+{
+	kgit_nameindex **p;
+	pthread_rwlock_wrlock(&nameindex_lock);
+	for (p = &nameindexes[kgit_nameindex_bucket(tree)]; *p != NULL; p = &(*p)->next) {
+		if ((*p)->tree == tree) {
+			kgit_nameindex *index = *p;
+			*p = index->next;
+			free(index->slots);
+			free(index);
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&nameindex_lock);
+}
+
+/* Lookup a tree entry by its filename, through the name index when the tree
+ * has one. */
+const git_tree_entry *kgit_tree_entry_byname(git_tree *tree, const char *filename)
+{
+	const git_tree_entry *entry = NULL;
+	kgit_nameindex *index;
+	pthread_rwlock_rdlock(&nameindex_lock);
+	index = kgit_nameindex_get(tree);
+	if (index != NULL && index->slots == NULL) {
+		pthread_rwlock_unlock(&nameindex_lock);
+		pthread_rwlock_wrlock(&nameindex_lock);
+		/* another thread may have built or dropped it meanwhile */
+		index = kgit_nameindex_get(tree);
+		if (index != NULL && index->slots == NULL && kgit_nameindex_build(index, tree) < GIT_SUCCESS) {
+			index = NULL;
+		}
+	}
+	if (index == NULL) {
+		pthread_rwlock_unlock(&nameindex_lock);
+		return git_tree_entry_byname(tree, filename);
+	}
+	uint32_t h = kgit_name_hash(filename) & index->mask;
+	for (; index->slots[h] != 0; h = (h + 1) & index->mask) {
+		const git_tree_entry *e = git_tree_entry_byindex(tree, index->slots[h] - 1);
+		if (strcmp(git_tree_entry_name(e), filename) == 0) {
+			entry = e;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&nameindex_lock);
+	return entry;
+}
+
 /* ------------------------------------------------------------------------ */
 
 static void kGitTree_init(CTX ctx, kRawPtr *po)
@@ -46,6 +178,7 @@ static void kGitTree_init(CTX ctx, kRawPtr *po)
 static void kGitTree_free(CTX ctx, kRawPtr *po)
 {
 	if (po->rawptr != NULL) {
+		kgit_nameindex_drop((git_tree *)po->rawptr);
 		git_tree_close((git_tree *)po->rawptr);
 		po->rawptr = NULL;
 	}
@@ -78,6 +211,251 @@ DEFAPI(void) defGitTreeEntry(CTX ctx, kclass_t cid, kclassdef_t *cdef)
 	cdef->free = kGitTreeEntry_free;
 }
 
+/* ------------------------------------------------------------------------ */
+/* Subtree cache: (tree id, component) -> (child id, attributes), kept per
+ * repository. Tree objects are immutable, so entries never go stale; the
+ * table is simply cleared when it grows past KGIT_TREECACHE_MAX. */
+
+#define KGIT_TREECACHE_MAX     (1 << 18)
+#define KGIT_TREECACHE_INITIAL (1 << 10)
+
+typedef struct kgit_treecache_entry {
+	struct kgit_treecache_entry *next;
+	unsigned int hash;
+	git_oid tree;
+	git_oid child;
+	unsigned int attr;
+	size_t namelen;
+	char name[1];
+} kgit_treecache_entry;
+
+typedef struct kgit_treecache {
+	struct kgit_treecache *next;
+	git_repository *repo;
+	kgit_treecache_entry **buckets;
+	size_t nbuckets;
+	size_t size;
+} kgit_treecache;
+
+static kgit_treecache *treecaches = NULL;
+static pthread_mutex_t treecache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int kgit_treecache_hash(const git_oid *tree, const char *name, size_t namelen)
+{
+	unsigned int h = 2166136261U;
+	size_t i;
+	for (i = 0; i < GIT_OID_RAWSZ; i++) {
+		h = (h ^ tree->id[i]) * 16777619U;
+	}
+	for (i = 0; i < namelen; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619U;
+	}
+	return h;
+}
+
+static void kgit_treecache_clear(kgit_treecache *cache)
+{
+	size_t i;
+	for (i = 0; i < cache->nbuckets; i++) {
+		kgit_treecache_entry *e = cache->buckets[i];
+		while (e != NULL) {
+			kgit_treecache_entry *next = e->next;
+			free(e);
+			e = next;
+		}
+		cache->buckets[i] = NULL;
+	}
+	cache->size = 0;
+}
+
+static kgit_treecache *kgit_treecache_get(git_repository *repo)
+{
+	kgit_treecache *cache;
+	for (cache = treecaches; cache != NULL; cache = cache->next) {
+		if (cache->repo == repo) {
+			return cache;
+		}
+	}
+	cache = (kgit_treecache *)calloc(1, sizeof(kgit_treecache));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->buckets = (kgit_treecache_entry **)calloc(KGIT_TREECACHE_INITIAL, sizeof(kgit_treecache_entry *));
+	if (cache->buckets == NULL) {
+		free(cache);
+		return NULL;
+	}
+	cache->repo = repo;
+	cache->nbuckets = KGIT_TREECACHE_INITIAL;
+	cache->next = treecaches;
+	treecaches = cache;
+	return cache;
+}
+
+static void kgit_treecache_grow(kgit_treecache *cache)
+{
+	size_t nbuckets = cache->nbuckets * 2, i;
+	kgit_treecache_entry **buckets = (kgit_treecache_entry **)calloc(nbuckets, sizeof(kgit_treecache_entry *));
+	if (buckets == NULL) {
+		return;
+	}
+	for (i = 0; i < cache->nbuckets; i++) {
+		kgit_treecache_entry *e = cache->buckets[i];
+		while (e != NULL) {
+			kgit_treecache_entry *next = e->next;
+			e->next = buckets[e->hash & (nbuckets - 1)];
+			buckets[e->hash & (nbuckets - 1)] = e;
+			e = next;
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->nbuckets = nbuckets;
+}
+
+static int kgit_treecache_lookup(git_repository *repo, const git_oid *tree, const char *name, size_t namelen, git_oid *child, unsigned int *attr)
+{
+	int found = 0;
+	unsigned int hash = kgit_treecache_hash(tree, name, namelen);
+	pthread_mutex_lock(&treecache_lock);
+	kgit_treecache *cache = kgit_treecache_get(repo);
+	if (cache != NULL) {
+		kgit_treecache_entry *e;
+		for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e != NULL; e = e->next) {
+			if (e->hash == hash && e->namelen == namelen &&
+					memcmp(e->name, name, namelen) == 0 && git_oid_cmp(&e->tree, tree) == 0) {
+				git_oid_cpy(child, &e->child);
+				*attr = e->attr;
+				found = 1;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&treecache_lock);
+	return found;
+}
+
+static void kgit_treecache_store(git_repository *repo, const git_oid *tree, const char *name, size_t namelen, const git_oid *child, unsigned int attr)
+{
+	unsigned int hash = kgit_treecache_hash(tree, name, namelen);
+	kgit_treecache_entry *e = (kgit_treecache_entry *)malloc(sizeof(kgit_treecache_entry) + namelen);
+	if (e == NULL) {
+		return;
+	}
+	e->hash = hash;
+	git_oid_cpy(&e->tree, tree);
+	git_oid_cpy(&e->child, child);
+	e->attr = attr;
+	e->namelen = namelen;
+	memcpy(e->name, name, namelen);
+	e->name[namelen] = '\0';
+	pthread_mutex_lock(&treecache_lock);
+	kgit_treecache *cache = kgit_treecache_get(repo);
+	if (cache == NULL) {
+		pthread_mutex_unlock(&treecache_lock);
+		free(e);
+		return;
+	}
+	if (cache->size >= KGIT_TREECACHE_MAX) {
+		kgit_treecache_clear(cache);
+	} else if (cache->size >= cache->nbuckets) {
+		kgit_treecache_grow(cache);
+	}
+	e->next = cache->buckets[hash & (cache->nbuckets - 1)];
+	cache->buckets[hash & (cache->nbuckets - 1)] = e;
+	cache->size++;
+	pthread_mutex_unlock(&treecache_lock);
+}
+
+/* Forget the subtree cache of a repository that is being freed. */
+void kgit_treecache_drop(git_repository *repo)
+{
+	kgit_treecache **p;
+	pthread_mutex_lock(&treecache_lock);
+	for (p = &treecaches; *p != NULL; p = &(*p)->next) {
+		if ((*p)->repo == repo) {
+			kgit_treecache *cache = *p;
+			*p = cache->next;
+			kgit_treecache_clear(cache);
+			free(cache->buckets);
+			free(cache);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&treecache_lock);
+}
+
+/* Resolve a slash separated path below the tree 'root' to the id and
+ * attributes of the entry it names, one cache probe per component. An empty
+ * path resolves to the root itself. When the caller has the root open as
+ * 'roottree', its first component is searched there, through the name
+ * index of that tree if it has one. */
+int kgit_tree_resolve(git_repository *repo, const git_oid *root, git_tree *roottree, const char *path, git_oid *out, unsigned int *attr)
+{
+	git_oid cur;
+	unsigned int cur_attr = GIT_ATTR_DIR;
+	git_oid_cpy(&cur, root);
+	while (*path != '\0') {
+		const char *end;
+		size_t namelen;
+		git_oid child;
+		unsigned int child_attr;
+		while (*path == '/') path++;
+		if (*path == '\0') break;
+		end = strchr(path, '/');
+		namelen = (end != NULL) ? (size_t)(end - path) : strlen(path);
+		if (!GIT_ATTR_ISDIR(cur_attr)) {
+			return GIT_ENOTFOUND;
+		}
+		if (roottree != NULL) {
+			const git_tree_entry *entry;
+			char *name = strndup(path, namelen);
+			if (name == NULL) {
+				return GIT_ENOMEM;
+			}
+			entry = kgit_tree_entry_byname(roottree, name);
+			free(name);
+			if (entry == NULL) {
+				return GIT_ENOTFOUND;
+			}
+			git_oid_cpy(&child, git_tree_entry_id(entry));
+			child_attr = git_tree_entry_attributes(entry);
+			roottree = NULL;
+		} else if (!kgit_treecache_lookup(repo, &cur, path, namelen, &child, &child_attr)) {
+			git_tree *tree;
+			const git_tree_entry *entry;
+			char *name = strndup(path, namelen);
+			int error;
+			if (name == NULL) {
+				return GIT_ENOMEM;
+			}
+			error = git_tree_lookup(&tree, repo, &cur);
+			if (error < GIT_SUCCESS) {
+				free(name);
+				return error;
+			}
+			entry = kgit_tree_entry_byname(tree, name);
+			free(name);
+			if (entry == NULL) {
+				git_tree_close(tree);
+				return GIT_ENOTFOUND;
+			}
+			git_oid_cpy(&child, git_tree_entry_id(entry));
+			child_attr = git_tree_entry_attributes(entry);
+			git_tree_close(tree);
+			kgit_treecache_store(repo, &cur, path, namelen, &child, child_attr);
+		}
+		git_oid_cpy(&cur, &child);
+		cur_attr = child_attr;
+		path += namelen;
+	}
+	git_oid_cpy(out, &cur);
+	if (attr != NULL) {
+		*attr = cur_attr;
+	}
+	return GIT_SUCCESS;
+}
+
 /* ------------------------------------------------------------------------ */
 
 /* Close an open tree */
@@ -88,13 +466,14 @@ KMETHOD GitTree_close(CTX ctx, ksfp_t *sfp _RIX)
 	RETURNvoid_();
 }
 
-/* Write a tree to the ODB from the index file */
+/* Write a tree to the ODB from the index file. Directories unchanged since
+ * the last call are taken from the index's cache-tree. */
 //## @Native @Static GitOid GitTree.createFromIndex(GitIndex index);
 KMETHOD GitTree_createFromIndex(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_oid *oid = (git_oid *)KNH_MALLOC(ctx, sizeof(git_oid));
 	git_index *index = RawPtr_to(git_index *, sfp[1]);
-	int error = git_tree_create_fromindex(oid, index);
+	int error = kgit_index_write_tree(oid, index);
 	if (error < GIT_SUCCESS) {
 		TRACE_ERROR(ctx, "git_tree_create_fromindex", error);
 		KNH_FREE(ctx, oid, sizeof(git_oid));
@@ -136,7 +515,10 @@ KMETHOD GitTreeEntry_byName(CTX ctx, ksfp_t *sfp _RIX)
 {
 	git_tree *tree = RawPtr_to(git_tree *, sfp[1]);
 	const char *filename = String_to(const char *, sfp[2]);
-	const git_tree_entry *entry = git_tree_entry_byname(tree, filename);
+	if (tree == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	const git_tree_entry *entry = kgit_tree_entry_byname(tree, filename);
 	if (entry == NULL) {
 		KNH_NTRACE2(ctx, "git_tree_entry_byname", K_NOTICE, KNH_LDATA(
 					LOG_msg("not found")));
@@ -173,6 +555,15 @@ KMETHOD GitTreeEntry_type(CTX ctx, ksfp_t *sfp _RIX)
 	RETURNi_(git_tree_entry_type(entry));
 }
 
+/* Check whether a tree has an entry with the given filename */
+//## @Native boolean GitTree.contains(String filename);
+KMETHOD GitTree_contains(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_tree *tree = RawPtr_to(git_tree *, sfp[0]);
+	const char *filename = String_to(const char *, sfp[1]);
+	RETURNb_(tree != NULL && kgit_tree_entry_byname(tree, filename) != NULL);
+}
+
 /* Get the number of entries listed in a tree */
 //## @Native int GitTree.entryCount();
 KMETHOD GitTree_entryCount(CTX ctx, ksfp_t *sfp _RIX)
@@ -184,21 +575,73 @@ KMETHOD GitTree_entryCount(CTX ctx, ksfp_t *sfp _RIX)
 	RETURNi_(git_tree_entrycount(tree));
 }
 
-///* Retrieve the tree object containing a tree entry, given a relative path to
-// * this tree entry */
-////## @Native @Static GitTree GitTree.fromPath(GitTree root, Path treeentry_path);
-//KMETHOD GitTree_fromPath(CTX ctx, ksfp_t *sfp _RIX)
-//{
-//	git_tree *parent_out;
-//	git_tree *tree = RawPtr_to(git_tree *, sfp[1]);
-//	const char *treeentry_path = String_to(const char *, sfp[2]);
-//	int error = git_tree_frompath(&parent_out, tree, treeentry_path);
-//	if (error < GIT_SUCCESS) {
-//		TRACE_ERROR(ctx, "git_tree_frompath", error);
-//		RETURN_(KNH_NULL);
-//	}
-//	RETURN_(new_ReturnRawPtr(ctx, sfp, parent_out));
-//}
+/* Retrieve the tree object containing a tree entry, given a relative path to
+ * this tree entry */
+//## @Native @Static GitTree GitTree.fromPath(GitTree root, String treeentry_path);
+KMETHOD GitTree_fromPath(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_oid id;
+	git_tree *parent_out;
+	git_tree *tree = RawPtr_to(git_tree *, sfp[1]);
+	const char *treeentry_path = String_to(const char *, sfp[2]);
+	if (tree == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	git_repository *repo = git_object_owner((const git_object *)tree);
+	int error = kgit_tree_resolve(repo, git_tree_id(tree), tree, treeentry_path, &id, NULL);
+	if (error == GIT_SUCCESS) {
+		const char *slash = strrchr(treeentry_path, '/');
+		size_t len = (slash != NULL) ? (size_t)(slash - treeentry_path) : 0;
+		char *dirname = strndup(treeentry_path, len);
+		error = (dirname != NULL) ? kgit_tree_resolve(repo, git_tree_id(tree), tree, dirname, &id, NULL) : GIT_ENOMEM;
+		free(dirname);
+	}
+	if (error == GIT_SUCCESS) {
+		error = git_tree_lookup(&parent_out, repo, &id);
+	}
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_tree_frompath", error);
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, parent_out));
+}
+
+/* Get the UNIX file attributes of the entry at a relative path */
+//## @Native int GitTree.attributesByPath(String path);
+KMETHOD GitTree_attributesByPath(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_oid id;
+	unsigned int attr;
+	git_tree *tree = RawPtr_to(git_tree *, sfp[0]);
+	const char *path = String_to(const char *, sfp[1]);
+	if (tree == NULL) {
+		RETURN_(KNH_TNULL(Int));
+	}
+	git_repository *repo = git_object_owner((const git_object *)tree);
+	if (kgit_tree_resolve(repo, git_tree_id(tree), tree, path, &id, &attr) < GIT_SUCCESS) {
+		RETURN_(KNH_TNULL(Int));
+	}
+	RETURNi_(attr);
+}
+
+/* Get the id of the object pointed by the entry at a relative path */
+//## @Native GitOid GitTree.idByPath(String path);
+KMETHOD GitTree_idByPath(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_tree *tree = RawPtr_to(git_tree *, sfp[0]);
+	const char *path = String_to(const char *, sfp[1]);
+	if (tree == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	git_oid *id = (git_oid *)KNH_MALLOC(ctx, sizeof(git_oid));
+	git_repository *repo = git_object_owner((const git_object *)tree);
+	int error = kgit_tree_resolve(repo, git_tree_id(tree), tree, path, id, NULL);
+	if (error < GIT_SUCCESS) {
+		KNH_FREE(ctx, id, sizeof(git_oid));
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, id));
+}
 
 /* Get the id of a tree. */
 //## @Native GitOid GitTree.id();
@@ -241,6 +684,27 @@ KMETHOD GitTree_lookupPrefix(CTX ctx, ksfp_t *sfp _RIX)
 	RETURN_(new_ReturnRawPtr(ctx, sfp, tree));
 }
 
+/* Enable or disable the name index used by GitTreeEntry.byName(),
+ * contains() and the first step of idByPath(), attributesByPath() and
+ * fromPath() from this tree, worth it for trees of thousands of entries
+ * searched many times. The table is built on the first lookup and freed
+ * with the tree. */
+//## @Native void GitTree.useNameIndex(boolean enable);
+KMETHOD GitTree_useNameIndex(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_tree *tree = RawPtr_to(git_tree *, sfp[0]);
+	int enable = Boolean_to(int, sfp[1]);
+	if (tree == NULL) {
+		RETURNvoid_();
+	}
+	if (!enable) {
+		kgit_nameindex_drop(tree);
+	} else if (kgit_nameindex_add(tree) < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_tree_use_name_index", GIT_ENOMEM);
+	}
+	RETURNvoid_();
+}
+
 /* ------------------------------------------------------------------------ */
 
 #ifdef __cplusplus
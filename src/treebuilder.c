@@ -60,6 +60,147 @@ DEFAPI(void) defGitTreebuilder(CTX ctx, kclass_t cid, kclassdef_t *cdef)
 	cdef->free = kGitTreebuilder_free;
 }
 
+/* Sort tree entries in git order: by name, as if subtrees had a trailing
+ * '/', with equal names ordered by their position in the input. */
+static int kgit_entry_cmp(const void *p1, const void *p2)
+{
+	const kgit_entry *a = (const kgit_entry *)p1;
+	const kgit_entry *b = (const kgit_entry *)p2;
+	size_t len = (a->namelen < b->namelen) ? a->namelen : b->namelen;
+	int cmp = memcmp(a->name, b->name, len);
+	if (cmp != 0) {
+		return cmp;
+	}
+	unsigned char ca = (a->namelen > len) ? a->name[len] : (GIT_ATTR_ISDIR(a->attr) ? '/' : '\0');
+	unsigned char cb = (b->namelen > len) ? b->name[len] : (GIT_ATTR_ISDIR(b->attr) ? '/' : '\0');
+	if (ca != cb) {
+		return ca - cb;
+	}
+	return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+/* Sort tree entries by name alone, whatever their kind, then by 'seq' */
+static int kgit_entry_namecmp(const void *p1, const void *p2)
+{
+	const kgit_entry *a = (const kgit_entry *)p1;
+	const kgit_entry *b = (const kgit_entry *)p2;
+	size_t len = (a->namelen < b->namelen) ? a->namelen : b->namelen;
+	int cmp = memcmp(a->name, b->name, len);
+	if (cmp != 0) {
+		return cmp;
+	}
+	if (a->namelen != b->namelen) {
+		return (a->namelen < b->namelen) ? -1 : 1;
+	}
+	return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+static int kgit_entry_valid(const kgit_entry *e)
+{
+	switch (e->attr) {
+	case 0040000: case 0100644: case 0100664: case 0100755: case 0120000: case 0160000:
+		break;
+	default:
+		return 0;
+	}
+	if (e->namelen == 0 || memchr(e->name, '/', e->namelen) != NULL) {
+		return 0;
+	}
+	if ((e->namelen == 1 && e->name[0] == '.') || (e->namelen == 2 && e->name[0] == '.' && e->name[1] == '.')) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Validate, sort and serialize 'n' entries into a tree object and write it
+ * to the object database in one pass. When a name occurs more than once,
+ * as a blob or as a tree, the entry with the highest 'seq' wins. The
+ * entries are reordered in place. */
+int kgit_tree_write(git_oid *out, git_repository *repo, kgit_entry *entries, size_t n)
+{
+	size_t i, m = 0, size = 0, len = 0;
+	for (i = 0; i < n; i++) {
+		if (!kgit_entry_valid(&entries[i])) {
+			return GIT_EINVALIDARGS;
+		}
+	}
+	/* a blob "a" sorts as "a" and a tree "a" as "a/" in git order, so other
+	 * names can fall between two of the same name: drop those first */
+	qsort(entries, n, sizeof(kgit_entry), kgit_entry_namecmp);
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n && entries[i].namelen == entries[i + 1].namelen &&
+				memcmp(entries[i].name, entries[i + 1].name, entries[i].namelen) == 0) {
+			continue;
+		}
+		entries[m++] = entries[i];
+		size += 7 + entries[i].namelen + 1 + GIT_OID_RAWSZ;
+	}
+	qsort(entries, m, sizeof(kgit_entry), kgit_entry_cmp);
+	char *buf = (char *)malloc(size + 1);
+	if (buf == NULL) {
+		return GIT_ENOMEM;
+	}
+	for (i = 0; i < m; i++) {
+		const kgit_entry *e = &entries[i];
+		len += sprintf(buf + len, "%o ", e->attr);
+		memcpy(buf + len, e->name, e->namelen);
+		len += e->namelen;
+		buf[len++] = '\0';
+		memcpy(buf + len, e->oid.id, GIT_OID_RAWSZ);
+		len += GIT_OID_RAWSZ;
+	}
+	int error = git_odb_write(out, git_repository_database(repo), buf, len, GIT_OBJ_TREE);
+	free(buf);
+	return error;
+}
+
+typedef struct kgit_entries {
+	kgit_entry *ptr;
+	size_t size;
+	size_t capacity;
+	int error;
+} kgit_entries;
+
+static int kgit_entries_grow(kgit_entries *list, size_t n)
+{
+	if (list->size + n > list->capacity) {
+		size_t capacity = (list->capacity == 0) ? 64 : list->capacity;
+		while (list->size + n > capacity) {
+			capacity *= 2;
+		}
+		kgit_entry *ptr = (kgit_entry *)realloc(list->ptr, capacity * sizeof(kgit_entry));
+		if (ptr == NULL) {
+			return GIT_ENOMEM;
+		}
+		list->ptr = ptr;
+		list->capacity = capacity;
+	}
+	return GIT_SUCCESS;
+}
+
+/* git_treebuilder_filter callback that copies every entry and keeps it.
+ * The filter cannot be stopped, and a non-zero return would remove the
+ * entry, so a failure is kept in the list and the rest are skipped. */
+static int kgit_entries_collect(const git_tree_entry *entry, void *payload)
+{
+	kgit_entries *list = (kgit_entries *)payload;
+	if (list->error == GIT_SUCCESS && (list->error = kgit_entries_grow(list, 1)) == GIT_SUCCESS) {
+		kgit_entry *e = &list->ptr[list->size];
+		e->name = git_tree_entry_name(entry);
+		e->namelen = strlen(e->name);
+		e->attr = git_tree_entry_attributes(entry);
+		e->seq = list->size;
+		git_oid_cpy(&e->oid, git_tree_entry_id(entry));
+		list->size++;
+	}
+	return 0;
+}
+
+static int kGitTreebuilder_filterBy(const git_tree_entry *entry, void *payload)
+{
+	return kgit_filter_match((const kgit_filter *)payload, entry);
+}
+
 static int kGitTreebuilder_filter(const git_tree_entry *entry, void *payload)
 {
 	CTX lctx = knh_getCurrentContext();
@@ -70,6 +211,40 @@ static int kGitTreebuilder_filter(const git_tree_entry *entry, void *payload)
 	return lsfp[K_RTNIDX].ivalue;
 }
 
+/* Write the entries of a builder, when there is one, together with a batch
+ * of new or updated entries as a tree object. */
+static int kgit_treebuilder_writemany(git_oid *out, git_treebuilder *bld, git_repository *repo, kArray *names, kArray *ids, kArray *attrs)
+{
+	kgit_entries list = {NULL, 0, 0, GIT_SUCCESS};
+	size_t i, n = knh_Array_size(names);
+	int error;
+	if (bld != NULL) {
+		git_treebuilder_filter(bld, kgit_entries_collect, &list);
+	}
+	if ((error = list.error) == GIT_SUCCESS) {
+		error = kgit_entries_grow(&list, n);
+	}
+	for (i = 0; i < n && error == GIT_SUCCESS; i++) {
+		const git_oid *id = (const git_oid *)ids->ptrs[i]->rawptr;
+		kgit_entry *e = &list.ptr[list.size];
+		if (id == NULL) {
+			error = GIT_EINVALIDARGS;
+			break;
+		}
+		e->name = S_totext(names->strings[i]);
+		e->namelen = strlen(e->name);
+		e->attr = (unsigned int)attrs->ilist[i];
+		e->seq = list.size;
+		git_oid_cpy(&e->oid, id);
+		list.size++;
+	}
+	if (error == GIT_SUCCESS) {
+		error = kgit_tree_write(out, repo, list.ptr, list.size);
+	}
+	free(list.ptr);
+	return error;
+}
+
 /* ------------------------------------------------------------------------ */
 
 /* Clear all the entires in the builder */
@@ -106,6 +281,19 @@ KMETHOD GitTreebuilder_filter(CTX ctx, ksfp_t *sfp _RIX)
 	RETURNvoid_();
 }
 
+/* Remove the entries matching a native filter, without calling back into
+ * the VM; use filter() only for conditions a GitTreeFilter cannot express */
+//## @Native void GitTreebuilder.filterBy(GitTreeFilter filter);
+KMETHOD GitTreebuilder_filterBy(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_treebuilder *bld = RawPtr_to(git_treebuilder *, sfp[0]);
+	kgit_filter *filter = RawPtr_to(kgit_filter *, sfp[1]);
+	if (bld != NULL && filter != NULL) {
+		git_treebuilder_filter(bld, kGitTreebuilder_filterBy, filter);
+	}
+	RETURNvoid_();
+}
+
 /* Free a tree builder */
 //## @Native void GitTreebuilder.free();
 KMETHOD GitTreebuilder_free(CTX ctx, ksfp_t *sfp _RIX)
@@ -146,6 +334,43 @@ KMETHOD GitTreebuilder_insert(CTX ctx, ksfp_t *sfp _RIX)
 	RETURN_(new_ReturnRawPtr(ctx, sfp, entry_out));
 }
 
+/* Add or update a batch of entries in the builder at once, sorting and
+ * validating them once instead of per entry, and write the resulting tree
+ * object in the same pass. The builder then holds the entries of that tree.
+ * Returns the id of the tree, or null on error, when the builder is left
+ * as it was. */
+//## @Native GitOid GitTreebuilder.insertMany(GitRepository repo, Array<String> names, Array<GitOid> ids, Array<int> attributes);
+KMETHOD GitTreebuilder_insertMany(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_treebuilder *bld = RawPtr_to(git_treebuilder *, sfp[0]);
+	git_treebuilder *rebuilt = NULL;
+	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	git_tree *tree = NULL;
+	size_t n = knh_Array_size(sfp[2].a);
+	if (knh_Array_size(sfp[3].a) != n || knh_Array_size(sfp[4].a) != n) {
+		KNH_NTRACE2(ctx, "git_treebuilder_insert", K_FAILED, KNH_LDATA(LOG_msg("array size mismatch")));
+		RETURN_(KNH_NULL);
+	}
+	git_oid *oid = (git_oid *)KNH_MALLOC(ctx, sizeof(git_oid));
+	int error = kgit_treebuilder_writemany(oid, bld, repo, sfp[2].a, sfp[3].a, sfp[4].a);
+	/* a builder created from a tree takes its entries without searching,
+	 * unlike one insert after another */
+	if (error == GIT_SUCCESS && (error = git_tree_lookup(&tree, repo, oid)) == GIT_SUCCESS) {
+		error = git_treebuilder_create(&rebuilt, tree);
+		git_tree_close(tree);
+	}
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_treebuilder_insert", error);
+		KNH_FREE(ctx, oid, sizeof(git_oid));
+		RETURN_(KNH_NULL);
+	}
+	if (bld != NULL) {
+		git_treebuilder_free(bld);
+	}
+	sfp[0].p->rawptr = rebuilt;
+	RETURN_(new_ReturnRawPtr(ctx, sfp, oid));
+}
+
 /* Remove an entry from the builder by its filename */
 //## @Native void GitTreebuilder.remove(String filename);
 KMETHOD GitTreebuilder_remove(CTX ctx, ksfp_t *sfp _RIX)
@@ -159,6 +384,29 @@ KMETHOD GitTreebuilder_remove(CTX ctx, ksfp_t *sfp _RIX)
 	RETURNvoid_();
 }
 
+/* Write the contents of the tree builder together with a batch of new or
+ * updated entries as a tree object, sorting and validating the batch once.
+ * The builder itself is left unchanged. */
+//## @Native GitOid GitTreebuilder.writeMany(GitRepository repo, Array<String> names, Array<GitOid> ids, Array<int> attributes);
+KMETHOD GitTreebuilder_writeMany(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_treebuilder *bld = RawPtr_to(git_treebuilder *, sfp[0]);
+	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	size_t n = knh_Array_size(sfp[2].a);
+	if (knh_Array_size(sfp[3].a) != n || knh_Array_size(sfp[4].a) != n) {
+		KNH_NTRACE2(ctx, "git_treebuilder_insert", K_FAILED, KNH_LDATA(LOG_msg("array size mismatch")));
+		RETURN_(KNH_NULL);
+	}
+	git_oid *oid = (git_oid *)KNH_MALLOC(ctx, sizeof(git_oid));
+	int error = kgit_treebuilder_writemany(oid, bld, repo, sfp[2].a, sfp[3].a, sfp[4].a);
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_treebuilder_write", error);
+		KNH_FREE(ctx, oid, sizeof(git_oid));
+		RETURN_(KNH_NULL);
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, oid));
+}
+
 /* Write the contents of the tree builder as a tree object */
 //## @Native GitOid GitTreebuilder.write(GitRepository repo);
 KMETHOD GitTreebuilder_write(CTX ctx, ksfp_t *sfp _RIX)
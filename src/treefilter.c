@@ -0,0 +1,305 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <fnmatch.h>
+#include <regex.h>
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+#define KGIT_FILTER_GLOB  1
+#define KGIT_FILTER_REGEX 2
+#define KGIT_FILTER_MODE  3
+#define KGIT_FILTER_IDS   4
+#define KGIT_FILTER_AND   5
+#define KGIT_FILTER_OR    6
+#define KGIT_FILTER_NOT   7
+
+/* A predicate over tree entries evaluated without entering the VM. Composite
+ * filters own private copies of their operands, so each GitTreeFilter object
+ * can be collected independently. */
+struct kgit_filter {
+	int type;
+	struct kgit_filter *left;
+	struct kgit_filter *right;
+	char *pattern;
+	regex_t re;
+	unsigned int mask;
+	unsigned int value;
+	git_oid *ids;
+	size_t nids;
+};
+
+static void kgit_filter_free(kgit_filter *f)
+{
+	if (f == NULL) {
+		return;
+	}
+	kgit_filter_free(f->left);
+	kgit_filter_free(f->right);
+	if (f->type == KGIT_FILTER_REGEX) {
+		regfree(&f->re);
+	}
+	free(f->pattern);
+	free(f->ids);
+	free(f);
+}
+
+static kgit_filter *kgit_filter_new(int type)
+{
+	kgit_filter *f = (kgit_filter *)calloc(1, sizeof(kgit_filter));
+	if (f != NULL) {
+		f->type = type;
+	}
+	return f;
+}
+
+static kgit_filter *kgit_filter_regex(const char *pattern)
+{
+	kgit_filter *f = kgit_filter_new(KGIT_FILTER_REGEX);
+	if (f == NULL) {
+		return NULL;
+	}
+	f->pattern = strdup(pattern);
+	if (f->pattern == NULL || regcomp(&f->re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+		f->type = KGIT_FILTER_GLOB; /* nothing compiled to regfree */
+		kgit_filter_free(f);
+		return NULL;
+	}
+	return f;
+}
+
+static kgit_filter *kgit_filter_clone(const kgit_filter *src)
+{
+	kgit_filter *f;
+	if (src == NULL) {
+		return NULL;
+	}
+	if (src->type == KGIT_FILTER_REGEX) {
+		return kgit_filter_regex(src->pattern);
+	}
+	f = kgit_filter_new(src->type);
+	if (f == NULL) {
+		return NULL;
+	}
+	f->mask = src->mask;
+	f->value = src->value;
+	if (src->pattern != NULL && (f->pattern = strdup(src->pattern)) == NULL) {
+		goto fail;
+	}
+	if (src->nids > 0) {
+		f->ids = (git_oid *)malloc(src->nids * sizeof(git_oid));
+		if (f->ids == NULL) {
+			goto fail;
+		}
+		memcpy(f->ids, src->ids, src->nids * sizeof(git_oid));
+		f->nids = src->nids;
+	}
+	if (src->left != NULL && (f->left = kgit_filter_clone(src->left)) == NULL) {
+		goto fail;
+	}
+	if (src->right != NULL && (f->right = kgit_filter_clone(src->right)) == NULL) {
+		goto fail;
+	}
+	return f;
+fail:
+	kgit_filter_free(f);
+	return NULL;
+}
+
+static int kgit_oid_qcmp(const void *a, const void *b)
+{
+	return git_oid_cmp((const git_oid *)a, (const git_oid *)b);
+}
+
+/* Return non-zero when the entry satisfies the filter. */
+int kgit_filter_match(const kgit_filter *f, const git_tree_entry *entry)
+{
+	switch (f->type) {
+	case KGIT_FILTER_GLOB:
+		return fnmatch(f->pattern, git_tree_entry_name(entry), 0) == 0;
+	case KGIT_FILTER_REGEX:
+		return regexec(&f->re, git_tree_entry_name(entry), 0, NULL, 0) == 0;
+	case KGIT_FILTER_MODE:
+		return (git_tree_entry_attributes(entry) & f->mask) == f->value;
+	case KGIT_FILTER_IDS:
+		return bsearch(git_tree_entry_id(entry), f->ids, f->nids, sizeof(git_oid), kgit_oid_qcmp) != NULL;
+	case KGIT_FILTER_AND:
+		return kgit_filter_match(f->left, entry) && kgit_filter_match(f->right, entry);
+	case KGIT_FILTER_OR:
+		return kgit_filter_match(f->left, entry) || kgit_filter_match(f->right, entry);
+	case KGIT_FILTER_NOT:
+		return !kgit_filter_match(f->left, entry);
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void kGitTreeFilter_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitTreeFilter_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_filter_free((kgit_filter *)po->rawptr);
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitTreeFilter(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitTreeFilter";
+	cdef->init = kGitTreeFilter_init;
+	cdef->free = kGitTreeFilter_free;
+}
+
+static kgit_filter *kgit_filter_compose(int type, const kgit_filter *left, const kgit_filter *right)
+{
+	kgit_filter *f;
+	if (left == NULL || (right == NULL && type != KGIT_FILTER_NOT)) {
+		return NULL;
+	}
+	f = kgit_filter_new(type);
+	if (f != NULL) {
+		f->left = kgit_filter_clone(left);
+		f->right = kgit_filter_clone(right);
+		if (f->left == NULL || (right != NULL && f->right == NULL)) {
+			kgit_filter_free(f);
+			return NULL;
+		}
+	}
+	return f;
+}
+
+#define RETURN_GitTreeFilter(f) do { \
+		if ((f) == NULL) { \
+			KNH_NTRACE2(ctx, "git_treefilter", K_FAILED, KNH_LDATA(LOG_msg("invalid filter"))); \
+			RETURN_(KNH_NULL); \
+		} \
+		RETURN_(new_ReturnRawPtr(ctx, sfp, (f))); \
+	} while (0)
+
+/* ------------------------------------------------------------------------ */
+
+/* Match entries matching both filters */
+//## @Native GitTreeFilter GitTreeFilter.and(GitTreeFilter other);
+KMETHOD GitTreeFilter_and(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_filter *f = kgit_filter_compose(KGIT_FILTER_AND, RawPtr_to(kgit_filter *, sfp[0]), RawPtr_to(kgit_filter *, sfp[1]));
+	RETURN_GitTreeFilter(f);
+}
+
+/* Match entries whose filename matches a shell wildcard pattern */
+//## @Native @Static GitTreeFilter GitTreeFilter.glob(String pattern);
+KMETHOD GitTreeFilter_glob(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_filter *f = kgit_filter_new(KGIT_FILTER_GLOB);
+	if (f != NULL && (f->pattern = strdup(String_to(const char *, sfp[1]))) == NULL) {
+		kgit_filter_free(f);
+		f = NULL;
+	}
+	RETURN_GitTreeFilter(f);
+}
+
+/* Match entries whose id is one of the given ids */
+//## @Native @Static GitTreeFilter GitTreeFilter.ids(Array<GitOid> ids);
+KMETHOD GitTreeFilter_ids(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kArray *a = sfp[1].a;
+	size_t i, n = knh_Array_size(a);
+	kgit_filter *f = kgit_filter_new(KGIT_FILTER_IDS);
+	if (f != NULL && n > 0) {
+		f->ids = (git_oid *)malloc(n * sizeof(git_oid));
+		if (f->ids == NULL) {
+			kgit_filter_free(f);
+			f = NULL;
+		}
+	}
+	if (f != NULL) {
+		for (i = 0; i < n; i++) {
+			if (a->ptrs[i]->rawptr != NULL) {
+				git_oid_cpy(&f->ids[f->nids++], (const git_oid *)a->ptrs[i]->rawptr);
+			}
+		}
+		qsort(f->ids, f->nids, sizeof(git_oid), kgit_oid_qcmp);
+	}
+	RETURN_GitTreeFilter(f);
+}
+
+/* Match entries whose attributes masked with 'mask' equal 'value' */
+//## @Native @Static GitTreeFilter GitTreeFilter.mode(int mask, int value);
+KMETHOD GitTreeFilter_mode(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_filter *f = kgit_filter_new(KGIT_FILTER_MODE);
+	if (f != NULL) {
+		f->mask = Int_to(unsigned int, sfp[1]);
+		f->value = Int_to(unsigned int, sfp[2]);
+	}
+	RETURN_GitTreeFilter(f);
+}
+
+/* Match entries not matching the filter */
+//## @Native GitTreeFilter GitTreeFilter.not();
+KMETHOD GitTreeFilter_not(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_filter *f = kgit_filter_compose(KGIT_FILTER_NOT, RawPtr_to(kgit_filter *, sfp[0]), NULL);
+	RETURN_GitTreeFilter(f);
+}
+
+/* Match entries matching either filter */
+//## @Native GitTreeFilter GitTreeFilter.or(GitTreeFilter other);
+KMETHOD GitTreeFilter_or(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_filter *f = kgit_filter_compose(KGIT_FILTER_OR, RawPtr_to(kgit_filter *, sfp[0]), RawPtr_to(kgit_filter *, sfp[1]));
+	RETURN_GitTreeFilter(f);
+}
+
+/* Match entries whose filename matches a POSIX extended regular expression */
+//## @Native @Static GitTreeFilter GitTreeFilter.regex(String pattern);
+KMETHOD GitTreeFilter_regex(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_filter *f = kgit_filter_regex(String_to(const char *, sfp[1]));
+	RETURN_GitTreeFilter(f);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,468 @@
+/****************************************************************************
+ * KONOHA COPYRIGHT, LICENSE NOTICE, AND DISCRIMER
+ *
+ * Copyright (c)  2010-      Konoha Team konohaken@googlegroups.com
+ * All rights reserved.
+ *
+ * You may choose one of the following two licenses when you use konoha.
+ * See www.konohaware.org/license.html for further information.
+ *
+ * (1) GNU Lesser General Public License 3.0 (with KONOHA_UNDER_LGPL3)
+ * (2) Konoha Software Foundation License 1.0
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+// **************************************************************************
+// LIST OF CONTRIBUTERS
+//  chen_ji - Takuma Wakamori, Yokohama National University, Japan
+// **************************************************************************
+
+#include <konoha1.h>
+#include "libgit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+/* A tree writer records path updates against a base tree and, on write,
+ * rebuilds only the directories that contain an update, bottom-up. Every
+ * other subtree is reused by id without being read. */
+typedef struct kgit_update {
+	char *path;
+	git_oid oid;
+	unsigned int attr;
+	int remove;
+	size_t seq;
+} kgit_update;
+
+typedef struct kgit_treewriter {
+	git_repository *repo;
+	git_oid base;
+	int has_base;
+	kgit_update *updates;
+	size_t size;
+	size_t capacity;
+} kgit_treewriter;
+
+typedef struct kgit_change {
+	const char *name;
+	size_t namelen;
+	git_oid oid;
+	unsigned int attr;
+	int remove;
+	size_t seq;
+} kgit_change;
+
+static void kgit_treewriter_clear(kgit_treewriter *w)
+{
+	size_t i;
+	for (i = 0; i < w->size; i++) {
+		free(w->updates[i].path);
+	}
+	w->size = 0;
+}
+
+static void kgit_treewriter_free(CTX ctx, kgit_treewriter *w)
+{
+	kgit_treewriter_clear(w);
+	free(w->updates);
+	KNH_FREE(ctx, w, sizeof(kgit_treewriter));
+}
+
+static int kgit_treewriter_add(kgit_treewriter *w, const char *path, const git_oid *oid, unsigned int attr, int remove)
+{
+	while (*path == '/') path++;
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/') len--;
+	if (len == 0 || strstr(path, "//") != NULL) {
+		return GIT_EINVALIDARGS;
+	}
+	if (w->size == w->capacity) {
+		size_t capacity = (w->capacity == 0) ? 16 : w->capacity * 2;
+		kgit_update *updates = (kgit_update *)realloc(w->updates, capacity * sizeof(kgit_update));
+		if (updates == NULL) {
+			return GIT_ENOMEM;
+		}
+		w->updates = updates;
+		w->capacity = capacity;
+	}
+	kgit_update *u = &w->updates[w->size];
+	u->path = strndup(path, len);
+	if (u->path == NULL) {
+		return GIT_ENOMEM;
+	}
+	if (oid != NULL) {
+		git_oid_cpy(&u->oid, oid);
+	}
+	u->attr = attr;
+	u->remove = remove;
+	u->seq = w->size;
+	w->size++;
+	return GIT_SUCCESS;
+}
+
+static int kgit_update_cmp(const void *p1, const void *p2)
+{
+	const kgit_update *a = (const kgit_update *)p1;
+	const kgit_update *b = (const kgit_update *)p2;
+	int cmp = strcmp(a->path, b->path);
+	if (cmp != 0) {
+		return cmp;
+	}
+	return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+static int kgit_change_cmp(const void *p1, const void *p2)
+{
+	const kgit_change *a = (const kgit_change *)p1;
+	const kgit_change *b = (const kgit_change *)p2;
+	size_t len = (a->namelen < b->namelen) ? a->namelen : b->namelen;
+	int cmp = memcmp(a->name, b->name, len);
+	if (cmp != 0) {
+		return cmp;
+	}
+	if (a->namelen != b->namelen) {
+		return (a->namelen < b->namelen) ? -1 : 1;
+	}
+	return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+static const kgit_change *kgit_change_find(const kgit_change *changes, size_t n, const char *name)
+{
+	kgit_change key;
+	key.name = name;
+	key.namelen = strlen(name);
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const kgit_change *c = &changes[mid];
+		size_t len = (c->namelen < key.namelen) ? c->namelen : key.namelen;
+		int cmp = memcmp(c->name, key.name, len);
+		if (cmp == 0 && c->namelen != key.namelen) {
+			cmp = (c->namelen < key.namelen) ? -1 : 1;
+		}
+		if (cmp == 0) {
+			return c;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+/* Rebuild the directory whose updates are updates[lo..hi), each path with
+ * its first 'off' bytes (the directory prefix) already consumed. 'base' is the
+ * previous version of the directory, or NULL. Sets '*empty' instead of
+ * writing a tree when nothing is left in the directory. */
+static int kgit_treewriter_dir(kgit_treewriter *w, const git_oid *base, size_t lo, size_t hi, size_t off, git_oid *out, int *empty)
+{
+	git_tree *tree = NULL;
+	kgit_change *changes = (kgit_change *)calloc(hi - lo, sizeof(kgit_change));
+	kgit_entry *entries = NULL;
+	size_t nchanges = 0, nentries = 0, i = lo, k;
+	unsigned int ntree = 0;
+	int error = GIT_SUCCESS;
+	if (changes == NULL) {
+		return GIT_ENOMEM;
+	}
+	if (base != NULL) {
+		error = git_tree_lookup(&tree, w->repo, base);
+		if (error < GIT_SUCCESS) {
+			free(changes);
+			return error;
+		}
+		ntree = git_tree_entrycount(tree);
+	}
+	while (i < hi && error == GIT_SUCCESS) {
+		const char *rest = w->updates[i].path + off;
+		const char *slash = strchr(rest, '/');
+		kgit_change *c = &changes[nchanges++];
+		if (slash == NULL) {
+			const kgit_update *u = &w->updates[i];
+			c->name = rest;
+			c->namelen = strlen(rest);
+			git_oid_cpy(&c->oid, &u->oid);
+			c->attr = u->attr;
+			c->remove = u->remove;
+			c->seq = u->seq;
+			i++;
+		} else {
+			size_t len = slash - rest, j = i, seq = 0;
+			git_oid child;
+			const git_oid *child_base = NULL;
+			const kgit_change *direct = NULL;
+			int child_empty = 0;
+			while (j < hi && strncmp(w->updates[j].path + off, rest, len) == 0 && w->updates[j].path[off + len] == '/') {
+				if (w->updates[j].seq > seq) seq = w->updates[j].seq;
+				j++;
+			}
+			/* an update of the entry itself sorts before the paths below
+			 * it, among the siblings its name is a prefix of */
+			for (k = nchanges - 1; k > 0 && changes[k - 1].namelen >= len && memcmp(changes[k - 1].name, rest, len) == 0; k--) {
+				if (changes[k - 1].namelen == len) {
+					direct = &changes[k - 1];
+					break;
+				}
+			}
+			if (direct != NULL) {
+				/* the paths below it are all newer; build on what it left */
+				if (!direct->remove && GIT_ATTR_ISDIR(direct->attr)) {
+					child_base = &direct->oid;
+				}
+			} else if (tree != NULL) {
+				char *name = strndup(rest, len);
+				const git_tree_entry *e = (name != NULL) ? kgit_tree_entry_byname(tree, name) : NULL;
+				if (e != NULL && GIT_ATTR_ISDIR(git_tree_entry_attributes(e))) {
+					child_base = git_tree_entry_id(e);
+				}
+				free(name);
+			}
+			error = kgit_treewriter_dir(w, child_base, i, j, off + len + 1, &child, &child_empty);
+			if (error == GIT_SUCCESS && child_empty && child_base == NULL) {
+				/* removals below an entry that is no directory change nothing */
+				nchanges--;
+				i = j;
+				continue;
+			}
+			c->name = rest;
+			c->namelen = len;
+			git_oid_cpy(&c->oid, &child);
+			c->attr = GIT_ATTR_DIR;
+			c->remove = child_empty;
+			c->seq = seq;
+			i = j;
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		qsort(changes, nchanges, sizeof(kgit_change), kgit_change_cmp);
+		entries = (kgit_entry *)malloc((ntree + nchanges + 1) * sizeof(kgit_entry));
+		if (entries == NULL) {
+			error = GIT_ENOMEM;
+		}
+	}
+	if (error == GIT_SUCCESS) {
+		for (k = 0; k < ntree; k++) {
+			const git_tree_entry *e = git_tree_entry_byindex(tree, k);
+			if (kgit_change_find(changes, nchanges, git_tree_entry_name(e)) != NULL) {
+				continue;
+			}
+			kgit_entry *d = &entries[nentries++];
+			d->name = git_tree_entry_name(e);
+			d->namelen = strlen(d->name);
+			d->attr = git_tree_entry_attributes(e);
+			d->seq = 0;
+			git_oid_cpy(&d->oid, git_tree_entry_id(e));
+		}
+		for (k = 0; k < nchanges; k++) {
+			const kgit_change *c = &changes[k];
+			/* only the latest change of a name counts */
+			if (k + 1 < nchanges && c->namelen == changes[k + 1].namelen &&
+					memcmp(c->name, changes[k + 1].name, c->namelen) == 0) {
+				continue;
+			}
+			if (c->remove) {
+				continue;
+			}
+			kgit_entry *d = &entries[nentries++];
+			d->name = c->name;
+			d->namelen = c->namelen;
+			d->attr = c->attr;
+			d->seq = 1;
+			git_oid_cpy(&d->oid, &c->oid);
+		}
+		*empty = (nentries == 0);
+		if (nentries > 0 || off == 0) {
+			error = kgit_tree_write(out, w->repo, entries, nentries);
+		}
+	}
+	free(entries);
+	free(changes);
+	if (tree != NULL) {
+		git_tree_close(tree);
+	}
+	return error;
+}
+
+/* Find the update of the first 'len' bytes of a path among sorted updates */
+static const kgit_update *kgit_update_find(const kgit_update *updates, size_t n, const char *path, size_t len)
+{
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strncmp(updates[mid].path, path, len);
+		if (cmp == 0 && updates[mid].path[len] != '\0') {
+			cmp = 1;
+		}
+		if (cmp == 0) {
+			return &updates[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+static int kgit_treewriter_write(kgit_treewriter *w, git_oid *out)
+{
+	size_t i, n = 0;
+	char *stale;
+	int empty;
+	qsort(w->updates, w->size, sizeof(kgit_update), kgit_update_cmp);
+	/* drop all but the last update of each path */
+	for (i = 0; i < w->size; i++) {
+		if (i + 1 < w->size && strcmp(w->updates[i].path, w->updates[i + 1].path) == 0) {
+			free(w->updates[i].path);
+			continue;
+		}
+		w->updates[n++] = w->updates[i];
+	}
+	w->size = n;
+	/* and those below a directory removed or replaced after them */
+	if ((stale = (char *)calloc(w->size + 1, 1)) == NULL) {
+		return GIT_ENOMEM;
+	}
+	for (i = 0; i < w->size; i++) {
+		const char *slash;
+		for (slash = strchr(w->updates[i].path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+			const kgit_update *u = kgit_update_find(w->updates, w->size, w->updates[i].path, slash - w->updates[i].path);
+			if (u != NULL && u->seq > w->updates[i].seq) {
+				stale[i] = 1;
+				break;
+			}
+		}
+	}
+	for (i = 0, n = 0; i < w->size; i++) {
+		if (stale[i]) {
+			free(w->updates[i].path);
+			continue;
+		}
+		w->updates[n++] = w->updates[i];
+	}
+	w->size = n;
+	free(stale);
+	return kgit_treewriter_dir(w, w->has_base ? &w->base : NULL, 0, w->size, 0, out, &empty);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void kGitTreeWriter_init(CTX ctx, kRawPtr *po)
+{
+	po->rawptr = NULL;
+}
+
+static void kGitTreeWriter_free(CTX ctx, kRawPtr *po)
+{
+	if (po->rawptr != NULL) {
+		kgit_treewriter_free(ctx, (kgit_treewriter *)po->rawptr);
+		po->rawptr = NULL;
+	}
+}
+
+DEFAPI(void) defGitTreeWriter(CTX ctx, kclass_t cid, kclassdef_t *cdef)
+{
+	cdef->name = "GitTreeWriter";
+	cdef->init = kGitTreeWriter_init;
+	cdef->free = kGitTreeWriter_free;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Free a tree writer */
+//## @Native void GitTreeWriter.free();
+KMETHOD GitTreeWriter_free(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kGitTreeWriter_free(ctx, sfp[0].p);
+	RETURNvoid_();
+}
+
+/* Add or update the entry at a relative path; missing directories are
+ * created */
+//## @Native void GitTreeWriter.insert(String path, GitOid id, int attributes);
+KMETHOD GitTreeWriter_insert(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_treewriter *w = RawPtr_to(kgit_treewriter *, sfp[0]);
+	const char *path = String_to(const char *, sfp[1]);
+	const git_oid *id = RawPtr_to(const git_oid *, sfp[2]);
+	unsigned int attributes = Int_to(unsigned int, sfp[3]);
+	int error = (w != NULL && id != NULL) ? kgit_treewriter_add(w, path, id, attributes, 0) : GIT_EINVALIDARGS;
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_treewriter_insert", error);
+	}
+	RETURNvoid_();
+}
+
+/* Create a new tree writer on top of a base tree, which may be null */
+//## @Native GitTreeWriter GitTreeWriter.new(GitRepository repo, GitTree base);
+KMETHOD GitTreeWriter_new(CTX ctx, ksfp_t *sfp _RIX)
+{
+	git_repository *repo = RawPtr_to(git_repository *, sfp[1]);
+	git_tree *base = RawPtr_to(git_tree *, sfp[2]);
+	kgit_treewriter *w = (kgit_treewriter *)KNH_MALLOC(ctx, sizeof(kgit_treewriter));
+	memset(w, 0, sizeof(kgit_treewriter));
+	w->repo = repo;
+	if (base != NULL) {
+		git_oid_cpy(&w->base, git_tree_id(base));
+		w->has_base = 1;
+	}
+	RETURN_(new_ReturnRawPtr(ctx, sfp, w));
+}
+
+/* Remove the entry at a relative path; directories left empty are removed.
+ * A path below an entry that is not a directory is left alone. */
+//## @Native void GitTreeWriter.remove(String path);
+KMETHOD GitTreeWriter_remove(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_treewriter *w = RawPtr_to(kgit_treewriter *, sfp[0]);
+	const char *path = String_to(const char *, sfp[1]);
+	int error = (w != NULL) ? kgit_treewriter_add(w, path, NULL, 0, 1) : GIT_EINVALIDARGS;
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_treewriter_remove", error);
+	}
+	RETURNvoid_();
+}
+
+/* Write the base tree with all recorded updates applied and return the id of
+ * the new root tree. The writer is emptied and rebased on the new root. */
+//## @Native GitOid GitTreeWriter.write();
+KMETHOD GitTreeWriter_write(CTX ctx, ksfp_t *sfp _RIX)
+{
+	kgit_treewriter *w = RawPtr_to(kgit_treewriter *, sfp[0]);
+	if (w == NULL) {
+		RETURN_(KNH_NULL);
+	}
+	git_oid *oid = (git_oid *)KNH_MALLOC(ctx, sizeof(git_oid));
+	int error = kgit_treewriter_write(w, oid);
+	if (error < GIT_SUCCESS) {
+		TRACE_ERROR(ctx, "git_treewriter_write", error);
+		KNH_FREE(ctx, oid, sizeof(git_oid));
+		RETURN_(KNH_NULL);
+	}
+	kgit_treewriter_clear(w);
+	git_oid_cpy(&w->base, oid);
+	w->has_base = 1;
+	RETURN_(new_ReturnRawPtr(ctx, sfp, oid));
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+}
+#endif